@@ -0,0 +1,143 @@
+/* raw vectors backed by memory outside of R (ALTREP)
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+   data1 is an external pointer to altraw_t, data2 is NULL until the
+   vector is materialised (i.e., a writable pointer was requested)
+   and holds a regular raw vector with the copy of the content
+   afterwards. The external memory is released at that point or by
+   the finalizer of data1, whichever comes first.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "altraw.h"
+#include <R_ext/Altrep.h>
+
+typedef struct altraw_s {
+    const void *data; /* NULL once released */
+    R_xlen_t len;
+    altraw_release_t release;
+    void *ctx;
+} altraw_t;
+
+static R_altrep_class_t altraw_class;
+
+static void altraw_release(altraw_t *a) {
+    if (a->data) {
+	a->data = 0;
+	if (a->release)
+	    a->release(a->ctx);
+    }
+}
+
+static void altraw_fin(SEXP sPtr) {
+    altraw_t *a = (altraw_t*) R_ExternalPtrAddr(sPtr);
+    if (a) {
+	altraw_release(a);
+	free(a);
+	R_SetExternalPtrAddr(sPtr, 0);
+    }
+}
+
+#define ALTRAW(X) ((altraw_t*) R_ExternalPtrAddr(R_altrep_data1(X)))
+
+static R_xlen_t altraw_length(SEXP x) {
+    return ALTRAW(x)->len;
+}
+
+static const void *altraw_dataptr_or_null(SEXP x) {
+    SEXP sCopy = R_altrep_data2(x);
+    return (sCopy == R_NilValue) ? ALTRAW(x)->data : RAW(sCopy);
+}
+
+static void *altraw_dataptr(SEXP x, Rboolean writeable) {
+    SEXP sCopy = R_altrep_data2(x);
+    altraw_t *a;
+    if (sCopy != R_NilValue)
+	return RAW(sCopy);
+    a = ALTRAW(x);
+    if (!writeable)
+	return (void*) a->data;
+    /* materialise, R may modify the content */
+    sCopy = allocVector(RAWSXP, a->len);
+    if (a->len)
+	memcpy(RAW(sCopy), a->data, a->len);
+    R_set_altrep_data2(x, sCopy);
+    altraw_release(a);
+    return RAW(sCopy);
+}
+
+static Rbyte altraw_elt(SEXP x, R_xlen_t i) {
+    return ((const Rbyte*) altraw_dataptr_or_null(x))[i];
+}
+
+static R_xlen_t altraw_get_region(SEXP x, R_xlen_t i, R_xlen_t n, Rbyte *buf) {
+    R_xlen_t len = ALTRAW(x)->len;
+    if (i >= len)
+	return 0;
+    if (n > len - i)
+	n = len - i;
+    memcpy(buf, ((const Rbyte*) altraw_dataptr_or_null(x)) + i, n);
+    return n;
+}
+
+static Rboolean altraw_inspect(SEXP x, int pre, int deep, int pvec,
+			       void (*inspect_subtree)(SEXP, int, int, int)) {
+    Rprintf(" osrv raw vector (len=%ld, %s)\n", (long) ALTRAW(x)->len,
+	    (R_altrep_data2(x) == R_NilValue) ? "mapped" : "materialised");
+    return TRUE;
+}
+
+void altraw_init(DllInfo *dll) {
+    altraw_class = R_make_altraw_class("osrv_raw", "osrv", dll);
+    R_set_altrep_Length_method(altraw_class, altraw_length);
+    R_set_altrep_Inspect_method(altraw_class, altraw_inspect);
+    R_set_altvec_Dataptr_method(altraw_class, altraw_dataptr);
+    R_set_altvec_Dataptr_or_null_method(altraw_class, altraw_dataptr_or_null);
+    R_set_altraw_Elt_method(altraw_class, altraw_elt);
+    R_set_altraw_Get_region_method(altraw_class, altraw_get_region);
+}
+
+typedef struct new_arg_s {
+    altraw_t *a; /* NULL once owned by the vector */
+} new_arg_t;
+
+static SEXP altraw_new_(void *arg) {
+    new_arg_t *na = (new_arg_t*) arg;
+    /* the pointer is only set once nothing can fail anymore, until
+       then the finalizer has nothing to release */
+    SEXP sPtr = PROTECT(R_MakeExternalPtr(0, R_NilValue, R_NilValue)), res;
+    R_RegisterCFinalizerEx(sPtr, altraw_fin, TRUE);
+    res = R_new_altrep(altraw_class, sPtr, R_NilValue);
+    R_SetExternalPtrAddr(sPtr, na->a);
+    na->a = 0;
+    UNPROTECT(1);
+    return res;
+}
+
+static void altraw_new_done(void *arg) {
+    new_arg_t *na = (new_arg_t*) arg;
+    if (na->a) {
+	altraw_release(na->a);
+	free(na->a);
+    }
+}
+
+SEXP altraw_new(const void *data, R_xlen_t len, altraw_release_t release, void *ctx) {
+    altraw_t *a = (altraw_t*) malloc(sizeof(altraw_t));
+    new_arg_t na;
+    if (!a) {
+	if (release)
+	    release(ctx);
+	Rf_error("Out of memory");
+    }
+    a->data = data ? data : ((const void*) ""); /* NULL means released */
+    a->len = len;
+    a->release = release;
+    a->ctx = ctx;
+    na.a = a;
+    return R_ExecWithCleanup(altraw_new_, &na, altraw_new_done, &na);
+}
@@ -0,0 +1,28 @@
+/* raw vectors backed by memory outside of R (ALTREP)
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+*/
+
+#ifndef OSRV_ALTRAW_H_
+#define OSRV_ALTRAW_H_
+
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+/* registers the class, called from R_init_osrv() */
+void altraw_init(DllInfo *dll);
+
+/* called once the vector no longer needs the memory */
+typedef void (*altraw_release_t)(void *ctx);
+
+/* creates a raw vector of length len pointing to data. The memory is
+   only read and must stay valid until release(ctx) is called which
+   happens when the vector is garbage-collected or when it is
+   modified: the content is then copied into a regular vector first
+   (so modifications never affect data). If the vector cannot be
+   created release(ctx) is called before the error is raised, so ctx
+   is handed over in any case. */
+SEXP altraw_new(const void *data, R_xlen_t len, altraw_release_t release, void *ctx);
+
+#endif
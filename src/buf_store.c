@@ -0,0 +1,60 @@
+/* Simple Fast Serialisation
+   experimental serialiser focused on speed
+
+   (C)2021 Simon Urbanek <simon.urbanek@R-project.org>
+
+   License: MIT
+
+   Stores into one contiguous buffer: the first pass only computes
+   the size, the second writes the result. Used by the object store
+   to serialise objects at put time which servers cannot serialise
+   on their own (see sfs_needs_r()).
+*/
+
+#include "sfs.h"
+
+struct store_api {
+    store_fn_t store;
+    char *buf;
+    sfs_len_t pos, cap;
+};
+
+/* only writes what fits, but counts everything */
+static void put(store_api_t *api, const void *what, sfs_len_t len) {
+    if (api->buf && api->pos <= api->cap && len <= api->cap - api->pos)
+	memcpy(api->buf + api->pos, what, len);
+    api->pos += len;
+}
+
+static void add(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const void *buf) {
+    sfs_len_t hdr = len;
+    hdr <<= 8;
+    hdr |= ts;
+    if (el > 1)
+	len *= el;
+    if (ts != SFS_DATA)
+	put(api, &hdr, sizeof(hdr));
+    if (buf)
+	put(api, buf, len);
+}
+
+/* returns the buffer (to be released with free()) and sets len,
+   NULL if out of memory or if the passes don't agree (the encoder
+   may run out of memory for its string table in one of them) */
+void *buf_store(SEXP sWhat, sfs_len_t *len) {
+    store_api_t api;
+    memset(&api, 0, sizeof(api));
+    api.store = add;
+    sfs_store(&api, sWhat);
+    if (!(api.buf = (char*) malloc(api.pos ? api.pos : 1)))
+	return 0;
+    api.cap = api.pos;
+    api.pos = 0;
+    sfs_store(&api, sWhat);
+    if (api.pos != api.cap) {
+	free(api.buf);
+	return 0;
+    }
+    *len = api.pos;
+    return api.buf;
+}
@@ -91,6 +91,50 @@ void deps_complete(const char *key) {
     pthread_mutex_unlock(&dep_mutex);    
 }
 
+static int cmp_key(const void *a, const void *b) {
+    return strcmp(*(const char**) a, *(const char**) b);
+}
+
+void deps_complete_items(obj_item_t *items, int n) {
+    const char **keys;
+    depent_t *e;
+    int i, nk = 0;
+    /* nothing to resolve (we hold no lock, but this is no worse than
+       a put that happens just before the dependency is added) */
+    if (!__atomic_load_n(&head, __ATOMIC_RELAXED) || n < 1)
+	return;
+    if (!(keys = (const char**) malloc(sizeof(char*) * n))) {
+	for (i = 0; i < n; i++)
+	    if (items[i].version)
+		deps_complete(items[i].key);
+	return;
+    }
+    for (i = 0; i < n; i++)
+	if (items[i].version)
+	    keys[nk++] = items[i].key;
+    qsort(keys, nk, sizeof(char*), cmp_key);
+    pthread_mutex_lock(&dep_mutex);
+    for (e = head; e; e = e->next)
+	for (i = 0; i < e->nreq; i++)
+	    if (!e->status[i] &&
+		bsearch(&e->keys[i], keys, nk, sizeof(char*), cmp_key))
+		e->status[i] = 1;
+    pthread_mutex_unlock(&dep_mutex);
+    free(keys);
+    /* post the satisfied entries */
+    deps_complete(0);
+}
+
+void deps_notify(const char *key, int msg) {
+    ev_entry_t *ev = ev_create(NULL, strlen(key) + sizeof(int) + 4, NULL);
+    if (ev) {
+	ev_resolved_t *m = (ev_resolved_t*) ev->data;
+	m->msg = msg;
+	strcpy(m->name, key);
+	ev_push(dep_queue, ev, 0);
+    }
+}
+
 /* FIXME: nothing is efficient here - we could sort the deps,
    or hash them or do many other things to make it faster ... */
 int deps_add(const char *name, const char **keys, int n, int msg) {
@@ -29,3 +29,16 @@ int deps_add(const char *name, const char **keys, int n, int msg);
 
 void deps_complete(const char *key);
 
+/* same as deps_complete() for the keys of all items that were stored
+   (version set), in one pass */
+void deps_complete_items(obj_item_t *items, int n);
+
+/* message used for keys evicted from the store ("EVI:") */
+#define DEPS_MSG_EVICTED 0x3a495645
+/* message used for keys that expired ("EXP:") */
+#define DEPS_MSG_EXPIRED 0x3a505845
+
+/* post a notification about key on the queue, it is safe
+   to call from critical regions in obj */
+void deps_notify(const char *key, int msg);
+
@@ -27,8 +27,7 @@ static void add(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const
     sfs_len_t hdr = len, i = 0;
     hdr <<= 8;
     hdr |= ts;
-    n = (int) write(api->s, &hdr, sizeof(hdr));
-    if (n < sizeof(hdr)) {
+    if (ts != SFS_DATA && (n = (int) write(api->s, &hdr, sizeof(hdr))) < sizeof(hdr)) {
 	close(api->s);
 	api->s = -1;
 	Rf_error("Failed to write header (n=%d) %s", n, (n == -1 && errno) ? strerror(errno) : "");
@@ -44,7 +44,8 @@ static void add(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const
     sfs_len_t hdr = len;
     hdr <<= 8;
     hdr |= ts;
-    buf_add(api, &hdr, sizeof(hdr));
+    if (ts != SFS_DATA)
+	buf_add(api, &hdr, sizeof(hdr));
     len *= el;
     if (buf)
 	buf_add(api, buf, len);
@@ -111,6 +111,14 @@ static raw_t *collect_buffers(struct buffer *buf) {
 	return res;
 }
 
+static void *(*body_alloc)(size_t) = malloc;
+static void (*body_free)(void*) = free;
+
+void http_body_allocator(void *(*alloc_fn)(size_t), void (*free_fn)(void*)) {
+	body_alloc = alloc_fn ? alloc_fn : malloc;
+	body_free = free_fn ? free_fn : free;
+}
+
 static void clear_http_request(http_request_t *c)
 {
 	if (c->path) {
@@ -118,7 +126,7 @@ static void clear_http_request(http_request_t *c)
 		c->path = NULL;
 	}
 	if (c->body) {
-		free(c->body);
+		body_free(c->body);
 		c->body = NULL;
 	}
 	if (c->content_type) {
@@ -129,6 +137,10 @@ static void clear_http_request(http_request_t *c)
 		free(c->ws_key);
 		c->ws_key = NULL;
 	}
+	if (c->range) {
+		free(c->range);
+		c->range = NULL;
+	}
 	if (c->ws_protocol) {
 		free(c->ws_protocol);
 		c->ws_protocol = NULL;
@@ -296,7 +308,7 @@ static void http_input_iteration(http_connection_t *c) {
 					DBG(printf(" allocating buffer for body %ld bytes\n", (long) req->content_length));
 					if (req->content_length < 0 ||  /* we are parsing signed so negative numbers are bad */
 						req->content_length > 2147483640 || /* R will currently have issues with body around 2Gb or more, so better to not go there */
-						!(req->body = (char*) malloc(req->content_length + 1 /* allocate an extra termination byte */ ))) {
+						!(req->body = (char*) body_alloc(req->content_length + 1 /* allocate an extra termination byte */ ))) {
 						send_http_response(c, " 413 Request Entity Too Large (request body too big)\r\nConnection: close\r\n\r\n");
 						http_close(c);
 						return;
@@ -466,6 +478,10 @@ static void http_input_iteration(http_connection_t *c) {
 								if (!strncmp(k, "close", 5))
 									req->attr |= CONNECTION_CLOSE;
 							}
+							if (!strcmp(bol, "range")) {
+								if (req->range) free(req->range);
+								req->range = strdup(k);
+							}
 							if (!strcmp(bol, "sec-websocket-key")) {
 								if (req->ws_key) free(req->ws_key);
 								req->ws_key = strdup(k);
@@ -626,6 +642,24 @@ int http_send(http_connection_t *c, const void *buf, size_t len) {
 	return 0;
 }
 
+int http_sendfile(http_connection_t *c, int fd, off_t off, size_t len) {
+	char buf[65536];
+	/* plain sockets can send straight from the file */
+	if (c->send == socket_send)
+		return socket_sendfile(c->s, fd, off, len);
+	while (len) {
+		ssize_t n = pread(fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len, off);
+		int r;
+		if (n < 1)
+			return -1;
+		if ((r = http_send(c, buf, n)))
+			return r;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
 static const char hex[16] = "0123456789abcdef";
 
 int http_send_chunk(http_connection_t *conn, const void *buf, size_t len) {
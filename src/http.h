@@ -48,6 +48,7 @@ typedef struct http_request {
 	char method;                   /* request part, method */
 	int  attr;                     /* connection attributes */
 	char *ws_protocol, *ws_version, *ws_key;
+	char *range;                   /* Range: header (if set) */
 	raw_t *headers;
 } http_request_t;
 
@@ -64,6 +65,12 @@ typedef void(*http_process_callback)(http_request_t *req, http_connection_t *con
    For each request calls the process() callback. */
 int http_connected(SOCKET s, int flags, http_process_callback process);
 
+/* Sets the functions used to allocate and free request bodies
+   (default malloc/free). Consumers that take ownership of the body
+   must release it with the same allocator. Not thread-safe, set it
+   before any connections are served. */
+void http_body_allocator(void *(*alloc_fn)(size_t), void (*free_fn)(void*));
+
 /* the following API can be used inside the process callback */
 
 /* Send HTTP response. If any body payload is required, is must be sent
@@ -83,6 +90,10 @@ int http_response(http_connection_t *conn, int code, const char *txt,
    this way. Return value same as http_response */
 int  http_send(http_connection_t *conn, const void *buf, size_t len);
 
+/* Same as http_send() for len bytes of the file fd starting at off,
+   using sendfile() if the connection is a plain socket */
+int  http_sendfile(http_connection_t *conn, int fd, off_t off, size_t len);
+
 /* send one chunk in Transfer-Encoding: chunked stream.
    Note that last chunk must be of length 0 and finalizes the stream
    (buf is ignored in that case). If you need trailer headers,
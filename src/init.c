@@ -0,0 +1,13 @@
+/* package initialisation
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+*/
+
+#include "altraw.h"
+#include "sfs.h"
+
+void R_init_osrv(DllInfo *dll) {
+    altraw_init(dll);
+    sfs_init();
+}
@@ -56,7 +56,7 @@ static const char *type_name[] = {
   "220", "221", "222", "223", "224", "225", "226", "227", "228", "229",
   "230", "231", "232", "233", "234", "235", "236", "237", "238", "239",
   "240", "241", "242", "243", "244", "245", "246", "247", "248", "249",
-  "250", "251", "252", "253", "254",
+  "250", "DATA", "RSEQ", "ISEQ", "REF",
   "ATTR" };
 
 static lbuf_t *alloc_buf(sfs_len_t size) {
@@ -112,10 +112,12 @@ static void add_buf(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, co
     sfs_len_t hdr = len;
     hdr <<= 8;
     hdr |= ts;
-    buf_add(api, &hdr, sizeof(hdr));
+    if (ts != SFS_DATA)
+	buf_add(api, &hdr, sizeof(hdr));
     if (api->verb)
 	Rprintf("%06lx: [%6s:%06lx/%02lu] ", api->cptr, type_name[ts], len, el);
-    api->cptr += 8;
+    if (ts != SFS_DATA)
+	api->cptr += 8;
     len *= el;
     if (api->verb) {
 	if (buf)
@@ -3,100 +3,2465 @@
    Author and (c) Simon Urbanek <urbanek@R-project.org>
    License: MIT
 
+   The index is a hash table split into OBJ_SHARDS shards, each
+   with its own lock. Each shard uses open addressing with linear
+   probing, the hash of the key is cached in the entry so probing
+   and rehashing don't need to look at the keys.
+
+   Lookups don't take any locks: slot tables are only modified
+   (under the shard lock) with atomic stores and replaced tables
+   as well as removed entries are reclaimed using epoch-based
+   reclamation (EBR). Each thread that reads from the store
+   announces the global epoch it entered in (obj_read_begin()),
+   objects retired at epoch E are reclaimed once no thread is
+   inside a read section that started at or before E. Retired
+   objects are linked through a field embedded in them, so retiring
+   never fails. A thread that cannot allocate its own record (out of
+   memory) uses a shared one which holds the oldest epoch of the
+   threads using it. A read section only attempts reclamation when
+   it ends if it may have held back the oldest retired object or the
+   list has doubled since the last attempt, so readers don't pay for
+   scanning a list that a long read (e.g. a view) keeps from
+   shrinking. Payloads owned by the store are released right
+   away, entries holding R objects are passed to the GC pool which
+   is released on the R thread by obj_gc().
+
+   Putting an existing key replaces the entry in its slot with a
+   single atomic store and retires the old entry, so readers see
+   either the old or the new entry. Each put is assigned a new
+   version from a global counter which allows conditional puts.
+
+   Servers serialise R objects (entries without payload) on their own
+   threads, so they may not use the R API. Objects that cannot be
+   serialised without it (environments, see sfs_needs_r()) are
+   serialised at put time instead and servers send the result.
+
+   Optionally, the store can be given a memory budget for the
+   payloads it owns (i.e., not R objects). Once it is exceeded,
+   entries are evicted by sampling a few candidates in a shard and
+   removing the coldest one according to the policy: GDSF
+   (Greedy-Dual-Size-Frequency - priority is hits/size plus an
+   inflation value which is raised to the priority of each evicted
+   entry), LRU or LFU. The "time" is the version counter, so it
+   only advances with puts. Pinned entries are never evicted.
+
+   If a spill directory is set, evicted payloads are not dropped,
+   but written to a file in that directory instead. The file is
+   mapped and unlinked right away (so it disappears with the map)
+   and the entry is replaced by a copy pointing to the map, so
+   readers don't need to know about it. The spill tier has its
+   own (optional) limit, once it is full entries are evicted from
+   memory as usual. So are entries whose payload is in a shared
+   memory segment, since other processes may be using it.
+
+   Entries are allocated from the slab allocator (slab.c) to avoid
+   heap fragmentation and malloc lock contention with many small
+   objects. Payloads up to OBJ_INLINE_MAX bytes are stored inline,
+   right after the key in the same block. Other payloads owned by
+   the store come from obj_payload_alloc() which maps large ones
+   directly (big_alloc() in slab.c).
+
+   Entries restored from a snapshot (snap.c) point into the map of
+   the snapshot file which is shared by all of them and unmapped
+   once the last one is released. They don't count against the
+   budget, since their pages can be dropped by the kernel at any
+   time, and can be promoted to memory just like spilled entries.
+   Entries of files (obj_put_file()) are the same, except that the
+   map keeps the file open so servers can send the payload directly
+   from the file with sendfile().
+
+   Entries can have a time-to-live. Expiry is driven by a timer
+   thread using a hierarchical timer wheel (OBJ_WHEEL_LEVELS levels
+   of OBJ_WHEEL_SLOTS slots, the first level advances every
+   OBJ_TICK_MS), so scheduling and expiring costs O(1) per entry.
+   The thread sleeps while no timers are scheduled. If it cannot be
+   started, puts expire due entries instead.
+   Timers only reference the key and version, so replaced or removed
+   entries don't need to cancel them. Expired entries are hidden from
+   readers right away even if the timer has not fired yet.
+
+   Besides the default store there can be any number of named stores
+   (namespaces), each with its own shards, budget, policy and
+   statistics. A key <ns>/<key> goes to the namespace <ns> if it
+   exists. Namespaces are kept in a list which is only modified under
+   obj_ns_mutex and read inside read sections, so dropping a namespace
+   just unlinks it and retires the whole store which is released with
+   all its entries once no reader can see it. The spill directory and
+   its limit are shared by all stores.
+
+   Optionally, accesses can be tracked (obj_set_tracking()): entries
+   then record creation and access times and the bytes served, the
+   hottest keys are found with a Space-Saving tracker.
+
+   If publishing to shared memory is on (shm.c), payloads of at least
+   the minimal size are copied into a segment when they are put and
+   the entry uses the segment as its payload, which is published in
+   the shared index under the full key (with the shard lock held, so
+   replacements are published in order). The segment is unpublished
+   when the entry is released.
+
+   Optionally, payloads owned by the store can be deduplicated
+   (obj_set_dedup()): the content of payloads of at least the
+   minimal size is hashed when they are put and entries with
+   identical payloads share a single copy (a blob) which is
+   reference-counted and released with the last entry using it.
+   Blobs are found by hash and verified by comparing the content,
+   so hash collisions only cost a comparison. The budget still
+   counts the full size of each entry.
+
+   Readers can pin a view of the store (obj_view_begin()), i.e., the
+   state after a given version. While views exist, replaced entries
+   are not retired but kept in a chain of older versions behind the
+   new entry, so obj_get_at() can find the newest version that
+   belongs to the view. Versions are assigned and installed under a
+   shared (read) lock of obj_commit_lock which views only take
+   exclusively for the moment it takes to read the version counter,
+   so all versions up to that of the view are visible. obj_commit()
+   puts several keys with a single version under the same lock, so
+   views see either all or none of them. Older versions that no view
+   can see are trimmed when a key is replaced and when a view ends
+   (keys with chains are recorded for that). Removed keys disappear
+   from views with all their versions.
+
+   If the write-ahead log is open (wal.c), puts and removals are
+   appended to it after the shard lock is released, replay orders
+   the records of each key by version. Evictions and expiry are not
+   logged.
 */
 
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <Rinternals.h>
 
-static pthread_mutex_t obj_mutex;
+static pthread_mutex_t obj_gc_mutex;
 static int obj_init_ = 0;
 
 #define OSRV_OBJ_STRUCT_ 1
 #include "obj.h"
+#include "slab.h"
+#include "shm.h"
+#include "wal.h"
+#include "sfs.h"
 #ifndef NO_DEPS
 #include "deps.h"
 #endif
 
+/* link of retired objects (see obj_retire_()), embedded in the
+   objects so that retiring them never needs to allocate */
+typedef struct obj_retired_s {
+    struct obj_retired_s *next;
+    uint64_t epoch; /* epoch at which it was retired */
+    int type;       /* OBJ_RET_* */
+} obj_retired_t;
+
+#define OBJ_RET_ENTRY 1
+#define OBJ_RET_TABLE 2
+#define OBJ_RET_STORE 3
+
+/* object of type T that contains the link R */
+#define OBJ_RET_OF(R, T) ((T*) (((char*) (R)) - offsetof(T, ret)))
+
 /* structure of the object entry */
 struct obj_entry_s {
     obj_len_t len;
     void *obj;
     SEXP sWhat;
+    obj_ver_t version;
+    void *sfs;
+    obj_len_t sfs_len;
     /* private, may not be touched by client code */
-    struct obj_entry_s *next;
+    struct obj_entry_s *next; /* GC pool */
+    uint64_t hash;
+    int flags;
+    /* access statistics for eviction, updated without locks */
+    unsigned int hits;
+    obj_ver_t atime;  /* version counter at last access */
+    double prio;      /* GDSF priority */
+    /* optional statistics (obj_set_tracking()), wall time in ms */
+    uint64_t served, created, accessed;
+    struct obj_map_s *map; /* snapshot map holding obj (OBJ_SNAP) */
+    shm_seg_t *shm;   /* shared memory copy (owned obj or SFS of sWhat) */
+    struct obj_blob_s *blob; /* shared payload holding obj (OBJ_DEDUP) */
+    struct obj_entry_s *older; /* previous version kept for views */
+    struct obj_hold_s *hold; /* holder protecting sWhat (instead of pslot) */
+    unsigned long pslot; /* slot protecting sWhat in obj_pool + 1, 0 = none */
+    uint64_t refs;    /* references (obj_ref()), OBJ_REF_FREED once unreachable */
+    uint64_t expires; /* monotonic time (in ms) of expiry, 0 = never */
+    obj_retired_t ret;
     char key[1];
 };
 
-/* FIXME: use hash */
-static obj_entry_t *obj_root;
+/* obj_entry_t.flags */
+#define OBJ_OWNED  0x01 /* obj is owned by the store and released with free() */
+#define OBJ_PINNED 0x02 /* never evicted, inherited by replacements */
+#define OBJ_MAPPED 0x04 /* owned obj is a map of a spilled file, released with munmap() */
+#define OBJ_INLINE 0x08 /* owned obj is stored in the entry block */
+#define OBJ_SLAB   0x10 /* owned obj is allocated by slab_alloc() */
+#define OBJ_SNAP   0x20 /* obj points into map, released with its last entry */
+#define OBJ_DEDUP  0x40 /* owned obj is the data of blob */
+#define OBJ_CHAINED 0x80 /* the key is recorded for trimming older versions */
+
+/* added to obj_entry_t.refs once the entry is unreachable */
+#define OBJ_REF_FREED (((uint64_t) 1) << 62)
+
+/* private put mode flag: the caller completes dependencies of all keys */
+#define OBJ_PUT_NODEPS 0x200
+
+/* R object protecting the R objects of entries (used by the R thread only) */
+struct obj_hold_s {
+    unsigned long pslot; /* see obj_protect_() */
+    unsigned long refs;
+};
+
+/* shared read-only map (e.g., a restored snapshot) */
+struct obj_map_s {
+    void *addr;
+    size_t len;
+    unsigned long refs;
+    int fd; /* file of the map if kept open (-1 otherwise) */
+};
+
+#if OBJ_SMALL_MAX > SLAB_MAX
+#error OBJ_SMALL_MAX must be served by the slab allocator
+#endif
+
+/* payloads of at least this size are mapped */
+#define OBJ_BIG_MIN (1024*1024)
+
+/* header of payloads from obj_payload_alloc() */
+typedef struct obj_payload_s {
+    size_t big;
+    size_t pad; /* keep the payload 16-byte aligned */
+} obj_payload_t;
+
+/* payloads up to this size are stored inline */
+#define OBJ_INLINE_MAX 256
+
+/* size of the entry block with key length kl and inline payload il */
+#define OBJ_ENTRY_SIZE(kl, il) (offsetof(obj_entry_t, key) + (((kl) + 8) & ~((size_t) 7)) + (il))
+
+/* must be a power of 2, the top bits of the hash select the shard */
+#define OBJ_SHARDS      64
+#define OBJ_SHARD_BITS  6
+/* initial number of slots in a shard (power of 2) */
+#define OBJ_INIT_SLOTS  64
+
+/* slot table - replaced as a whole on resize */
+typedef struct obj_table_s {
+    unsigned long size;  /* number of slots, power of 2 */
+    obj_retired_t ret;
+    obj_entry_t *slot[1];
+} obj_table_t;
+
+typedef struct obj_shard_s {
+    pthread_mutex_t mutex;
+    obj_table_t *tab;    /* read without lock, written under mutex */
+    unsigned long used;  /* slots with live entries */
+    unsigned long fill;  /* used + tombstones */
+    struct obj_store_s *store;
+} obj_shard_t;
+
+/* store: the default one or a namespace */
+typedef struct obj_store_s {
+    struct obj_store_s *next; /* namespace list */
+    unsigned long id;         /* 0 = default store */
+    obj_shard_t shard[OBJ_SHARDS];
+    /* memory budget (0 = unlimited) and accounting of owned payloads */
+    size_t budget, mem_used, evicted, evicted_bytes, expired;
+    int policy;
+    double gdsf_L; /* GDSF inflation value */
+    size_t spill_used, spills, promoted;
+    size_t ram_n, spill_n; /* number of owned entries per tier */
+    pthread_mutex_t evict_mutex;
+    unsigned int evict_shard;
+    obj_retired_t ret;
+    char name[1];
+} obj_store_t;
+
+static obj_store_t obj_default;
+
+/* namespaces, read without lock, modified under obj_ns_mutex */
+static obj_store_t *obj_ns_list;
+static unsigned long obj_ns_serial;
+static pthread_mutex_t obj_ns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* marks deleted slots so probe sequences are not broken */
+static obj_entry_t obj_tomb_;
+#define OBJ_TOMB (&obj_tomb_)
+
 static obj_entry_t *obj_gc_pool;
 
-/* FIXME: the lifetime of data is not defined, need destructor? */
-void obj_add(const char *key, SEXP sWhat, void *data, obj_len_t len) {
-    obj_entry_t *e = (obj_entry_t*) calloc(1, sizeof(obj_entry_t) + strlen(key));
-    strcpy(e->key, key);
+/* last assigned version */
+static obj_ver_t obj_version;
+
+/* spill tier, shared by all stores (obj_spill_dir is only
+   used under a read lock of obj_spill_lock) */
+static char *obj_spill_dir;
+static size_t obj_spill_limit, obj_spill_used;
+static unsigned long obj_spill_serial;
+static pthread_rwlock_t obj_spill_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* expiry timers */
+typedef struct obj_timer_s {
+    struct obj_timer_s *next;
+    uint64_t tick;     /* tick at which it fires */
+    obj_ver_t version; /* version of the entry that set it */
+    uint64_t hash;
+    unsigned long store; /* id of the store */
+    char key[1];
+} obj_timer_t;
+
+#define OBJ_TIMER_SIZE(kl) (offsetof(obj_timer_t, key) + (kl) + 1)
+
+#define OBJ_TICK_MS      100
+#define OBJ_WHEEL_BITS   6
+#define OBJ_WHEEL_SLOTS  (1 << OBJ_WHEEL_BITS)
+#define OBJ_WHEEL_LEVELS 4
+/* ticks covered by the wheel (~19 days), later timers
+   are re-scheduled once they reach the first level */
+#define OBJ_WHEEL_SPAN   (((uint64_t) 1) << (OBJ_WHEEL_BITS * OBJ_WHEEL_LEVELS))
+
+static obj_timer_t *obj_wheel[OBJ_WHEEL_LEVELS][OBJ_WHEEL_SLOTS];
+static uint64_t obj_wheel_now; /* last processed tick */
+static uint64_t obj_wheel_timers; /* number of scheduled timers */
+static pthread_mutex_t obj_wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t obj_wheel_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t obj_wheel_once = PTHREAD_ONCE_INIT;
+static int obj_wheel_running; /* 0 if the timer thread could not be started */
+
+/* number of candidates to sample per eviction */
+#define OBJ_EVICT_SAMPLES 16
+
+#define A_LOAD(X)     __atomic_load_n(&(X), __ATOMIC_ACQUIRE)
+#define A_STORE(X, V) __atomic_store_n(&(X), (V), __ATOMIC_RELEASE)
+
+/* accounts for owned payloads in the tier of the entry */
+static void obj_acct_(obj_store_t *st, obj_entry_t *e, int add) {
+    size_t *used = &st->mem_used, *n = &st->ram_n;
+    if (!(e->flags & OBJ_OWNED))
+	return;
+    if (e->flags & OBJ_MAPPED) {
+	used = &st->spill_used;
+	n = &st->spill_n;
+	/* the spill limit applies to all stores */
+	if (add)
+	    __atomic_add_fetch(&obj_spill_used, e->len, __ATOMIC_RELAXED);
+	else
+	    __atomic_sub_fetch(&obj_spill_used, e->len, __ATOMIC_RELAXED);
+    }
+    if (add) {
+	__atomic_add_fetch(used, e->len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(n, 1, __ATOMIC_RELAXED);
+    } else {
+	__atomic_sub_fetch(used, e->len, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(n, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* record an access, called by readers without locks */
+static void obj_touch_(obj_store_t *st, obj_entry_t *e) {
+    unsigned int hits = __atomic_add_fetch(&e->hits, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->atime, __atomic_load_n(&obj_version, __ATOMIC_RELAXED),
+		     __ATOMIC_RELAXED);
+    if (st->policy == OBJ_EVICT_GDSF) {
+	double L, prio;
+	__atomic_load(&st->gdsf_L, &L, __ATOMIC_RELAXED);
+	prio = L + ((double) hits) / ((double) (e->len + 1));
+	__atomic_store(&e->prio, &prio, __ATOMIC_RELAXED);
+    }
+}
+
+/* lower is colder */
+static double obj_score_(obj_store_t *st, obj_entry_t *e) {
+    double prio;
+    switch (st->policy) {
+    case OBJ_EVICT_LRU:
+	return (double) __atomic_load_n(&e->atime, __ATOMIC_RELAXED);
+    case OBJ_EVICT_LFU:
+	return (double) __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+    }
+    __atomic_load(&e->prio, &prio, __ATOMIC_RELAXED);
+    return prio;
+}
+
+/* --- access tracking --- */
+
+/* Hot keys are tracked with the Space-Saving algorithm: there are
+   k counters, a key that has a counter increments it, otherwise it
+   takes over the counter with the lowest count c and starts at c + 1
+   (c is its maximal over-estimation). Counters form a min-heap so
+   the replacement is O(log k), keys are matched by hash. Readers only
+   try the lock, accesses are not counted if it is busy, so under
+   heavy contention the counts are only a sample of the accesses. */
+
+typedef struct obj_hot_cnt_s {
+    uint64_t hash, count, error;
+    char key[OBJ_HOT_KEY];
+} obj_hot_cnt_t;
+
+static int obj_track;          /* number of counters, 0 = tracking off */
+static obj_hot_cnt_t *obj_hot_heap;
+static uint64_t obj_hot_skipped; /* accesses not counted due to contention */
+static pthread_mutex_t obj_hot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t obj_wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* restores the heap after the count of i was increased */
+static void obj_hot_down_(int i, int n) {
+    obj_hot_cnt_t tmp;
+    while (1) {
+	int c = 2 * i + 1;
+	if (c >= n)
+	    break;
+	if (c + 1 < n && obj_hot_heap[c + 1].count < obj_hot_heap[c].count)
+	    c++;
+	if (obj_hot_heap[i].count <= obj_hot_heap[c].count)
+	    break;
+	tmp = obj_hot_heap[i];
+	obj_hot_heap[i] = obj_hot_heap[c];
+	obj_hot_heap[c] = tmp;
+	i = c;
+    }
+}
+
+static void obj_hot_add_(const char *key, uint64_t hash) {
+    int i, n;
+    if (pthread_mutex_trylock(&obj_hot_mutex)) {
+	__atomic_add_fetch(&obj_hot_skipped, 1, __ATOMIC_RELAXED);
+	return;
+    }
+    if ((n = obj_track) && obj_hot_heap) {
+	for (i = 0; i < n; i++)
+	    if (obj_hot_heap[i].hash == hash && obj_hot_heap[i].count)
+		break;
+	if (i == n) { /* take over the minimum */
+	    i = 0;
+	    obj_hot_heap[0].hash = hash;
+	    obj_hot_heap[0].error = obj_hot_heap[0].count;
+	    strncpy(obj_hot_heap[0].key, key, OBJ_HOT_KEY - 1);
+	    obj_hot_heap[0].key[OBJ_HOT_KEY - 1] = 0;
+	}
+	obj_hot_heap[i].count++;
+	obj_hot_down_(i, n);
+    }
+    pthread_mutex_unlock(&obj_hot_mutex);
+}
+
+int obj_set_tracking(int k) {
+    obj_hot_cnt_t *h = 0, *old;
+    if (k < 0)
+	k = 0;
+    if (k && !(h = (obj_hot_cnt_t*) calloc(k, sizeof(obj_hot_cnt_t))))
+	return -1;
+    pthread_mutex_lock(&obj_hot_mutex);
+    old = obj_hot_heap;
+    obj_hot_heap = h;
+    A_STORE(obj_track, k);
+    obj_hot_skipped = 0;
+    pthread_mutex_unlock(&obj_hot_mutex);
+    free(old);
+    return 0;
+}
+
+static int obj_hot_cmp_(const void *a, const void *b) {
+    const obj_hot_cnt_t *x = (const obj_hot_cnt_t*) a, *y = (const obj_hot_cnt_t*) b;
+    return (x->count < y->count) ? 1 : ((x->count > y->count) ? -1 : 0);
+}
+
+int obj_hot(obj_hot_t *res, int n) {
+    obj_hot_cnt_t *h;
+    int i, k;
+    pthread_mutex_lock(&obj_hot_mutex);
+    k = obj_track;
+    if (!k || !(h = (obj_hot_cnt_t*) malloc(k * sizeof(obj_hot_cnt_t)))) {
+	pthread_mutex_unlock(&obj_hot_mutex);
+	return k ? -1 : 0;
+    }
+    memcpy(h, obj_hot_heap, k * sizeof(obj_hot_cnt_t));
+    pthread_mutex_unlock(&obj_hot_mutex);
+    qsort(h, k, sizeof(obj_hot_cnt_t), obj_hot_cmp_);
+    for (i = 0; i < n && i < k && h[i].count; i++) {
+	memcpy(res[i].key, h[i].key, OBJ_HOT_KEY);
+	res[i].count = h[i].count;
+	res[i].error = h[i].error;
+    }
+    free(h);
+    return i;
+}
+
+void obj_served(obj_entry_t *e, obj_len_t len) {
+    if (A_LOAD(obj_track))
+	__atomic_add_fetch(&e->served, len, __ATOMIC_RELAXED);
+}
+
+/* --- epoch-based reclamation --- */
+
+/* per-thread record, never released (re-used once the thread exits) */
+typedef struct obj_thr_s {
+    struct obj_thr_s *next;
+    uint64_t epoch; /* epoch the thread entered in, 0 = not reading */
+    int depth;      /* nesting of read sections */
+    int in_use;
+} obj_thr_t;
+
+static uint64_t obj_epoch = 1;
+static obj_thr_t *obj_threads;
+static pthread_mutex_t obj_thr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t obj_thr_key;
+static __thread obj_thr_t *obj_me;
+
+/* shared by threads that cannot get a record of their own (out of
+   memory), it holds the epoch of the oldest of them. Only modified
+   under obj_shared_mutex, obj_shared_depth is the nesting of the
+   read sections of the thread using it. */
+static obj_thr_t obj_thr_shared;
+static pthread_mutex_t obj_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread int obj_shared_depth;
+
+/* retired objects waiting for reclamation */
+#define OBJ_RECLAIM_MIN 64
+static obj_retired_t *obj_retired;
+static unsigned long obj_retired_n;
+/* oldest epoch in the list (or UINT64_MAX) and the length at which
+   readers attempt reclamation regardless of their epoch */
+static uint64_t obj_retired_min = UINT64_MAX;
+static unsigned long obj_retired_next = OBJ_RECLAIM_MIN;
+static pthread_mutex_t obj_retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void obj_thr_exit(void *rec) {
+    obj_thr_t *t = (obj_thr_t*) rec;
+    A_STORE(t->epoch, 0);
+    t->depth = 0;
+    A_STORE(t->in_use, 0);
+}
+
+static obj_thr_t *obj_thr() {
+    obj_thr_t *t;
+    if (obj_me)
+	return obj_me;
+    pthread_mutex_lock(&obj_thr_mutex);
+    t = obj_threads;
+    /* records are released by exiting threads without the lock */
+    while (t && A_LOAD(t->in_use))
+	t = t->next;
+    if (!t && (t = (obj_thr_t*) calloc(1, sizeof(obj_thr_t)))) {
+	t->next = obj_threads;
+	A_STORE(obj_threads, t);
+    }
+    if (t)
+	t->in_use = 1;
+    pthread_mutex_unlock(&obj_thr_mutex);
+    if (!t) /* the caller uses obj_thr_shared */
+	return 0;
+    pthread_setspecific(obj_thr_key, t);
+    return (obj_me = t);
+}
+
+static void obj_reclaim(int wait);
+
+/* fork() copies only the calling thread, so the list must be
+   consistent and the records of all other threads are free */
+static void obj_prefork() {
+    pthread_mutex_lock(&obj_thr_mutex);
+    pthread_mutex_lock(&obj_shared_mutex);
+}
+
+static void obj_forked_parent() {
+    pthread_mutex_unlock(&obj_shared_mutex);
+    pthread_mutex_unlock(&obj_thr_mutex);
+}
+
+static void obj_forked_child() {
+    obj_thr_t *t;
+    for (t = obj_threads; t; t = t->next)
+	if (t == &obj_thr_shared) {
+	    /* only we can still be using it */
+	    if (!obj_shared_depth) {
+		t->epoch = 0;
+		t->depth = 0;
+	    } else
+		t->depth = 1;
+	} else if (t != obj_me) {
+	    t->epoch = 0;
+	    t->depth = 0;
+	    t->in_use = 0;
+	}
+    pthread_mutex_unlock(&obj_shared_mutex);
+    pthread_mutex_unlock(&obj_thr_mutex);
+}
+
+/* set in a forked child that only reads (see obj_freeze()) */
+static int obj_frozen;
+
+void obj_freeze() {
+    obj_frozen = 1;
+}
+
+void obj_read_begin() {
+    obj_thr_t *t = obj_shared_depth ? 0 : obj_thr();
+    if (!t) {
+	/* the shared record keeps the epoch of the first thread
+	   that entered, which is safe for all later ones */
+	if (!obj_shared_depth++) {
+	    pthread_mutex_lock(&obj_shared_mutex);
+	    if (!obj_thr_shared.depth++) {
+		__atomic_store_n(&obj_thr_shared.epoch, __atomic_load_n(&obj_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	    }
+	    pthread_mutex_unlock(&obj_shared_mutex);
+	}
+	return;
+    }
+    if (!t->depth++) {
+	__atomic_store_n(&t->epoch, __atomic_load_n(&obj_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void obj_read_end() {
+    obj_thr_t *t = obj_me;
+    if (obj_shared_depth) {
+	if (!--obj_shared_depth) {
+	    pthread_mutex_lock(&obj_shared_mutex);
+	    if (!--obj_thr_shared.depth)
+		A_STORE(obj_thr_shared.epoch, 0);
+	    pthread_mutex_unlock(&obj_shared_mutex);
+	}
+	return;
+    }
+    if (t && t->depth > 0 && !--t->depth) {
+	uint64_t ep = t->epoch;
+	unsigned long n;
+	A_STORE(t->epoch, 0);
+	/* opportunistic reclamation so memory is released
+	   even if nothing else gets removed */
+	if ((n = A_LOAD(obj_retired_n)) && !obj_frozen &&
+	    (ep <= A_LOAD(obj_retired_min) || n >= A_LOAD(obj_retired_next)))
+	    obj_reclaim(0);
+    }
+}
+
+/* the oldest epoch that may still be in use */
+static uint64_t obj_safe_epoch() {
+    uint64_t min = __atomic_load_n(&obj_epoch, __ATOMIC_SEQ_CST);
+    obj_thr_t *t = A_LOAD(obj_threads);
+    while (t) {
+	uint64_t e = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+	if (e && e < min)
+	    min = e;
+	t = t->next;
+    }
+    return min;
+}
+
+/* allocates a zeroed entry block with space for il bytes of inline payload */
+static obj_entry_t *obj_entry_alloc(size_t kl, obj_len_t il) {
+    size_t hs = offsetof(obj_entry_t, key);
+    obj_entry_t *e = (obj_entry_t*) slab_alloc(OBJ_ENTRY_SIZE(kl, il));
+    if (e)
+	memset(e, 0, hs);
+    return e;
+}
+
+static void obj_entry_release(obj_entry_t *e) {
+    slab_free(e, OBJ_ENTRY_SIZE(strlen(e->key), (e->flags & OBJ_INLINE) ? e->len : 0));
+}
+
+void *obj_payload_alloc(size_t len) {
+    obj_payload_t *p;
+    size_t big = (len >= OBJ_BIG_MIN) ? 1 : 0;
+    /* the payload will be written right away, so pre-fault it */
+    p = (obj_payload_t*) (big ? big_alloc(sizeof(obj_payload_t) + len, BIG_POPULATE) :
+			  malloc(sizeof(obj_payload_t) + len));
+    if (!p)
+	return 0;
+    p->big = big;
+    return p + 1;
+}
+
+void obj_payload_free(void *data) {
+    obj_payload_t *p = ((obj_payload_t*) data) - 1;
+    if (!data)
+	return;
+    if (p->big)
+	big_free(p);
+    else
+	free(p);
+}
+
+void obj_set_hugepages(int mode) {
+    big_config(mode);
+}
+
+void obj_alloc_stat(obj_alloc_stat_t *st) {
+    big_stat(&st->mapped, &st->resident);
+    st->slab = slab_reserved();
+    st->hugepages = big_huge();
+}
+
+obj_map_t *obj_map_new(void *addr, size_t len) {
+    obj_map_t *m = (obj_map_t*) malloc(sizeof(obj_map_t));
+    if (m) {
+	m->addr = addr;
+	m->len = len;
+	m->refs = 1;
+	m->fd = -1;
+    }
+    return m;
+}
+
+void obj_map_release(obj_map_t *m) {
+    if (m && !__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL)) {
+	munmap(m->addr, m->len);
+	if (m->fd != -1)
+	    close(m->fd);
+	free(m);
+    }
+}
+
+/* --- deduplication --- */
+
+/* payload shared by all entries with the same content */
+typedef struct obj_blob_s {
+    struct obj_blob_s *next;
+    uint64_t hash;
+    obj_len_t len;
+    unsigned long refs;
+    void *data; /* from obj_payload_alloc() */
+} obj_blob_t;
+
+static size_t obj_dedup_min; /* 0 = off */
+static obj_blob_t **obj_blob_tab;
+static unsigned long obj_blob_size; /* number of buckets, power of 2 */
+/* statistics: blobs and their size, references and the size of
+   the payloads they stand for, puts that found a blob */
+static size_t obj_blob_n, obj_blob_bytes, obj_blob_refs, obj_blob_logical, obj_blob_hits;
+static pthread_mutex_t obj_blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t obj_hash(const char *key, size_t len);
+
+static void obj_blob_release_(obj_blob_t *b) {
+    obj_blob_t **prev;
+    pthread_mutex_lock(&obj_blob_mutex);
+    obj_blob_refs--;
+    obj_blob_logical -= b->len;
+    if (--b->refs) {
+	pthread_mutex_unlock(&obj_blob_mutex);
+	return;
+    }
+    if (obj_blob_tab) {
+	prev = &obj_blob_tab[b->hash & (obj_blob_size - 1)];
+	while (*prev && *prev != b)
+	    prev = &(*prev)->next;
+	if (*prev)
+	    *prev = b->next;
+    }
+    obj_blob_n--;
+    obj_blob_bytes -= b->len;
+    pthread_mutex_unlock(&obj_blob_mutex);
+    obj_payload_free(b->data);
+    free(b);
+}
+
+/* returns a new reference to a blob with the given content or NULL */
+static obj_blob_t *obj_blob_find_(const void *data, obj_len_t len, uint64_t hash) {
+    obj_blob_t *b = 0;
+    pthread_mutex_lock(&obj_blob_mutex);
+    if (obj_blob_tab)
+	for (b = obj_blob_tab[hash & (obj_blob_size - 1)]; b; b = b->next)
+	    if (b->hash == hash && b->len == len) {
+		b->refs++;
+		obj_blob_refs++;
+		obj_blob_logical += len;
+		break;
+	    }
+    pthread_mutex_unlock(&obj_blob_mutex);
+    /* compare outside of the lock, the reference keeps the blob */
+    if (b && memcmp(b->data, data, len)) {
+	obj_blob_release_(b);
+	b = 0;
+    }
+    if (b)
+	__atomic_add_fetch(&obj_blob_hits, 1, __ATOMIC_RELAXED);
+    return b;
+}
+
+/* creates a blob with one reference, it takes over data
+   unless copy is set. It is private until obj_blob_insert_() */
+static obj_blob_t *obj_blob_new_(void *data, obj_len_t len, uint64_t hash, int copy) {
+    obj_blob_t *b = (obj_blob_t*) calloc(1, sizeof(obj_blob_t));
+    if (!b)
+	return 0;
+    if (copy) {
+	if (!(b->data = obj_payload_alloc(len))) {
+	    free(b);
+	    return 0;
+	}
+	memcpy(b->data, data, len);
+    } else
+	b->data = data;
+    b->hash = hash;
+    b->len = len;
+    b->refs = 1;
+    return b;
+}
+
+/* makes the blob visible to obj_blob_find_() */
+static void obj_blob_insert_(obj_blob_t *b) {
+    pthread_mutex_lock(&obj_blob_mutex);
+    /* keep at most one blob per bucket on average */
+    if (obj_blob_n >= obj_blob_size) {
+	unsigned long size = obj_blob_size ? obj_blob_size * 2 : 1024, i;
+	obj_blob_t **tab = (obj_blob_t**) calloc(size, sizeof(obj_blob_t*));
+	if (tab) {
+	    for (i = 0; i < obj_blob_size; i++)
+		while (obj_blob_tab[i]) {
+		    obj_blob_t *c = obj_blob_tab[i];
+		    obj_blob_tab[i] = c->next;
+		    c->next = tab[c->hash & (size - 1)];
+		    tab[c->hash & (size - 1)] = c;
+		}
+	    free(obj_blob_tab);
+	    obj_blob_tab = tab;
+	    obj_blob_size = size;
+	}
+    }
+    /* if the table could not be created the blob is just not shared */
+    if (obj_blob_tab) {
+	b->next = obj_blob_tab[b->hash & (obj_blob_size - 1)];
+	obj_blob_tab[b->hash & (obj_blob_size - 1)] = b;
+    }
+    obj_blob_n++;
+    obj_blob_bytes += b->len;
+    obj_blob_refs++;
+    obj_blob_logical += b->len;
+    pthread_mutex_unlock(&obj_blob_mutex);
+}
+
+void obj_set_dedup(size_t min_size) {
+    A_STORE(obj_dedup_min, min_size);
+}
+
+void obj_dedup_stat(obj_dedup_stat_t *ds) {
+    pthread_mutex_lock(&obj_blob_mutex);
+    ds->min_size = obj_dedup_min;
+    ds->blobs = obj_blob_n;
+    ds->bytes = obj_blob_bytes;
+    ds->refs = obj_blob_refs;
+    ds->logical = obj_blob_logical;
+    ds->hits = A_LOAD(obj_blob_hits);
+    pthread_mutex_unlock(&obj_blob_mutex);
+}
+
+static void obj_free_payload(obj_entry_t *e) {
+    if (e->sfs && !e->shm) /* otherwise it is the segment */
+	free(e->sfs);
+    if (e->flags & OBJ_SNAP)
+	obj_map_release(e->map);
+    if (e->flags & OBJ_DEDUP)
+	obj_blob_release_(e->blob);
+    else if (e->shm) /* obj (if owned) points into the segment */
+	shm_seg_free(e->shm);
+    else if ((e->flags & OBJ_OWNED) && e->obj) {
+	if (e->flags & OBJ_MAPPED)
+	    munmap(e->obj, e->len);
+	else if (e->flags & OBJ_SLAB)
+	    slab_free(e->obj, e->len);
+	else if (!(e->flags & OBJ_INLINE))
+	    obj_payload_free(e->obj);
+    }
+}
+
+static void obj_free_entry_(obj_entry_t *e) {
+    if (e->sWhat) {
+	pthread_mutex_lock(&obj_gc_mutex);
+	e->next = obj_gc_pool;
+	obj_gc_pool = e;
+	pthread_mutex_unlock(&obj_gc_mutex);
+	return;
+    }
+    obj_free_payload(e);
+    obj_entry_release(e);
+}
+
+/* entries that are still referenced are freed by the last obj_unref() */
+static void obj_free_entry(obj_entry_t *e) {
+    if (!__atomic_fetch_add(&e->refs, OBJ_REF_FREED, __ATOMIC_ACQ_REL))
+	obj_free_entry_(e);
+}
+
+void obj_ref(obj_entry_t *e) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+}
+
+void obj_unref(obj_entry_t *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == OBJ_REF_FREED &&
+	!obj_frozen)
+	obj_free_entry_(e);
+}
+
+/* releases a dropped namespace with all its entries */
+static void obj_store_free_(obj_store_t *st) {
+    int i;
+    for (i = 0; i < OBJ_SHARDS; i++) {
+	obj_table_t *tab = st->shard[i].tab;
+	if (tab) {
+	    unsigned long j;
+	    for (j = 0; j < tab->size; j++)
+		if (tab->slot[j] && tab->slot[j] != OBJ_TOMB) {
+		    obj_entry_t *e = tab->slot[j];
+		    while (e) {
+			obj_entry_t *o = e->older;
+			obj_free_entry(e);
+			e = o;
+		    }
+		}
+	    free(tab);
+	}
+	pthread_mutex_destroy(&st->shard[i].mutex);
+    }
+    pthread_mutex_destroy(&st->evict_mutex);
+    free(st);
+}
+
+/* must be called after the object with the link r has been made
+   unreachable, it is released once no reader can see it anymore */
+static void obj_retire_(obj_retired_t *r, int type) {
+    r->type = type;
+    pthread_mutex_lock(&obj_retire_mutex);
+    r->epoch = __atomic_fetch_add(&obj_epoch, 1, __ATOMIC_SEQ_CST);
+    r->next = obj_retired;
+    obj_retired = r;
+    if (r->epoch < obj_retired_min)
+	A_STORE(obj_retired_min, r->epoch);
+    __atomic_fetch_add(&obj_retired_n, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&obj_retire_mutex);
+}
+
+#define obj_retire(E) obj_retire_(&(E)->ret, OBJ_RET_ENTRY)
+
+/* retires the entry with all its older versions */
+static void obj_retire_chain_(obj_entry_t *e) {
+    while (e) {
+	obj_entry_t *o = e->older;
+	obj_retire(e);
+	e = o;
+    }
+}
+
+/* free everything that is no longer reachable by readers.
+   If wait is 0 then we give up if another thread is reclaiming */
+static void obj_reclaim(int wait) {
+    obj_retired_t *r, **prev, *done = 0;
+    uint64_t safe, min = UINT64_MAX;
+    unsigned long n = 0;
+    if (wait)
+	pthread_mutex_lock(&obj_retire_mutex);
+    else if (pthread_mutex_trylock(&obj_retire_mutex))
+	return;
+    safe = obj_safe_epoch();
+    prev = &obj_retired;
+    while ((r = *prev)) {
+	if (r->epoch < safe) {
+	    *prev = r->next;
+	    r->next = done;
+	    done = r;
+	    __atomic_fetch_sub(&obj_retired_n, 1, __ATOMIC_RELAXED);
+	} else {
+	    if (r->epoch < min)
+		min = r->epoch;
+	    n++;
+	    prev = &r->next;
+	}
+    }
+    A_STORE(obj_retired_min, min);
+    A_STORE(obj_retired_next, 2 * n + OBJ_RECLAIM_MIN);
+    pthread_mutex_unlock(&obj_retire_mutex);
+    /* release outside of the lock */
+    while ((r = done)) {
+	done = r->next;
+	if (r->type == OBJ_RET_ENTRY)
+	    obj_free_entry(OBJ_RET_OF(r, obj_entry_t));
+	else if (r->type == OBJ_RET_TABLE)
+	    free(OBJ_RET_OF(r, obj_table_t));
+	else
+	    obj_store_free_(OBJ_RET_OF(r, obj_store_t));
+    }
+}
+
+/* --- index --- */
+
+/* MurmurHash64A by Austin Appleby (public domain) */
+static uint64_t obj_hash(const char *key, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (len * m);
+    const unsigned char *d = (const unsigned char*) key, *end = d + (len & ~((size_t) 7));
+
+    while (d != end) {
+	uint64_t k;
+	memcpy(&k, d, 8);
+	k *= m;
+	k ^= k >> r;
+	k *= m;
+	h ^= k;
+	h *= m;
+	d += 8;
+    }
+    switch (len & 7) {
+    case 7: h ^= ((uint64_t) d[6]) << 48;
+	/* fall through */
+    case 6: h ^= ((uint64_t) d[5]) << 40;
+	/* fall through */
+    case 5: h ^= ((uint64_t) d[4]) << 32;
+	/* fall through */
+    case 4: h ^= ((uint64_t) d[3]) << 24;
+	/* fall through */
+    case 3: h ^= ((uint64_t) d[2]) << 16;
+	/* fall through */
+    case 2: h ^= ((uint64_t) d[1]) << 8;
+	/* fall through */
+    case 1: h ^= ((uint64_t) d[0]);
+	h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+#define obj_shard_of(ST, H) (&(ST)->shard[(H) >> (64 - OBJ_SHARD_BITS)])
+
+/* returns the store of the key and sets *skey to the key inside
+   the store. Keys are only routed to a namespace if it exists, i.e.,
+   "a/b" is a plain key in the default store unless there is a
+   namespace "a". Must be called inside a read section. */
+static obj_store_t *obj_store_of_(const char *key, const char **skey) {
+    obj_store_t *st = A_LOAD(obj_ns_list);
+    const char *c;
+    *skey = key;
+    if (!st || !(c = strchr(key, '/')))
+	return &obj_default;
+    for (; st; st = A_LOAD(st->next))
+	if (!strncmp(st->name, key, c - key) && !st->name[c - key]) {
+	    *skey = c + 1;
+	    return st;
+	}
+    return &obj_default;
+}
+
+/* store by name (NULL = default) or id, NULL if it doesn't exist.
+   Must be called inside a read section. */
+static obj_store_t *obj_store_(const char *name, unsigned long id) {
+    obj_store_t *st;
+    if (name ? !*name : !id)
+	return &obj_default;
+    for (st = A_LOAD(obj_ns_list); st; st = A_LOAD(st->next))
+	if (name ? !strcmp(st->name, name) : (st->id == id))
+	    break;
+    return st;
+}
+
+/* posts the full key of an entry on the deps queue */
+static void obj_notify_(obj_store_t *st, const char *key, int msg) {
+#ifndef NO_DEPS
+    char *fk;
+    if (!st->id) {
+	deps_notify(key, msg);
+	return;
+    }
+    if ((fk = (char*) malloc(strlen(st->name) + strlen(key) + 2))) {
+	sprintf(fk, "%s/%s", st->name, key);
+	deps_notify(fk, msg);
+	free(fk);
+    }
+#endif
+}
+
+/* returns the slot holding the key or NULL,
+   safe to call without the shard lock from a read section */
+static obj_entry_t **obj_find_(obj_shard_t *sh, const char *key, uint64_t hash) {
+    obj_table_t *tab = A_LOAD(sh->tab);
+    unsigned long mask, i;
+    obj_entry_t *e;
+    if (!tab)
+	return 0;
+    mask = tab->size - 1;
+    i = hash & mask;
+    while ((e = A_LOAD(tab->slot[i]))) {
+	if (e != OBJ_TOMB && e->hash == hash && !strcmp(key, e->key))
+	    return &tab->slot[i];
+	i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+/* re-allocate the slots, drops tombstones. The old table is
+   retired since readers may still be probing it.
+   Must be called with the shard lock held.
+   Returns non-zero on error. */
+static int obj_resize_(obj_shard_t *sh, unsigned long size) {
+    obj_table_t *tab = (obj_table_t*) calloc(1, sizeof(obj_table_t) + sizeof(obj_entry_t*) * (size - 1)),
+	*old = sh->tab;
+    unsigned long i = 0, mask = size - 1;
+    if (!tab)
+	return -1;
+    tab->size = size;
+    if (old) {
+	while (i < old->size) {
+	    obj_entry_t *e = old->slot[i++];
+	    if (e && e != OBJ_TOMB) {
+		unsigned long j = e->hash & mask;
+		while (tab->slot[j])
+		    j = (j + 1) & mask;
+		tab->slot[j] = e;
+	    }
+	}
+    }
+    A_STORE(sh->tab, tab);
+    sh->fill = sh->used;
+    if (old)
+	obj_retire_(&old->ret, OBJ_RET_TABLE);
+    return 0;
+}
+
+/* removes the entry in the slot, must be called with the shard lock held */
+static obj_entry_t *obj_unlink_(obj_shard_t *sh, obj_entry_t **sl) {
+    obj_entry_t *e = *sl;
+    A_STORE(*sl, OBJ_TOMB);
+    sh->used--;
+    obj_acct_(sh->store, e, 0);
+    obj_retire_chain_(e);
+    return e;
+}
+
+/* --- views --- */
+
+/* active views (sorted, may contain duplicates) */
+static obj_ver_t *obj_views;
+static size_t obj_views_n, obj_views_size;
+static pthread_mutex_t obj_view_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* read-locked while assigning and installing versions */
+static pthread_rwlock_t obj_commit_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* key with older versions that may need trimming */
+typedef struct obj_chain_s {
+    struct obj_chain_s *next;
+    uint64_t hash;
+    unsigned long store; /* id of the store */
+    char key[1];
+} obj_chain_t;
+
+#define OBJ_CHAIN_SIZE(kl) (offsetof(obj_chain_t, key) + (kl) + 1)
+
+static obj_chain_t *obj_chains;
+static pthread_mutex_t obj_chain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* removes older versions of e that no view can see. A version is
+   seen by views in [version, version of the next newer one).
+   Must be called with the shard lock held. */
+static void obj_trim_(obj_entry_t *e) {
+    obj_entry_t *prev = e, *o = e->older;
+    pthread_mutex_lock(&obj_view_mutex);
+    while (o) {
+	obj_entry_t *next = o->older;
+	size_t lo = 0, hi = obj_views_n;
+	/* first view >= o->version */
+	while (lo < hi) {
+	    size_t mid = (lo + hi) / 2;
+	    if (obj_views[mid] < o->version)
+		lo = mid + 1;
+	    else
+		hi = mid;
+	}
+	if (lo < obj_views_n && obj_views[lo] < prev->version)
+	    prev = o;
+	else { /* readers may still be walking through o */
+	    A_STORE(prev->older, next);
+	    obj_retire(o);
+	}
+	o = next;
+    }
+    pthread_mutex_unlock(&obj_view_mutex);
+}
+
+/* records the key of e (which has older versions) for trimming using
+   the record *cp (allocated with OBJ_CHAIN_SIZE() of the key length by
+   the caller, so this cannot fail), which is set to NULL if it was
+   used. Must be called with the shard lock held */
+static void obj_chain_add_(obj_store_t *st, obj_entry_t *e, obj_chain_t **cp) {
+    size_t kl = strlen(e->key);
+    obj_chain_t *c = *cp;
+    if (e->flags & OBJ_CHAINED)
+	return;
+    *cp = 0;
+    memcpy(c->key, e->key, kl + 1);
+    c->hash = e->hash;
+    c->store = st->id;
+    e->flags |= OBJ_CHAINED;
+    pthread_mutex_lock(&obj_chain_mutex);
+    c->next = obj_chains;
+    obj_chains = c;
+    pthread_mutex_unlock(&obj_chain_mutex);
+}
+
+/* trims the versions of all recorded keys */
+static void obj_chain_sweep_() {
+    obj_chain_t *c, *keep = 0;
+    pthread_mutex_lock(&obj_chain_mutex);
+    c = obj_chains;
+    obj_chains = 0;
+    pthread_mutex_unlock(&obj_chain_mutex);
+    /* the stores may be dropped concurrently */
+    obj_read_begin();
+    while (c) {
+	obj_chain_t *n = c->next;
+	obj_store_t *st = obj_store_(0, c->store);
+	int chained = 0;
+	if (st) {
+	    obj_shard_t *sh = obj_shard_of(st, c->hash);
+	    obj_entry_t **sl;
+	    pthread_mutex_lock(&sh->mutex);
+	    if ((sl = obj_find_(sh, c->key, c->hash))) {
+		obj_trim_(*sl);
+		if (!(chained = ((*sl)->older != 0)))
+		    (*sl)->flags &= ~OBJ_CHAINED;
+	    }
+	    pthread_mutex_unlock(&sh->mutex);
+	}
+	if (chained) {
+	    c->next = keep;
+	    keep = c;
+	} else
+	    slab_free(c, OBJ_CHAIN_SIZE(strlen(c->key)));
+	c = n;
+    }
+    obj_read_end();
+    if (keep) {
+	obj_chain_t *last = keep;
+	while (last->next)
+	    last = last->next;
+	pthread_mutex_lock(&obj_chain_mutex);
+	last->next = obj_chains;
+	obj_chains = keep;
+	pthread_mutex_unlock(&obj_chain_mutex);
+    }
+}
+
+int obj_view_begin(obj_ver_t *view) {
+    int res = 0;
+    /* no version can be assigned, but not installed yet */
+    pthread_rwlock_wrlock(&obj_commit_lock);
+    pthread_mutex_lock(&obj_view_mutex);
+    if (obj_views_n == obj_views_size) {
+	size_t ns = obj_views_size ? obj_views_size * 2 : 16;
+	obj_ver_t *nv = (obj_ver_t*) realloc(obj_views, ns * sizeof(obj_ver_t));
+	if (!nv)
+	    res = -1;
+	else {
+	    obj_views = nv;
+	    obj_views_size = ns;
+	}
+    }
+    if (!res) {
+	/* the newest view, so it goes at the end */
+	*view = A_LOAD(obj_version);
+	obj_views[obj_views_n] = *view;
+	A_STORE(obj_views_n, obj_views_n + 1);
+    }
+    pthread_mutex_unlock(&obj_view_mutex);
+    pthread_rwlock_unlock(&obj_commit_lock);
+    return res;
+}
+
+void obj_view_end(obj_ver_t view) {
+    size_t i;
+    pthread_mutex_lock(&obj_view_mutex);
+    for (i = 0; i < obj_views_n && obj_views[i] != view; i++) {}
+    if (i < obj_views_n) {
+	memmove(obj_views + i, obj_views + i + 1, (obj_views_n - i - 1) * sizeof(obj_ver_t));
+	A_STORE(obj_views_n, obj_views_n - 1);
+    }
+    pthread_mutex_unlock(&obj_view_mutex);
+    obj_chain_sweep_();
+}
+
+/* samples candidates in the shard and stores the score of the
+   coldest one in *score (and the entry in *cand, which is only
+   valid inside a read section). If evict is set, the candidate
+   is also evicted. Returns 1 if a candidate was found. */
+static int obj_sample_(obj_shard_t *sh, int evict, double *score, obj_entry_t **cand) {
+    obj_store_t *st = sh->store;
+    obj_table_t *tab;
+    obj_entry_t **victim = 0;
+    double vscore = 0.0;
+    unsigned long i, n = 0, seen = 0, mask;
+    pthread_mutex_lock(&sh->mutex);
+    tab = sh->tab;
+    if (!tab || !sh->used) {
+	pthread_mutex_unlock(&sh->mutex);
+	return 0;
+    }
+    mask = tab->size - 1;
+    /* scan from a pseudo-random position, the table is at most
+       3/4 full so we find candidates quickly */
+    i = ((st->evicted + obj_version) * 0x9E3779B97F4A7C15ULL) & mask;
+    while (n < OBJ_EVICT_SAMPLES && seen++ < tab->size) {
+	obj_entry_t *e = tab->slot[i];
+	/* spilled entries don't use memory, so are never candidates */
+	if (e && e != OBJ_TOMB && (e->flags & OBJ_OWNED) &&
+	    !(e->flags & (OBJ_PINNED | OBJ_MAPPED)) && e->len) {
+	    double sc = obj_score_(st, e);
+	    if (!victim || sc < vscore) {
+		victim = &tab->slot[i];
+		vscore = sc;
+	    }
+	    n++;
+	}
+	i = (i + 1) & mask;
+    }
+    if (victim && evict) {
+	obj_entry_t *e = *victim;
+	st->evicted++;
+	st->evicted_bytes += e->len;
+	if (st->policy == OBJ_EVICT_GDSF && vscore > st->gdsf_L)
+	    __atomic_store(&st->gdsf_L, &vscore, __ATOMIC_RELAXED);
+	obj_notify_(st, e->key, DEPS_MSG_EVICTED);
+	obj_unlink_(sh, victim);
+    }
+    if (cand)
+	*cand = victim ? *victim : 0;
+    pthread_mutex_unlock(&sh->mutex);
+    *score = vscore;
+    return victim ? 1 : 0;
+}
+
+/* writes the payload into a new file in the spill directory and
+   returns its read-only map or NULL on failure */
+static void *obj_spill_map_(const void *data, obj_len_t len) {
+    char *fn = (char*) malloc(strlen(obj_spill_dir) + 64);
+    const char *d = (const char*) data;
+    obj_len_t pos = 0;
+    void *m = 0;
+    int fd;
+    if (!fn)
+	return 0;
+    snprintf(fn, strlen(obj_spill_dir) + 64, "%s/osrv-%ld-%lu.spill", obj_spill_dir,
+	     (long) getpid(), __atomic_add_fetch(&obj_spill_serial, 1, __ATOMIC_RELAXED));
+    fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+	free(fn);
+	return 0;
+    }
+    /* the map keeps the content alive, we don't need the name */
+    unlink(fn);
+    free(fn);
+    while (pos < len) {
+	ssize_t n = write(fd, d + pos, len - pos);
+	if (n < 1)
+	    break;
+	pos += n;
+    }
+    if (pos == len) {
+	m = mmap(0, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED)
+	    m = 0;
+	else /* GETs typically send the whole payload */
+	    madvise(m, len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return m;
+}
+
+/* replaces the entry in the slot (if it is still there) with a copy
+   holding the new payload obj described by flags (OBJ_OWNED etc.),
+   the old one is retired. The copy only keeps OBJ_PINNED and
+   OBJ_CHAINED of the old flags: everything else the old entry owns
+   (segment, blob, map, SFS form, cached sWhat with its protection)
+   stays with it and is released with it. Returns the new entry or
+   NULL if the slot has changed. */
+static obj_entry_t *obj_swap_payload_(obj_shard_t *sh, obj_entry_t *e, void *obj,
+				      int flags) {
+    size_t kl = strlen(e->key);
+    obj_entry_t *ne = obj_entry_alloc(kl, 0), **sl;
+    if (!ne)
+	return 0;
+    memcpy(ne->key, e->key, kl + 1);
+    ne->len = e->len;
+    ne->obj = obj;
+    /* cached R objects stay with the old entry and are released with it */
+    ne->version = e->version;
+    ne->expires = e->expires;
+    ne->hash = e->hash;
+    /* access stats are updated by readers concurrently */
+    ne->hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+    ne->atime = __atomic_load_n(&e->atime, __ATOMIC_RELAXED);
+    __atomic_load(&e->prio, &ne->prio, __ATOMIC_RELAXED);
+    ne->served = __atomic_load_n(&e->served, __ATOMIC_RELAXED);
+    ne->accessed = __atomic_load_n(&e->accessed, __ATOMIC_RELAXED);
+    ne->created = e->created;
+    pthread_mutex_lock(&sh->mutex);
+    if ((sl = obj_find_(sh, e->key, e->hash)) && *sl == e) {
+	ne->flags = (e->flags & (OBJ_PINNED | OBJ_CHAINED)) | flags;
+	ne->older = e->older; /* only trimmed under the lock */
+	obj_acct_(sh->store, ne, 1);
+	A_STORE(*sl, ne);
+	obj_acct_(sh->store, e, 0);
+	obj_retire(e);
+    } else {
+	obj_entry_release(ne);
+	ne = 0;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    return ne;
+}
+
+/* moves the coldest candidate of the shard to the spill tier,
+   returns 1 on success. Must be called with a read lock
+   of obj_spill_lock and obj_spill_dir set. */
+static int obj_spill_(obj_shard_t *sh) {
+    obj_entry_t *e;
+    double sc;
+    void *m;
+    int res = 0;
+    /* the candidate must stay valid while we write it */
+    obj_read_begin();
+    /* inline payloads are too small to be worth a file, payloads
+       in a segment would have to be withdrawn from other processes */
+    if (obj_sample_(sh, 0, &sc, &e) && !(e->flags & OBJ_INLINE) && !e->shm &&
+	(!obj_spill_limit || A_LOAD(obj_spill_used) + e->len <= obj_spill_limit) &&
+	(m = obj_spill_map_(e->obj, e->len))) {
+	if (obj_swap_payload_(sh, e, m, OBJ_OWNED | OBJ_MAPPED)) {
+	    sh->store->spills++;
+	    res = 1;
+	} else
+	    munmap(m, e->len);
+    }
+    obj_read_end();
+    return res;
+}
+
+/* number of shards compared for each eviction */
+#define OBJ_EVICT_SHARDS 4
+
+/* evicts entries until we fit the budget. Only one thread evicts
+   at a time, others just carry on unless wait is set. */
+static void obj_evict_(obj_store_t *st, int wait) {
+    int idle = 0; /* shards in a row without evictable entries */
+    if (wait)
+	pthread_mutex_lock(&st->evict_mutex);
+    else if (pthread_mutex_trylock(&st->evict_mutex))
+	return;
+    while (st->budget && A_LOAD(st->mem_used) > st->budget && idle < OBJ_SHARDS) {
+	obj_shard_t *best = 0;
+	double sc, bsc = 0.0;
+	int j = 0, spilled = 0;
+	/* pick the coldest candidate of a few shards */
+	while (j++ < OBJ_EVICT_SHARDS) {
+	    obj_shard_t *sh = &st->shard[st->evict_shard++ & (OBJ_SHARDS - 1)];
+	    if (obj_sample_(sh, 0, &sc, 0)) {
+		if (!best || sc < bsc) {
+		    best = sh;
+		    bsc = sc;
+		}
+	    }
+	}
+	if (best) {
+	    /* the directory may be changed in the meantime */
+	    pthread_rwlock_rdlock(&obj_spill_lock);
+	    spilled = obj_spill_dir && obj_spill_(best);
+	    pthread_rwlock_unlock(&obj_spill_lock);
+	}
+	/* the shard may have changed in the meantime, so re-sample */
+	if (best && (spilled || obj_sample_(best, 1, &sc, 0)))
+	    idle = 0;
+	else
+	    idle += OBJ_EVICT_SHARDS;
+    }
+    pthread_mutex_unlock(&st->evict_mutex);
+}
+
+int obj_set_budget(const char *ns, size_t limit, int policy) {
+    obj_store_t *st;
+    obj_read_begin();
+    if ((st = obj_store_(ns, 0))) {
+	st->policy = policy;
+	st->budget = limit;
+	if (limit && A_LOAD(st->mem_used) > limit)
+	    obj_evict_(st, 1);
+    }
+    obj_read_end();
+    return st ? 1 : 0;
+}
+
+int obj_mem_stat(const char *ns, obj_mem_stat_t *ms) {
+    obj_store_t *st;
+    obj_read_begin();
+    if ((st = obj_store_(ns, 0))) {
+	ms->limit = st->budget;
+	ms->used = A_LOAD(st->mem_used);
+	ms->entries = A_LOAD(st->ram_n);
+	ms->evicted = st->evicted;
+	ms->evicted_bytes = st->evicted_bytes;
+	ms->policy = st->policy;
+	ms->spill_limit = obj_spill_limit;
+	ms->spill_used = A_LOAD(st->spill_used);
+	ms->spill_entries = A_LOAD(st->spill_n);
+	ms->spills = st->spills;
+	ms->promoted = st->promoted;
+	ms->expired = A_LOAD(st->expired);
+    }
+    obj_read_end();
+    return st ? 1 : 0;
+}
+
+int obj_set_spill(const char *dir, size_t limit) {
+    char *d = 0;
+    if (dir && !(d = strdup(dir)))
+	return -1;
+    pthread_rwlock_wrlock(&obj_spill_lock);
+    free(obj_spill_dir);
+    obj_spill_dir = d;
+    obj_spill_limit = limit;
+    pthread_rwlock_unlock(&obj_spill_lock);
+    return 0;
+}
+
+int obj_promote(const char *key) {
+    obj_store_t *st;
+    obj_shard_t *sh;
+    obj_entry_t **sl, *e;
+    uint64_t hash;
+    int res = 0;
+    obj_read_begin();
+    st = obj_store_of_(key, &key);
+    hash = obj_hash(key, strlen(key));
+    sh = obj_shard_of(st, hash);
+    if ((sl = obj_find_(sh, key, hash)) && (e = A_LOAD(*sl))) {
+	res = 1;
+	if (e->flags & (OBJ_MAPPED | OBJ_SNAP)) {
+	    void *m = obj_payload_alloc(e->len);
+	    if (!m)
+		res = -1;
+	    else {
+		memcpy(m, e->obj, e->len);
+		if (obj_swap_payload_(sh, e, m, OBJ_OWNED))
+		    __atomic_add_fetch(&st->promoted, 1, __ATOMIC_RELAXED);
+		else { /* replaced in the meantime, nothing to do */
+		    obj_payload_free(m);
+		    res = 0;
+		}
+	    }
+	}
+    }
+    if (res == 1 && st->budget && A_LOAD(st->mem_used) > st->budget)
+	obj_evict_(st, 0);
+    obj_read_end();
+    return res;
+}
+
+void obj_will_read(obj_entry_t *e, obj_len_t off, obj_len_t len) {
+    if ((e->flags & (OBJ_MAPPED | OBJ_SNAP)) && off < e->len) {
+	/* madvise needs page-aligned addresses */
+	long ps = sysconf(_SC_PAGESIZE);
+	obj_len_t a = off - (off % ps);
+	if (len > e->len - off)
+	    len = e->len - off;
+	madvise(((char*) e->obj) + a, len + (off - a), MADV_WILLNEED);
+    }
+}
+
+int obj_pin(const char *key, int pin) {
+    obj_store_t *st;
+    obj_shard_t *sh;
+    obj_entry_t **sl;
+    uint64_t hash;
+    int res = 0;
+    obj_read_begin();
+    st = obj_store_of_(key, &key);
+    hash = obj_hash(key, strlen(key));
+    sh = obj_shard_of(st, hash);
+    pthread_mutex_lock(&sh->mutex);
+    if ((sl = obj_find_(sh, key, hash))) {
+	if (pin)
+	    (*sl)->flags |= OBJ_PINNED;
+	else
+	    (*sl)->flags &= ~OBJ_PINNED;
+	res = 1;
+    }
+    pthread_mutex_unlock(&sh->mutex);
+    obj_read_end();
+    return res;
+}
+
+/* does not count as an access */
+int obj_key_stat(const char *key, obj_key_stat_t *ks) {
+    obj_store_t *st;
+    obj_entry_t **sl, *e = 0;
+    uint64_t hash;
+    obj_read_begin();
+    st = obj_store_of_(key, &key);
+    hash = obj_hash(key, strlen(key));
+    if ((sl = obj_find_(obj_shard_of(st, hash), key, hash)) && (e = A_LOAD(*sl))) {
+	ks->len = e->len;
+	ks->version = e->version;
+	ks->hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+	ks->served = __atomic_load_n(&e->served, __ATOMIC_RELAXED);
+	ks->created = e->created;
+	ks->accessed = __atomic_load_n(&e->accessed, __ATOMIC_RELAXED);
+    }
+    obj_read_end();
+    return e ? 1 : 0;
+}
+
+/* --- expiry --- */
+
+static uint64_t obj_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+#define obj_is_expired_(E) ((E)->expires && (E)->expires <= obj_now_ms())
+
+/* schedules the timer no earlier than tick min,
+   must be called with obj_wheel_mutex held */
+static void obj_wheel_add_(obj_timer_t *t, uint64_t min) {
+    uint64_t tick = (t->tick < min) ? min : t->tick, delta = tick - obj_wheel_now;
+    int l = 0;
+    if (delta >= OBJ_WHEEL_SPAN)
+	delta = (tick = obj_wheel_now + OBJ_WHEEL_SPAN - 1) - obj_wheel_now;
+    while (l < OBJ_WHEEL_LEVELS - 1 && delta >= (((uint64_t) 1) << (OBJ_WHEEL_BITS * (l + 1))))
+	l++;
+    tick = (tick >> (OBJ_WHEEL_BITS * l)) & (OBJ_WHEEL_SLOTS - 1);
+    t->next = obj_wheel[l][tick];
+    obj_wheel[l][tick] = t;
+}
+
+/* advances the wheel up to tick, returns the list of due timers.
+   Must be called with obj_wheel_mutex held */
+static obj_timer_t *obj_wheel_advance_(uint64_t tick) {
+    obj_timer_t *due = 0, *t, *n;
+    while (obj_wheel_now < tick) {
+	unsigned int l = 1, i;
+	obj_wheel_now++;
+	/* once a level wraps, the next slot of the level above
+	   is distributed to the levels below */
+	while (l < OBJ_WHEEL_LEVELS &&
+	       !(obj_wheel_now & ((((uint64_t) 1) << (OBJ_WHEEL_BITS * l)) - 1))) {
+	    i = (obj_wheel_now >> (OBJ_WHEEL_BITS * l)) & (OBJ_WHEEL_SLOTS - 1);
+	    t = obj_wheel[l][i];
+	    obj_wheel[l][i] = 0;
+	    for (; t; t = n) {
+		n = t->next;
+		obj_wheel_add_(t, obj_wheel_now);
+	    }
+	    l++;
+	}
+	i = obj_wheel_now & (OBJ_WHEEL_SLOTS - 1);
+	t = obj_wheel[0][i];
+	obj_wheel[0][i] = 0;
+	for (; t; t = n) {
+	    n = t->next;
+	    if (t->tick > obj_wheel_now) /* beyond the span of the wheel */
+		obj_wheel_add_(t, obj_wheel_now + 1);
+	    else {
+		t->next = due;
+		due = t;
+		obj_wheel_timers--;
+	    }
+	}
+    }
+    return due;
+}
+
+/* expires all entries that are due */
+static void obj_expire_() {
+    obj_timer_t *t;
+    pthread_mutex_lock(&obj_wheel_mutex);
+    t = obj_wheel_advance_(obj_now_ms() / OBJ_TICK_MS);
+    pthread_mutex_unlock(&obj_wheel_mutex);
+    /* the store may be dropped concurrently */
+    obj_read_begin();
+    while (t) {
+	obj_timer_t *n = t->next;
+	obj_store_t *st = obj_store_(0, t->store);
+	if (st) { /* otherwise the namespace has been dropped */
+	    obj_shard_t *sh = obj_shard_of(st, t->hash);
+	    obj_entry_t **sl;
+	    pthread_mutex_lock(&sh->mutex);
+	    /* only if the entry was not replaced since */
+	    if ((sl = obj_find_(sh, t->key, t->hash)) && (*sl)->version == t->version) {
+		obj_unlink_(sh, sl);
+		__atomic_add_fetch(&st->expired, 1, __ATOMIC_RELAXED);
+		obj_notify_(st, t->key, DEPS_MSG_EXPIRED);
+	    }
+	    pthread_mutex_unlock(&sh->mutex);
+	}
+	slab_free(t, OBJ_TIMER_SIZE(strlen(t->key)));
+	t = n;
+    }
+    obj_read_end();
+    obj_reclaim(0);
+}
+
+/* the thread only ticks while there are timers, otherwise
+   it waits for obj_wheel_schedule_() to add one */
+static void *obj_wheel_thread(void *arg) {
+    while (1) {
+	struct timespec ts;
+	pthread_mutex_lock(&obj_wheel_mutex);
+	while (!obj_wheel_timers)
+	    pthread_cond_wait(&obj_wheel_cond, &obj_wheel_mutex);
+	pthread_mutex_unlock(&obj_wheel_mutex);
+	ts.tv_sec = 0;
+	ts.tv_nsec = OBJ_TICK_MS * 1000000L;
+	nanosleep(&ts, 0);
+	obj_expire_();
+    }
+    return 0;
+}
+
+static void obj_wheel_init() {
+    pthread_t thread;
+    pthread_attr_t attr;
+    obj_wheel_now = obj_now_ms() / OBJ_TICK_MS;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* if this fails puts expire due entries themselves */
+    obj_wheel_running = !pthread_create(&thread, &attr, obj_wheel_thread, 0);
+    pthread_attr_destroy(&attr);
+}
+
+/* schedules a new timer, wakes up the timer thread if the wheel was empty */
+static void obj_wheel_schedule_(obj_timer_t *t) {
+    pthread_once(&obj_wheel_once, obj_wheel_init);
+    pthread_mutex_lock(&obj_wheel_mutex);
+    /* an empty wheel doesn't need to catch up with idle ticks */
+    if (!obj_wheel_timers++) {
+	obj_wheel_now = obj_now_ms() / OBJ_TICK_MS;
+	pthread_cond_signal(&obj_wheel_cond);
+    }
+    obj_wheel_add_(t, obj_wheel_now + 1);
+    pthread_mutex_unlock(&obj_wheel_mutex);
+}
+
+/* --- protection of R objects ---
+
+   R objects held by the store are kept in the slots of one list which
+   is preserved instead of each object, because releasing objects from
+   R's precious list is O(n). Free slots are kept on a stack, so
+   protecting and releasing is O(1). Used by the R thread only. */
+
+static SEXP obj_pool;
+static unsigned long *obj_pool_free, obj_pool_size, obj_pool_nfree;
+
+/* makes sure that at least k slots are free, so the next k calls of
+   obj_protect_() cannot fail. Raises an R error if out of memory. */
+static void obj_protect_reserve_(unsigned long k) {
+    while (obj_pool_nfree < k) { /* grow */
+	unsigned long i, n = obj_pool_size ? obj_pool_size * 2 : 1024;
+	unsigned long *fr = (unsigned long*) realloc(obj_pool_free, sizeof(unsigned long) * n);
+	SEXP sNew;
+	if (!fr)
+	    Rf_error("Out of memory");
+	obj_pool_free = fr;
+	sNew = PROTECT(allocVector(VECSXP, n));
+	for (i = 0; i < obj_pool_size; i++)
+	    SET_VECTOR_ELT(sNew, i, VECTOR_ELT(obj_pool, i));
+	R_PreserveObject(sNew);
+	if (obj_pool)
+	    R_ReleaseObject(obj_pool);
+	UNPROTECT(1);
+	obj_pool = sNew;
+	/* lowest slots on top, above the free ones */
+	memmove(obj_pool_free + (n - obj_pool_size), obj_pool_free,
+		sizeof(unsigned long) * obj_pool_nfree);
+	for (i = 0; i < n - obj_pool_size; i++)
+	    obj_pool_free[i] = n - 1 - i;
+	obj_pool_nfree += n - obj_pool_size;
+	obj_pool_size = n;
+    }
+}
+
+/* returns the slot + 1 (which is never 0) */
+static unsigned long obj_protect_(SEXP x) {
+    unsigned long i;
+    if (!obj_pool_nfree) {
+	PROTECT(x); /* the caller may not have protected it */
+	obj_protect_reserve_(1);
+	UNPROTECT(1);
+    }
+    i = obj_pool_free[--obj_pool_nfree];
+    SET_VECTOR_ELT(obj_pool, i, x);
+    return i + 1;
+}
+
+static void obj_unprotect_(unsigned long pslot) {
+    if (pslot) {
+	SET_VECTOR_ELT(obj_pool, pslot - 1, R_NilValue);
+	obj_pool_free[obj_pool_nfree++] = pslot - 1;
+    }
+}
+
+/* if map is set, data points into it and is neither owned nor copied
+   (unless it is small enough to be inlined). sfs is the SFS form of
+   sWhat (from obj_sfs_()), owned by the entry if the put succeeds.
+   If hold is set, it protects sWhat, otherwise *pslot (from
+   obj_protect_() which the caller does outside of read sections
+   since it can raise an R error) does. *pslot is cleared once the
+   entry owns it, the caller releases it otherwise (also when the
+   entry doesn't keep sWhat). If commit is set, the caller holds obj_commit_lock
+   and the entry gets that version. */
+static obj_ver_t obj_store_put_(obj_store_t *st, const char *fkey, const char *key,
+				SEXP sWhat, void *data, obj_len_t len, int mode,
+				obj_ver_t version, obj_map_t *map, unsigned long ttl,
+				shm_seg_t *seg, void *sfs, obj_len_t sfs_len,
+				unsigned long *pslot, obj_hold_t *hold, obj_ver_t commit) {
+    size_t kl = strlen(key), smin;
+    int copy = mode & OBJ_PUT_COPY, inl = (!sWhat && data && len <= OBJ_INLINE_MAX);
+    int nodeps = mode & OBJ_PUT_NODEPS;
+    int shared = 0; /* 1 = our payload was copied to shm, 2 = other data was copied */
+    int dedup = 0;  /* 1 = found a blob with the same content, 2 = new blob */
+    obj_blob_t *blob = 0;
+    obj_entry_t *e = obj_entry_alloc(kl, inl ? len : 0), **sl;
+    obj_timer_t *t = 0;
+    obj_chain_t *chain = 0;
+    obj_shard_t *sh;
+    obj_ver_t ver;
+    if (!e)
+	return 0;
+    if (ttl) {
+	if (!(t = (obj_timer_t*) slab_alloc(OBJ_TIMER_SIZE(kl)))) {
+	    obj_entry_release(e);
+	    return 0;
+	}
+	memcpy(t->key, key, kl + 1);
+	t->store = st->id;
+	e->expires = obj_now_ms() + ttl;
+	t->tick = (e->expires + OBJ_TICK_MS - 1) / OBJ_TICK_MS;
+    }
+    /* published payloads are kept in their segment only */
+    if (!seg && data && !map && !inl && (smin = shm_min_size()) && len >= smin &&
+	(seg = shm_seg_new(len, 0))) {
+	memcpy(shm_seg_data(seg), data, len);
+	shared = (sWhat || copy) ? 2 : 1;
+    }
+    /* hashing happens outside of any locks */
+    if (!shared && !sWhat && data && !map && !inl && (smin = A_LOAD(obj_dedup_min)) &&
+	len >= smin) {
+	uint64_t h = obj_hash((const char*) data, len);
+	if ((blob = obj_blob_find_(data, len, h)))
+	    dedup = 1;
+	else if ((blob = obj_blob_new_(data, len, h, copy)))
+	    dedup = 2;
+    }
+    e->shm = seg;
+    e->sfs = sfs;
+    e->sfs_len = sfs_len;
+    /* the segment holds the SFS form of sWhat */
+    if (seg && sWhat && !data) {
+	e->sfs = shm_seg_data(seg);
+	e->sfs_len = shm_seg_len(seg);
+    }
+    mode &= ~(OBJ_PUT_COPY | OBJ_PUT_NODEPS);
+    memcpy(e->key, key, kl + 1);
     e->len = len;
     e->obj = data;
     e->sWhat = sWhat;
-    if (sWhat) R_PreserveObject(sWhat);
-    pthread_mutex_lock(&obj_mutex);
-    e->next = obj_root;
-    obj_root = e;
+    if (shared) {
+	/* a raw vector is not needed anymore */
+	e->sWhat = sWhat = 0;
+	e->obj = shm_seg_data(seg);
+	e->flags |= OBJ_OWNED;
+    } else if (blob) {
+	e->obj = blob->data;
+	e->blob = blob;
+	e->flags |= OBJ_OWNED | OBJ_DEDUP;
+    } else if (!sWhat) {
+	if (map && !inl) {
+	    e->flags |= OBJ_SNAP;
+	    e->map = map;
+	    __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+	} else
+	    e->flags |= OBJ_OWNED;
+	if (inl) {
+	    e->obj = ((char*) e) + OBJ_ENTRY_SIZE(kl, 0);
+	    e->flags |= OBJ_INLINE;
+	    memcpy(e->obj, data, len);
+	} else if (copy && data) {
+	    if (len <= SLAB_MAX) {
+		e->obj = slab_alloc(len);
+		e->flags |= OBJ_SLAB;
+	    } else
+		e->obj = obj_payload_alloc(len);
+	    if (!e->obj) {
+		if (t)
+		    slab_free(t, OBJ_TIMER_SIZE(kl));
+		obj_entry_release(e);
+		return 0;
+	    }
+	    memcpy(e->obj, data, len);
+	}
+    }
+    e->hash = obj_hash(key, kl);
+    if (t)
+	t->hash = e->hash;
+    if (A_LOAD(obj_track))
+	e->created = obj_wall_ms();
+    __atomic_load(&st->gdsf_L, &e->prio, __ATOMIC_RELAXED);
+    e->prio += 1.0 / ((double) (len + 1));
+    sh = obj_shard_of(st, e->hash);
+    if (sWhat) {
+	if (hold) {
+	    e->hold = hold;
+	    hold->refs++;
+	} else
+	    e->pslot = *pslot;
+    }
+    if (!commit)
+	pthread_rwlock_rdlock(&obj_commit_lock);
+    /* no view can begin while we hold obj_commit_lock, so this is
+       the record needed for trimming if we keep the old version */
+    if (A_LOAD(obj_views_n) &&
+	!(chain = (obj_chain_t*) slab_alloc(OBJ_CHAIN_SIZE(kl))))
+	goto failed_unlocked;
+    pthread_mutex_lock(&sh->mutex);
+    if ((sl = obj_find_(sh, key, e->hash))) {
+	obj_entry_t *old = *sl;
+	if (mode == OBJ_PUT_ABSENT ||
+	    (mode == OBJ_PUT_VERSION && old->version != version))
+	    goto failed;
+	/* replace, readers see either the old or the new entry */
+	ver = e->atime = e->version = commit ? commit :
+	    __atomic_add_fetch(&obj_version, 1, __ATOMIC_SEQ_CST);
+	e->flags |= (old->flags & (OBJ_PINNED | OBJ_CHAINED));
+	obj_acct_(st, e, 1);
+	/* views may need the old version (no view can begin
+	   while we hold obj_commit_lock) */
+	if (A_LOAD(obj_views_n))
+	    e->older = old;
+	A_STORE(*sl, e);
+	obj_acct_(st, old, 0);
+	if (!e->older)
+	    obj_retire_chain_(old);
+	else {
+	    obj_trim_(e);
+	    if (e->older)
+		obj_chain_add_(st, e, &chain);
+	}
+    } else {
+	obj_table_t *tab = sh->tab;
+	unsigned long i, mask;
+	if (mode == OBJ_PUT_VERSION)
+	    goto failed;
+	/* keep the load (including tombstones) below 3/4 */
+	if (!tab || (sh->fill + 1) * 4 > tab->size * 3) {
+	    obj_resize_(sh, !tab ? OBJ_INIT_SLOTS :
+			((sh->used + 1) * 2 > tab->size ? tab->size * 2 : tab->size));
+	    tab = sh->tab;
+	}
+	mask = tab->size - 1;
+	i = e->hash & mask;
+	while (tab->slot[i] && tab->slot[i] != OBJ_TOMB)
+	    i = (i + 1) & mask;
+	if (!tab->slot[i])
+	    sh->fill++;
+	ver = e->atime = e->version = commit ? commit :
+	    __atomic_add_fetch(&obj_version, 1, __ATOMIC_SEQ_CST);
+	obj_acct_(st, e, 1);
+	A_STORE(tab->slot[i], e);
+	sh->used++;
+    }
+    /* the entry cannot be removed before the blob is in the table */
+    if (dedup == 2)
+	obj_blob_insert_(blob);
+    /* under the shard lock so the index sees the versions in order */
+    if (seg)
+	shm_publish(seg, fkey, ver);
 #ifndef NO_DEPS
-    deps_complete(key);
+    if (!nodeps)
+	deps_complete(fkey);
 #endif
-    pthread_mutex_unlock(&obj_mutex);
+    pthread_mutex_unlock(&sh->mutex);
+    if (!commit)
+	pthread_rwlock_unlock(&obj_commit_lock);
+    if (chain)
+	slab_free(chain, OBJ_CHAIN_SIZE(kl));
+    /* the log is written without locks, replay orders records by
+       version. The caller's read section keeps the payload valid even
+       if the entry is replaced meanwhile. R objects without payload
+       are not logged. */
+    if (e->obj || !e->sWhat)
+	wal_put(fkey, st->id != 0, e->obj, len, ver, ttl ? obj_wall_ms() + ttl : 0);
+    else
+	wal_del(fkey, st->id != 0, ver);
+    if (t) {
+	t->version = ver;
+	obj_wheel_schedule_(t);
+    }
+    /* without the timer thread puts remove expired entries */
+    if (A_LOAD(obj_wheel_timers) && !obj_wheel_running)
+	obj_expire_();
+    /* we own data, but have copied it */
+    if ((inl && !copy && !map) || shared == 1 || (dedup == 1 && !copy))
+	obj_payload_free(data);
+    if (st->budget && A_LOAD(st->mem_used) > st->budget)
+	obj_evict_(st, 0);
+    /* the entry only owns the slot if it keeps sWhat */
+    if (sWhat && !hold)
+	*pslot = 0;
+    return ver;
+
+ failed:
+    pthread_mutex_unlock(&sh->mutex);
+ failed_unlocked:
+    if (!commit)
+	pthread_rwlock_unlock(&obj_commit_lock);
+    if (chain)
+	slab_free(chain, OBJ_CHAIN_SIZE(kl));
+    /* the caller releases pslot */
+    if (e->hold)
+	e->hold->refs--;
+    /* a segment passed by the caller stays with the caller */
+    if (shared)
+	shm_seg_free(seg);
+    else if (dedup == 1)
+	obj_blob_release_(blob);
+    else if (dedup == 2) { /* the caller keeps data */
+	if (copy)
+	    obj_payload_free(blob->data);
+	free(blob);
+    } else if (e->flags & OBJ_SLAB)
+	slab_free(e->obj, len);
+    else if (copy && !inl && e->obj)
+	obj_payload_free(e->obj);
+    if (e->map)
+	__atomic_sub_fetch(&e->map->refs, 1, __ATOMIC_RELAXED);
+    if (t)
+	slab_free(t, OBJ_TIMER_SIZE(kl));
+    obj_entry_release(e);
+    return 0;
+}
+
+/* from buf_store.c */
+void *buf_store(SEXP sWhat, sfs_len_t *len);
+
+/* serialises sWhat (without payload) if servers cannot do it on their
+   own. Must be called on the R thread, outside of read sections and
+   locks since it may raise an R error. Returns -1 if out of memory. */
+static int obj_sfs_(SEXP sWhat, void *data, void **sfs, obj_len_t *sfs_len) {
+    sfs_len_t sl = 0;
+    *sfs = 0;
+    *sfs_len = 0;
+    if (!sWhat || data || !sfs_needs_r(sWhat))
+	return 0;
+    if (!(*sfs = buf_store(sWhat, &sl)))
+	return -1;
+    *sfs_len = (obj_len_t) sl;
+    return 0;
+}
+
+static obj_ver_t obj_put_(const char *key, SEXP sWhat, void *data, obj_len_t len,
+			  int mode, obj_ver_t version, obj_map_t *map, unsigned long ttl,
+			  shm_seg_t *seg) {
+    const char *skey;
+    obj_store_t *st;
+    obj_ver_t ver;
+    void *sfs = 0;
+    obj_len_t sfs_len = 0;
+    unsigned long pslot;
+    /* a segment already holds the SFS form */
+    if (!seg && obj_sfs_(sWhat, data, &sfs, &sfs_len))
+	return 0;
+    /* can raise an error, so not inside the read section */
+    pslot = sWhat ? obj_protect_(sWhat) : 0;
+    /* the store may not be released while we use it */
+    obj_read_begin();
+    st = obj_store_of_(key, &skey);
+    ver = obj_store_put_(st, key, skey, sWhat, data, len, mode, version, map, ttl, seg,
+			 sfs, sfs_len, &pslot, 0, 0);
+    obj_read_end();
+    if (!ver)
+	free(sfs);
+    obj_unprotect_(pslot);
+    return ver;
+}
+
+obj_ver_t obj_put(const char *key, SEXP sWhat, void *data, obj_len_t len,
+		  int mode, obj_ver_t version) {
+    return obj_put_(key, sWhat, data, len, mode, version, 0, 0, 0);
+}
+
+obj_ver_t obj_put_ttl(const char *key, SEXP sWhat, void *data, obj_len_t len,
+		      int mode, obj_ver_t version, unsigned long ttl) {
+    return obj_put_(key, sWhat, data, len, mode, version, 0, ttl, 0);
+}
+
+obj_ver_t obj_put_shared(const char *key, SEXP sWhat, shm_seg_t *seg,
+			 int mode, obj_ver_t version, unsigned long ttl) {
+    return obj_put_(key, sWhat, 0, 0, mode, version, 0, ttl, seg);
+}
+
+obj_ver_t obj_put_map(const char *key, void *data, obj_len_t len, obj_map_t *map,
+		      unsigned long ttl) {
+    return obj_put_(key, 0, data, len, OBJ_PUT_ALWAYS, 0, map, ttl, 0);
+}
+
+obj_ver_t obj_put_file(const char *key, const char *path, unsigned long ttl) {
+    struct stat st;
+    obj_map_t *map;
+    obj_ver_t ver;
+    void *m;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+	return 0;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+	close(fd);
+	errno = EINVAL;
+	return 0;
+    }
+    /* empty files cannot be mapped */
+    if (!st.st_size) {
+	close(fd);
+	if (!(ver = obj_put_(key, 0, (void*) "", 0, OBJ_PUT_ALWAYS | OBJ_PUT_COPY, 0, 0, ttl, 0)))
+	    errno = ENOMEM;
+	return ver;
+    }
+    m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+	close(fd);
+	return 0;
+    }
+    if (!(map = obj_map_new(m, st.st_size))) {
+	munmap(m, st.st_size);
+	close(fd);
+	errno = ENOMEM;
+	return 0;
+    }
+    map->fd = fd;
+    if (!(ver = obj_put_(key, 0, m, st.st_size, OBJ_PUT_ALWAYS, 0, map, ttl, 0)))
+	errno = ENOMEM;
+    /* the entry holds its own reference */
+    obj_map_release(map);
+    return ver;
+}
+
+int obj_file(obj_entry_t *e, obj_len_t *off) {
+    if (!(e->flags & OBJ_SNAP) || !e->map || e->map->fd == -1)
+	return -1;
+    *off = (obj_len_t) (((char*) e->obj) - ((char*) e->map->addr));
+    return e->map->fd;
+}
+
+uint64_t obj_expiry(obj_entry_t *e) {
+    uint64_t now;
+    if (!e->expires)
+	return 0;
+    now = obj_now_ms();
+    return obj_wall_ms() + (e->expires > now ? e->expires - now : 0);
+}
+
+int obj_foreach(obj_iter_fn_t fn, void *arg) {
+    unsigned long id = 0, last; /* default store first, then namespaces by id */
+    char *fk = 0;         /* buffer for ns/key */
+    size_t fkl = 0;
+    int i, res = 0;
+    while (!res) {
+	obj_store_t *st;
+	for (i = 0; i < OBJ_SHARDS && !res; i++) {
+	    obj_table_t *tab;
+	    unsigned long j;
+	    /* one section per shard so we don't hold up reclamation
+	       for the whole store */
+	    obj_read_begin();
+	    if ((st = obj_store_(0, id)) && (tab = A_LOAD(st->shard[i].tab)))
+		for (j = 0; j < tab->size && !res; j++) {
+		    obj_entry_t *e = A_LOAD(tab->slot[j]);
+		    const char *key;
+		    if (!e || e == OBJ_TOMB)
+			continue;
+		    key = e->key;
+		    if (id) {
+			size_t need = strlen(st->name) + strlen(key) + 2;
+			if (need > fkl) {
+			    char *nk = (char*) realloc(fk, need * 2);
+			    if (!nk) {
+				res = -1;
+				break;
+			    }
+			    fk = nk;
+			    fkl = need * 2;
+			}
+			sprintf(fk, "%s/%s", st->name, key);
+			key = fk;
+		    }
+		    res = fn(key, e, ((e->flags & OBJ_PINNED) ? OBJ_ITER_PINNED : 0) |
+			     (id ? OBJ_ITER_NS : 0), arg);
+		}
+	    obj_read_end();
+	}
+	/* next namespace */
+	obj_read_begin();
+	last = id;
+	for (st = A_LOAD(obj_ns_list); st; st = A_LOAD(st->next))
+	    if (st->id > last && (id == last || st->id < id))
+		id = st->id;
+	obj_read_end();
+	if (id == last)
+	    break;
+    }
+    free(fk);
+    return res;
+}
+
+static void obj_store_init_(obj_store_t *st) {
+    int i;
+    for (i = 0; i < OBJ_SHARDS; i++) {
+	pthread_mutex_init(&st->shard[i].mutex, 0);
+	st->shard[i].store = st;
+    }
+    pthread_mutex_init(&st->evict_mutex, 0);
+    st->policy = OBJ_EVICT_GDSF;
+}
+
+int obj_ns_create(const char *name) {
+    obj_store_t *st;
+    if (!*name || strchr(name, '/'))
+	return -1;
+    pthread_mutex_lock(&obj_ns_mutex);
+    for (st = obj_ns_list; st; st = st->next)
+	if (!strcmp(st->name, name)) {
+	    pthread_mutex_unlock(&obj_ns_mutex);
+	    return 0;
+	}
+    if (!(st = (obj_store_t*) calloc(1, sizeof(obj_store_t) + strlen(name)))) {
+	pthread_mutex_unlock(&obj_ns_mutex);
+	return -1;
+    }
+    strcpy(st->name, name);
+    obj_store_init_(st);
+    st->id = ++obj_ns_serial;
+    st->next = obj_ns_list;
+    A_STORE(obj_ns_list, st);
+    pthread_mutex_unlock(&obj_ns_mutex);
+    return 1;
+}
+
+int obj_ns_drop(const char *name) {
+    obj_store_t *st, **prev = &obj_ns_list;
+    pthread_mutex_lock(&obj_ns_mutex);
+    while ((st = *prev) && strcmp(st->name, name))
+	prev = &st->next;
+    if (st) {
+	/* readers and writers that found the store are in read
+	   sections, so it is released (with all entries) after
+	   they are done */
+	A_STORE(*prev, st->next);
+	obj_retire_(&st->ret, OBJ_RET_STORE);
+	wal_drop(name, A_LOAD(obj_version));
+    }
+    pthread_mutex_unlock(&obj_ns_mutex);
+    return st ? 1 : 0;
+}
+
+char *obj_ns_names() {
+    obj_store_t *st;
+    size_t len = 1;
+    char *res, *c;
+    pthread_mutex_lock(&obj_ns_mutex);
+    for (st = obj_ns_list; st; st = st->next)
+	len += strlen(st->name) + 1;
+    if ((c = res = (char*) malloc(len))) {
+	for (st = obj_ns_list; st; st = st->next) {
+	    strcpy(c, st->name);
+	    c += strlen(c) + 1;
+	}
+	*c = 0;
+    }
+    pthread_mutex_unlock(&obj_ns_mutex);
+    return res;
+}
+
+/* what obj_commit() prepares for each item before the read section */
+typedef struct obj_prep_s {
+    void *sfs;
+    obj_len_t sfs_len;
+    unsigned long pslot;
+} obj_prep_t;
+
+obj_ver_t obj_commit(obj_item_t *items, int n, int mode, obj_hold_t *hold) {
+    obj_ver_t ver;
+    int i, ok = 1;
+    obj_prep_t *prep;
+    /* R errors can only happen here, before anything is allocated */
+    if (!hold)
+	obj_protect_reserve_(n);
+    if (!(prep = (obj_prep_t*) calloc(n ? n : 1, sizeof(obj_prep_t))))
+	return 0;
+    for (i = 0; i < n; i++)
+	if (obj_sfs_(items[i].sWhat, items[i].data, &prep[i].sfs, &prep[i].sfs_len)) {
+	    while (i--)
+		free(prep[i].sfs);
+	    free(prep);
+	    return 0;
+	}
+    if (!hold)
+	for (i = 0; i < n; i++)
+	    if (items[i].sWhat)
+		prep[i].pslot = obj_protect_(items[i].sWhat);
+    obj_read_begin();
+    pthread_rwlock_rdlock(&obj_commit_lock);
+    ver = __atomic_add_fetch(&obj_version, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < n; i++) {
+	const char *skey;
+	obj_store_t *st = obj_store_of_(items[i].key, &skey);
+	items[i].version = obj_store_put_(st, items[i].key, skey, items[i].sWhat,
+					  items[i].data, items[i].len,
+					  (mode & OBJ_PUT_COPY) | OBJ_PUT_ALWAYS | OBJ_PUT_NODEPS,
+					  0, 0, 0, 0, prep[i].sfs, prep[i].sfs_len,
+					  &prep[i].pslot, hold, ver);
+	if (!items[i].version) {
+	    free(prep[i].sfs);
+	    ok = 0;
+	}
+	obj_unprotect_(prep[i].pslot);
+    }
+    free(prep);
+    pthread_rwlock_unlock(&obj_commit_lock);
+#ifndef NO_DEPS
+    /* one pass for all keys */
+    deps_complete_items(items, n);
+#endif
+    obj_read_end();
+    return ok ? ver : 0;
+}
+
+obj_hold_t *obj_hold_new(SEXP sHold) {
+    obj_hold_t *h = (obj_hold_t*) malloc(sizeof(obj_hold_t));
+    if (h) {
+	h->pslot = obj_protect_(sHold);
+	h->refs = 1;
+    }
+    return h;
+}
+
+void obj_hold_release(obj_hold_t *h) {
+    if (!--h->refs) {
+	obj_unprotect_(h->pslot);
+	free(h);
+    }
+}
+
+void obj_cache(obj_entry_t *e, SEXP sWhat) {
+    e->pslot = obj_protect_(sWhat);
+    e->sWhat = sWhat;
+}
+
+void obj_add(const char *key, SEXP sWhat, void *data, obj_len_t len) {
+    obj_put(key, sWhat, data, len, OBJ_PUT_ALWAYS, 0);
 }
 
 void obj_gc() {
-    pthread_mutex_lock(&obj_mutex);
-    /* FIXME: is this safe? We are hoping that
-       R_ReleaseObject() cannot longjmp... */
-    while (obj_gc_pool) {
-	obj_entry_t *c = obj_gc_pool; 
-	if (c->sWhat)
-	    R_ReleaseObject(c->sWhat);
-	obj_gc_pool = c->next;
-	free(c);
+    obj_entry_t *pool;
+    obj_reclaim(1);
+    pthread_mutex_lock(&obj_gc_mutex);
+    pool = obj_gc_pool;
+    obj_gc_pool = 0;
+    pthread_mutex_unlock(&obj_gc_mutex);
+    /* releasing slots doesn't allocate, so it cannot longjmp */
+    while (pool) {
+	obj_entry_t *c = pool;
+	pool = c->next;
+	if (c->hold)
+	    obj_hold_release(c->hold);
+	else
+	    obj_unprotect_(c->pslot);
+	obj_free_payload(c);
+	obj_entry_release(c);
     }
-    pthread_mutex_unlock(&obj_mutex);
 }
 
-static obj_entry_t *obj_get_(const char *key, int rm) {
-    obj_entry_t *e = obj_root, *prev = 0;
-    while (e) {
-	if (!strcmp(key, e->key)) {
-	    if (rm) {
-		if (prev)
-		    prev->next = e->next;
-		else
-		    obj_root = e->next;
-		e->next = obj_gc_pool;
-		obj_gc_pool = e;
+/* looks up the newest version of the key up to view (or the current
+   one if latest is set) and records the access */
+static obj_entry_t *obj_get_(const char *key, obj_ver_t view, int latest) {
+    const char *fkey = key;
+    obj_entry_t *e = 0, **sl;
+    obj_store_t *st;
+    uint64_t hash;
+    obj_read_begin();
+    st = obj_store_of_(key, &key);
+    hash = obj_hash(key, strlen(key));
+    if ((sl = obj_find_(obj_shard_of(st, hash), key, hash)) && (e = A_LOAD(*sl))) {
+	if (!latest)
+	    while (e && e->version > view)
+		e = A_LOAD(e->older);
+	if (e && obj_is_expired_(e)) /* the timer has not fired yet */
+	    e = 0;
+	else if (e) {
+	    obj_touch_(st, e);
+	    if (A_LOAD(obj_track)) {
+		__atomic_store_n(&e->accessed, obj_wall_ms(), __ATOMIC_RELAXED);
+		/* the full key, so namespaces have distinct hashes */
+		obj_hot_add_(fkey, hash ^ (st->id * 0x9E3779B97F4A7C15ull));
 	    }
-	    return e;
 	}
-	prev = e;
-	e = e->next;
     }
-    return 0;
+    obj_read_end();
+    return e;
+}
+
+obj_entry_t *obj_get_at(const char *key, obj_ver_t view) {
+    return obj_get_(key, view, 0);
 }
 
 obj_entry_t *obj_get(const char *key, int rm) {
-    obj_entry_t *obj;
-    pthread_mutex_lock(&obj_mutex);
-    obj = obj_get_(key, rm);
-    pthread_mutex_unlock(&obj_mutex);
-    return obj;
+    const char *fkey = key;
+    obj_entry_t *e = 0, **sl;
+    obj_store_t *st;
+    obj_shard_t *sh;
+    uint64_t hash;
+    if (!rm)
+	return obj_get_(key, 0, 1);
+    obj_read_begin();
+    st = obj_store_of_(key, &key);
+    hash = obj_hash(key, strlen(key));
+    sh = obj_shard_of(st, hash);
+    pthread_mutex_lock(&sh->mutex);
+    if ((sl = obj_find_(sh, key, hash)))
+	e = obj_unlink_(sh, sl);
+    pthread_mutex_unlock(&sh->mutex);
+    if (e)
+	wal_del(fkey, st->id != 0, e->version);
+    obj_read_end();
+    return e;
 }
 
 void obj_init() {
     if (!obj_init_) {
-	pthread_mutex_init(&obj_mutex, 0);
+	pthread_mutex_init(&obj_gc_mutex, 0);
+	obj_store_init_(&obj_default);
+	pthread_key_create(&obj_thr_key, obj_thr_exit);
+	/* never handed out to a single thread */
+	obj_thr_shared.in_use = 1;
+	obj_thr_shared.next = obj_threads;
+	A_STORE(obj_threads, &obj_thr_shared);
+	pthread_atfork(obj_prefork, obj_forked_parent, obj_forked_child);
 	obj_init_ = 1;
 	dep_init();
     }
@@ -6,18 +6,29 @@
    NOTES:
    - obj_init() MUST be called before any of the functions are used
 
-   - obj_get() can be called from any thread, but the result is only
-     valid until obj_gc() call
+   - obj_get() can be called from any thread without blocking
+     writers. The result may only be used inside a read section,
+     i.e., between obj_read_begin() and obj_read_end() calls
+     of the same thread. Entries that are removed in the meantime
+     stay valid until the end of the read section.
 
-   - obj_add() 
+   - obj_add() takes ownership of data if sWhat is NULL, it must be
+     allocated with obj_payload_alloc() and will be released once the
+     entry is removed and no reader can access it anymore.
+
+   - if a memory budget is set (obj_set_budget()), payloads owned
+     by the store may be evicted by any put, so their keys can
+     disappear at any time unless they are pinned.
 */
 
 #ifndef OSRV_OBJ_H_
 #define OSRV_OBJ_H_
 
+#include <stdint.h>
 #include <Rinternals.h>
 
 typedef unsigned long int obj_len_t;
+typedef unsigned long int obj_ver_t;
 
 #ifndef OSRV_OBJ_STRUCT_
 
@@ -26,29 +37,296 @@ struct obj_entry_s {
     obj_len_t len;
     void *obj;
     SEXP sWhat;
+    obj_ver_t version; /* unique, increasing with each put (or commit) */
+    /* SFS form of sWhat if it cannot be serialised outside
+       of the R thread (see sfs_needs_r()), NULL otherwise */
+    void *sfs;
+    obj_len_t sfs_len;
 };
 
 #endif
 
 typedef struct obj_entry_s obj_entry_t;
 
+struct shm_seg_s; /* see shm.h */
+
 void obj_init();
 
 /* add object to the object store
-   Uses R_PreserveObject on sWhat so must be called from a place
-   where R API calls are safe (unless sWhat is NULL).
-   key is copied, sWhat/data is stored as-is
+   Protects sWhat from garbage collection (until the entry is released
+   by obj_gc()) so must be called from a place where R API calls are
+   safe (unless sWhat is NULL).
+   key is copied, sWhat/data is stored as-is, if sWhat is NULL
+   then data must be allocated by obj_payload_alloc() and the store
+   owns it
 */
 void obj_add(const char *key, SEXP sWhat, void *data, obj_len_t len);
 
+/* modes for obj_put() */
+#define OBJ_PUT_ALWAYS  0 /* add or replace */
+#define OBJ_PUT_ABSENT  1 /* only add if the key doesn't exist */
+#define OBJ_PUT_VERSION 2 /* only replace if the current version matches */
+/* flag that can be added to the mode: the store makes its own copy
+   of data (if sWhat is NULL), the caller keeps the ownership */
+#define OBJ_PUT_COPY    0x100
+
+/* payloads up to this size are allocated by the store efficiently,
+   so it is best to pass them with OBJ_PUT_COPY from a local buffer */
+#define OBJ_SMALL_MAX   2048
+
+/* same as obj_add(), but the put can be conditional (see mode).
+   An existing entry of the same key is replaced atomically.
+   Returns the version of the new entry or 0 if the condition
+   was not met (or out of memory), in which case the store does
+   NOT take ownership of data. */
+obj_ver_t obj_put(const char *key, SEXP sWhat, void *data, obj_len_t len,
+		  int mode, obj_ver_t version);
+
+/* same as obj_put(), but if ttl is not 0 then the entry expires
+   after ttl milliseconds (unless it is replaced or removed before).
+   Expired keys are posted on the deps queue with DEPS_MSG_EXPIRED. */
+obj_ver_t obj_put_ttl(const char *key, SEXP sWhat, void *data, obj_len_t len,
+		      int mode, obj_ver_t version, unsigned long ttl);
+
+/* same as obj_put_ttl() for an R object sWhat with its SFS-serialised
+   form in the shared memory segment seg (see shm.h) which is published
+   with the entry. The store owns seg if the put succeeds. */
+obj_ver_t obj_put_shared(const char *key, SEXP sWhat, struct shm_seg_s *seg,
+			 int mode, obj_ver_t version, unsigned long ttl);
+
+/* allocates memory for a payload to be passed to the store. Large
+   payloads are mapped directly (and pre-faulted) so they are returned
+   to the system once removed. */
+void *obj_payload_alloc(size_t len);
+/* releases a payload that was not passed to the store */
+void obj_payload_free(void *data);
+
+/* use huge pages for large payloads (see BIG_HUGE_* in slab.h) */
+void obj_set_hugepages(int mode);
+
+typedef struct obj_alloc_stat_s {
+    size_t mapped, resident; /* large payloads */
+    size_t slab;             /* reserved for entries and small payloads */
+    int hugepages;
+} obj_alloc_stat_t;
+
+void obj_alloc_stat(obj_alloc_stat_t *st);
+
+/* sets the R object of an entry without one (e.g., a raw vector with
+   the content of its payload), it is released with the entry. Must be
+   called from the R thread inside a read section. */
+void obj_cache(obj_entry_t *e, SEXP sWhat);
+
 /* release all objects that were deleted
-   Must be called from a place where R API is safe. */
+   Must be called from a place where R API is safe.
+   Removed entries without R objects are released automatically,
+   but entries holding R objects are only released here. */
 void obj_gc();
 
 /* retrieves object for a key
    if rm != 0 then the object is also removed from the store
-   This function is thread-safe, but the result is only valid until
-   the next call to obj_gc() */
+   This function is thread-safe, but the result may only be used
+   inside a read section (see below) */
 obj_entry_t *obj_get(const char *key, int rm);
 
+/* references: an entry obtained inside a read section and referenced
+   by obj_ref() stays valid (including its payload) after the end of
+   the section until obj_unref() is called, even if it is removed from
+   the store in the meantime. obj_unref() can be called from any
+   thread, but entries with R objects are only released by obj_gc(). */
+void obj_ref(obj_entry_t *e);
+void obj_unref(obj_entry_t *e);
+
+/* views: a view pins the state of the store after its version,
+   readers can use it to get a consistent set of keys while writers
+   carry on. Replaced versions are kept as long as a view may need
+   them. Removed (or evicted/expired) keys disappear from views. */
+
+/* creates a view, returns -1 if out of memory */
+int obj_view_begin(obj_ver_t *view);
+/* releases the view, versions only it could see are released */
+void obj_view_end(obj_ver_t view);
+/* same as obj_get(key, 0) but returns the version of the view */
+obj_entry_t *obj_get_at(const char *key, obj_ver_t view);
+
+typedef struct obj_item_s {
+    const char *key;
+    SEXP sWhat;
+    void *data;
+    obj_len_t len;
+    obj_ver_t version; /* set by obj_commit(), 0 if not stored */
+} obj_item_t;
+
+/* holders: instead of preserving the R object of each entry, the
+   caller can pass a holder of an R object (e.g., a list) which
+   references all of them, so it is preserved only once and released
+   with the last entry using it. Must be used from the R thread. */
+typedef struct obj_hold_s obj_hold_t;
+
+/* preserves sHold, returns NULL if out of memory */
+obj_hold_t *obj_hold_new(SEXP sHold);
+/* drops the reference of the caller */
+void obj_hold_release(obj_hold_t *h);
+
+/* puts all items atomically with respect to views, i.e., views see
+   either all of them or none, all get the same version. The mode can
+   be OBJ_PUT_ALWAYS and OBJ_PUT_COPY, the same rules as for obj_put()
+   apply to each item. If hold is not NULL, it must protect the R
+   objects of all items. Returns the version or 0 if some items could
+   not be stored (out of memory), check their version in that case. */
+obj_ver_t obj_commit(obj_item_t *items, int n, int mode, obj_hold_t *hold);
+
+/* eviction policies */
+#define OBJ_EVICT_GDSF 0 /* Greedy-Dual-Size-Frequency */
+#define OBJ_EVICT_LRU  1 /* least recently used */
+#define OBJ_EVICT_LFU  2 /* least frequently used */
+
+/* sets the limit (in bytes, 0 = unlimited) on the payloads owned by
+   the store ns (NULL = default store), entries are evicted as needed.
+   Evicted keys are posted on the deps queue with the DEPS_MSG_EVICTED
+   message. Returns 0 if the namespace doesn't exist. */
+int obj_set_budget(const char *ns, size_t limit, int policy);
+
+typedef struct obj_mem_stat_s {
+    size_t limit, used, entries, evicted, evicted_bytes;
+    int policy;
+    /* spill tier */
+    size_t spill_limit, spill_used, spill_entries, spills, promoted;
+    size_t expired; /* entries removed because their TTL ran out */
+} obj_mem_stat_t;
+
+/* returns 0 if the namespace doesn't exist */
+int obj_mem_stat(const char *ns, obj_mem_stat_t *st);
+
+/* namespaces: separate stores with their own index, budget and
+   statistics. Keys of the form <ns>/<key> are stored in the
+   namespace <ns> if it exists, otherwise in the default store.
+   The spill directory and limit are shared by all stores. */
+
+/* returns 1 if created, 0 if it exists already and -1 on error
+   (invalid name - empty or containing / - or out of memory) */
+int obj_ns_create(const char *name);
+/* removes the namespace with all its entries, returns 0 if not found */
+int obj_ns_drop(const char *name);
+/* names of all namespaces, each terminated by \0 with an empty
+   string at the end. Must be released with free(), NULL on error */
+char *obj_ns_names();
+
+/* access statistics: if tracking is on, obj_get() records the time
+   of the access and feeds the hot key tracker, puts record the
+   creation time and servers report the bytes sent with obj_served().
+   Hits are always counted (they are used for eviction). */
+
+/* k > 0 turns tracking on with k hot key counters (resetting them),
+   0 turns it off. Returns -1 if out of memory. */
+int obj_set_tracking(int k);
+
+/* bytes of the payload of e were sent to a client (read section) */
+void obj_served(obj_entry_t *e, obj_len_t len);
+
+typedef struct obj_key_stat_s {
+    obj_len_t len;
+    obj_ver_t version;
+    uint64_t hits, served;
+    uint64_t created, accessed; /* ms since the epoch, 0 = unknown */
+} obj_key_stat_t;
+
+/* returns 0 if the key was not found */
+int obj_key_stat(const char *key, obj_key_stat_t *ks);
+
+/* longer keys are truncated in the hot key list */
+#define OBJ_HOT_KEY 128
+
+typedef struct obj_hot_s {
+    char key[OBJ_HOT_KEY];
+    uint64_t count, error; /* count over-estimates by at most error */
+} obj_hot_t;
+
+/* fills res with up to n hottest keys (descending count), returns
+   their number (0 if tracking is off) or -1 if out of memory */
+int obj_hot(obj_hot_t *res, int n);
+
+/* deduplication: payloads owned by the store of at least min_size
+   bytes (0 = off) are hashed when put and entries with identical
+   payloads share one copy. Existing entries are not affected. */
+void obj_set_dedup(size_t min_size);
+
+typedef struct obj_dedup_stat_s {
+    size_t min_size;
+    size_t blobs, bytes;  /* distinct payloads and their size */
+    size_t refs, logical; /* entries using them and their total size */
+    size_t hits;          /* puts that found an identical payload */
+} obj_dedup_stat_t;
+
+void obj_dedup_stat(obj_dedup_stat_t *st);
+
+/* pinned entries are never evicted, returns 0 if the key was not found */
+int obj_pin(const char *key, int pin);
+
+/* sets the spill directory (NULL = none) and its limit in bytes
+   (0 = unlimited). Entries that exceed the budget are then written
+   to the directory and served from a memory map instead of being
+   evicted. Returns non-zero on error. */
+int obj_set_spill(const char *dir, size_t limit);
+
+/* moves a spilled entry back to memory. Returns 1 on success (or if
+   it is not spilled), 0 if not found and -1 if out of memory. */
+int obj_promote(const char *key);
+
+/* hint that [off, off + len) of the payload will be read soon,
+   must be called inside a read section */
+void obj_will_read(obj_entry_t *e, obj_len_t off, obj_len_t len);
+
+/* shared read-only map that payloads can point into (e.g., a restored
+   snapshot), unmapped with munmap() once it is no longer used */
+typedef struct obj_map_s obj_map_t;
+
+/* creates a map record with one reference held by the caller */
+obj_map_t *obj_map_new(void *addr, size_t len);
+/* drops a reference */
+void obj_map_release(obj_map_t *m);
+
+/* same as obj_put_ttl() with OBJ_PUT_ALWAYS, but data points into map
+   and is not owned by the store. Each entry holds a reference to the
+   map. Returns 0 if out of memory. */
+obj_ver_t obj_put_map(const char *key, void *data, obj_len_t len, obj_map_t *map,
+		      unsigned long ttl);
+
+/* puts an entry with the content of the file at path (OBJ_PUT_ALWAYS).
+   The file is mapped (not read) and kept open, so it must not be
+   modified while the entry exists. Returns 0 on error (errno). */
+obj_ver_t obj_put_file(const char *key, const char *path, unsigned long ttl);
+
+/* if the payload of e is in a file that is open (see obj_put_file()),
+   returns its descriptor and sets off to the offset of the payload
+   in the file, otherwise returns -1. The descriptor is only valid
+   inside the read section. */
+int obj_file(obj_entry_t *e, obj_len_t *off);
+
+/* wall time of the expiry of e in ms since the epoch, 0 = never */
+uint64_t obj_expiry(obj_entry_t *e);
+
+/* calls fn for each entry in all stores until it returns non-zero,
+   that value is then returned. fn is called inside a read section
+   so it must not long-jump and e is only valid during the call.
+   key is the full key (<ns>/<key> for entries in namespaces). */
+typedef int (*obj_iter_fn_t)(const char *key, obj_entry_t *e, int flags, void *arg);
+/* flags passed to obj_iter_fn_t */
+#define OBJ_ITER_PINNED 0x01
+#define OBJ_ITER_NS     0x02 /* entry is in a namespace */
+int obj_foreach(obj_iter_fn_t fn, void *arg);
+
+/* to be called in a forked child that only reads from the store
+   (from any number of threads): nothing is released anymore, because
+   releasing entries can affect the parent (e.g., shared memory) */
+void obj_freeze();
+
+/* read sections: entries (and their payload) obtained from obj_get()
+   remain valid until obj_read_end() is called. Sections can be
+   nested, but must not be held for longer than necessary, because
+   no removed objects can be released while any thread is inside
+   a read section. */
+void obj_read_begin();
+void obj_read_end();
+
 #endif
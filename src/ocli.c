@@ -1,6 +1,7 @@
 /* Rudimentary osrv TCP client
    
 SEXP C_ask(SEXP sHost, SEXP sPort, SEXP sCmd, SEXP sSFS);
+SEXP C_bcast(SEXP sKey, SEXP sPeers);
 
  */
 
@@ -18,13 +19,22 @@ SEXP C_ask(SEXP sHost, SEXP sPort, SEXP sCmd, SEXP sSFS);
 
 #include <Rinternals.h>
 
+#include "obj.h"
+
 #define SOCKET int
 #define closesocket(X) close(X)
 #define FETCH_SIZE (512*1024)
+#define MAX_SEND (1024*1024) /* 1Mb */
 
 /* from sock_restore.c */
 SEXP sock_restore(int s, int need_opts);
 
+/* from osrv.c */
+int bcast_next(const char *key, long len, char *peers, int *skipped);
+
+/* from mem_store.c */
+SEXP C_mem_store(SEXP sWhat, SEXP sVerb);
+
 SEXP C_ask(SEXP sHost, SEXP sPort, SEXP sCmd, SEXP sSFS) {
     SOCKET ss;
     int n, l, i = 1, port = asInteger(sPort), use_sfs = asInteger(sSFS);
@@ -172,3 +182,104 @@ SEXP C_ask(SEXP sHost, SEXP sPort, SEXP sCmd, SEXP sSFS) {
     /* never reached, but compiler may not know */
     return R_NilValue;
 }
+
+/* Broadcast a locally stored object along a chain of peers:
+   we only send to the first peer which forwards to the next one
+   while receiving (see BCAST in osrv.c) */
+SEXP C_bcast(SEXP sKey, SEXP sPeers) {
+    SOCKET ss;
+    int i = 0, n, skipped = 0, np = 0;
+    unsigned long len, pos = 0;
+    size_t plen = 1;
+    const char *key, *data;
+    char *peers, *c, buf[16];
+    obj_entry_t *o;
+    struct timeval tv;
+
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    if (TYPEOF(sPeers) != STRSXP || LENGTH(sPeers) < 1)
+	Rf_error("peers must be a non-empty character vector");
+    key = CHAR(STRING_ELT(sKey, 0));
+
+    n = LENGTH(sPeers);
+    while (i < n)
+	plen += strlen(CHAR(STRING_ELT(sPeers, i++))) + 1;
+    peers = c = R_alloc(plen, 1);
+    for (i = 0; i < n; i++) {
+	const char *p = CHAR(STRING_ELT(sPeers, i));
+	size_t l = strlen(p);
+	memcpy(c, p, l);
+	c += l;
+	*(c++) = ' ';
+    }
+    *c = 0;
+
+    obj_init();
+    /* the payload is only valid inside the read section
+       so we must not raise errors until it is ended */
+    obj_read_begin();
+    if (!(o = obj_get(key, 0))) {
+	obj_read_end();
+	Rf_error("Object '%s' not found", key);
+    }
+    if (o->obj) {
+	data = (const char*) o->obj;
+	len = o->len;
+    } else { /* SFS object - serialise first since we need the size */
+	SEXP sWhat = o->sWhat, sRaw;
+	/* R objects are only released by the R thread (us) */
+	obj_read_end();
+	sRaw = PROTECT(C_mem_store(sWhat, ScalarLogical(0)));
+	np++;
+	data = (const char*) RAW(sRaw);
+	len = XLENGTH(sRaw);
+	obj_read_begin();
+    }
+    if (!len) {
+	obj_read_end();
+	Rf_error("Cannot broadcast empty object");
+    }
+
+    if ((ss = bcast_next(key, (long) len, peers, &skipped)) == -1) {
+	obj_read_end();
+	Rf_error("None of the peers could be reached");
+    }
+
+    while (pos < len) {
+	int ts = (len - pos > MAX_SEND) ? MAX_SEND : ((int) (len - pos));
+	int sent = send(ss, data + pos, ts, 0);
+	if (sent < 1) {
+	    obj_read_end();
+	    closesocket(ss);
+	    Rf_error("Error while sending, sent %lu of %lu bytes %s", pos, len, errno ? strerror(errno) : "");
+	}
+	pos += sent;
+    }
+    obj_read_end();
+
+    /* enable timeout so we can support R-level interrupts
+       while waiting for the whole chain to respond */
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt(ss, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof tv);
+    pos = 0;
+    while (pos < sizeof(buf) - 1) {
+	n = recv(ss, buf + pos, 1, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+	    R_CheckUserInterrupt();
+	    continue;
+	}
+	if (n < 1 || buf[pos] == '\n')
+	    break;
+	pos++;
+    }
+    closesocket(ss);
+    UNPROTECT(np);
+    while (pos > 0 && buf[pos - 1] == '\r') pos--;
+    buf[pos] = 0;
+    if (!pos)
+	Rf_error("Connection closed unexpectedly");
+    /* the first peer may have been skipped by us */
+    return mkString((skipped && !strcmp(buf, "OK")) ? "FWD" : buf);
+}
@@ -7,10 +7,26 @@
 === protocol:
 
 GET /data/<key>
-PUT /data/<key>
+PUT /data/<key>[?nx|?ver=<version>][&ttl=<seconds>]
 HEAD /data/<key>
 DELETE /data/<key>
 
+GET, HEAD and PUT responses include the object version as ETag.
+GET supports a single byte range (Range: bytes=<first>-[<last>] or
+bytes=-<suffix>), the response is then 206 Partial Content (or 416
+if the range is not satisfiable), other ranges are ignored.
+PUT replaces an existing object atomically, ?nx only stores if the
+key doesn't exist and ?ver= only if the current version matches,
+otherwise the response is 412 Precondition Failed. ?ttl= (can be
+combined with the above using &) sets the time after which the object
+expires. Keys can contain /, so /data/<ns>/<key> addresses <key> in
+the namespace <ns>.
+
+If the write-ahead log is open, PUT and DELETE only respond once the
+change is on disk, 500 means the change was made, but could not be
+logged. A PUT without condition responds with 500 if the object could
+not be stored (out of memory).
+
 === R API:
 
 SEXP C_start_http(SEXP sHost, SEXP sPort, SEXP sThreads);
@@ -21,6 +37,7 @@ SEXP C_start_http(SEXP sHost, SEXP sPort, SEXP sThreads);
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 /* for TCP_NODELAY */
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -28,6 +45,7 @@ SEXP C_start_http(SEXP sHost, SEXP sPort, SEXP sThreads);
 
 #include "therver.h"
 #include "obj.h"
+#include "wal.h"
 #include "http.h"
 #include "evqueue.h"
 #include "deps.h"
@@ -49,37 +67,133 @@ int http_store(http_connection_t *conn, SEXP sWhat);
 /* FIXME: we register only one queue for the /work API */
 static ev_queue_t *queue;
 
+/* request bodies are allocated by obj_payload_alloc() */
+static ev_entry_t *ev_free_payload(ev_entry_t *e) {
+    if (e && e->data)
+	obj_payload_free(e->data);
+    return e;
+}
+
+/* parses a single range "bytes=<first>-[<last>]" or "bytes=-<suffix>",
+   returns 1 if valid, -1 if not satisfiable and 0 if it is not
+   supported (then the whole object is sent) */
+static int http_range(const char *r, obj_len_t total, obj_len_t *off, obj_len_t *len) {
+    unsigned long first, last;
+    char *c;
+    if (strncmp(r, "bytes=", 6) || strchr(r, ','))
+	return 0;
+    r += 6;
+    if (*r == '-') { /* suffix */
+	last = strtoul(r + 1, &c, 10);
+	if (c == r + 1 || *c)
+	    return 0;
+	if (!last || !total)
+	    return -1;
+	*len = (last > total) ? total : last;
+	*off = total - *len;
+	return 1;
+    }
+    if (*r < '0' || *r > '9')
+	return 0;
+    first = strtoul(r, &c, 10);
+    if (*c != '-')
+	return 0;
+    if (c[1]) {
+	r = c + 1;
+	last = strtoul(r, &c, 10);
+	if (*c || last < first)
+	    return 0;
+    } else
+	last = total - 1;
+    if (first >= total)
+	return -1;
+    if (last >= total)
+	last = total - 1;
+    *off = first;
+    *len = last - first + 1;
+    return 1;
+}
+
+/* sends [off, off + len) of the payload of o (inside a read section),
+   straight from the file if it is backed by one */
+static int http_send_payload(http_connection_t *conn, obj_entry_t *o, obj_len_t off, obj_len_t len) {
+    obj_len_t foff;
+    int fd = obj_file(o, &foff);
+    if (fd != -1)
+	return http_sendfile(conn, fd, (off_t) (foff + off), len);
+    obj_will_read(o, off, len);
+    return http_send(conn, ((const char*) o->obj) + off, len);
+}
+
+/* GET/HEAD on /data/<key>, must be called inside a read section */
+static void http_get(http_request_t *req, http_connection_t *conn, const char *key) {
+    obj_entry_t *o = obj_get(key, 0);
+    obj_len_t off = 0, len;
+    int partial = 0;
+    char hdr[256];
+    /* FIXME: we have two choices: use chunked encoding to stream or
+       use mem_store and cache. For now we assume that the usage is for
+       large data so we stream, but that is an arbitrary decision. */
+    if (!o) {
+	http_response(conn, 404, "Object Not Found", 0, 0, 0);
+	return;
+    }
+    if (req->method == METHOD_GET && !o->obj && o->sWhat) {
+	snprintf(hdr, sizeof(hdr), "ETag: \"%lu\"\r\nTransfer-Encoding: chunked\r\n",
+		 (unsigned long) o->version);
+	http_response(conn, 200, "OK", "application/octet-stream", -1, hdr);
+	/* serialised at put time if we can't do it here */
+	if (!o->sfs)
+	    http_store(conn, o->sWhat);
+	else if (!http_send_chunk(conn, o->sfs, o->sfs_len))
+	    http_send_chunk(conn, 0, 0);
+	return;
+    }
+    len = o->len;
+    if (o->obj && req->range &&
+	(partial = http_range(req->range, o->len, &off, &len)) < 0) {
+	snprintf(hdr, sizeof(hdr), "Content-Range: bytes */%lu\r\n", (unsigned long) o->len);
+	http_response(conn, 416, "Range Not Satisfiable", 0, 0, hdr);
+	return;
+    }
+    snprintf(hdr, sizeof(hdr), "ETag: \"%lu\"\r\n%s", (unsigned long) o->version,
+	     o->obj ? "Accept-Ranges: bytes\r\n" : "");
+    if (partial > 0)
+	snprintf(hdr + strlen(hdr), sizeof(hdr) - strlen(hdr), "Content-Range: bytes %lu-%lu/%lu\r\n",
+		 (unsigned long) off, (unsigned long) (off + len - 1), (unsigned long) o->len);
+    /* http_response() only takes int lengths */
+    if (o->obj && len > INT_MAX)
+	snprintf(hdr + strlen(hdr), sizeof(hdr) - strlen(hdr), "Content-Length: %lu\r\n",
+		 (unsigned long) len);
+    http_response(conn, (partial > 0) ? 206 : 200, (partial > 0) ? "Partial Content" : "OK",
+		  "application/octet-stream", (o->obj && len <= INT_MAX) ? (int) len : -1, hdr);
+    if (req->method == METHOD_GET) {
+	if (!http_send_payload(conn, o, off, len))
+	    obj_served(o, len);
+    }
+}
+
 static void http_process(http_request_t *req, http_connection_t *conn) {
     if (!strncmp("/data/", req->path, 6)) {
 	/* FIXME: should we put some limits on the keys? */
-	char *c = req->path + 6;
+	char *c = req->path + 6, *query;
 	const char *key = req->path + 6;
-	/* end the key if we see / or ? */
-	while (*c && *c != '/' && *c != '?') c++;
+	/* end the key if we see ? (keys of namespaces contain /) */
+	while (*c && *c != '?') c++;
+	query = strchr(c, '?');
 	*c = 0;
 	if (req->method == METHOD_HEAD || req->method == METHOD_GET) {
-	    obj_entry_t *o = obj_get(key, 0);
-	    /* FIXME: we have two choices: use chunked encoding to stream or
-	       use mem_store and cache. For now we assume that the usage is for
-	       large data so we stream, but that is an arbitrary decision. */
-	    if (req->method == METHOD_GET && o && !o->obj && o->sWhat) {
-		http_response(conn, 200, "OK", "application/octet-stream", -1, "Transfer-Encoding: chunked\r\n");
-		http_store(conn, o->sWhat);
-		return;
-	    }
-	    if (!o) {
-		http_response(conn, 404, "Object Not Found", 0, 0, 0);
-		return;
-	    }
-	    http_response(conn, 200, "OK", "application/octet-stream",
-			  o->obj ? o->len : -1, 0);
-	    if (req->method == METHOD_GET)
-		http_send(conn, o->obj, o->len);
+	    /* the entry is only valid inside the read section */
+	    obj_read_begin();
+	    http_get(req, conn, key);
+	    obj_read_end();
 	    return;
 	}
 	if (req->method == METHOD_DELETE) {
 	    obj_entry_t *o = obj_get(key, 1);
-	    if (o) {
+	    if (o && wal_sync()) {
+		http_response(conn, 500, "Log Write Failed", 0, 0, 0);
+	    } else if (o) {
 		http_response(conn, 200, "OK", 0, 0, 0);
 	    } else {
 		http_response(conn, 404, "Object Not Found", 0, 0, 0);
@@ -87,11 +201,42 @@ static void http_process(http_request_t *req, http_connection_t *conn) {
 	    return;
 	}
 	if (req->method == METHOD_PUT) {
-	    obj_add(key, 0, req->body, req->content_length);
+	    int mode = OBJ_PUT_ALWAYS;
+	    obj_ver_t ver = 0;
+	    unsigned long ttl = 0;
+	    char hdr[64];
+	    /* parameters are separated by & */
+	    while (query && *(++query)) {
+		if (!strncmp(query, "nx", 2) && (!query[2] || query[2] == '&'))
+		    mode = OBJ_PUT_ABSENT;
+		else if (!strncmp(query, "ver=", 4)) {
+		    mode = OBJ_PUT_VERSION;
+		    ver = strtoul(query + 4, 0, 10);
+		} else if (!strncmp(query, "ttl=", 4)) {
+		    double t = strtod(query + 4, 0);
+		    if (t > 0) /* at least 1ms, 0 would mean no expiry */
+			ttl = (t < 0.001) ? 1 : ((unsigned long) (t * 1000.0));
+		}
+		query = strchr(query, '&');
+	    }
+	    if (!(ver = obj_put_ttl(key, 0, req->body, req->content_length, mode, ver, ttl))) {
+		/* the body remains ours and is freed with the request,
+		   unconditional puts can only fail for lack of memory */
+		if (mode == OBJ_PUT_ALWAYS)
+		    http_response(conn, 500, "Store Failed", 0, 0, 0);
+		else
+		    http_response(conn, 412, "Precondition Failed", 0, 0, 0);
+		return;
+	    }
 	    /* obj store takes ownership, so reset the request
 	       body pointer so it doesn't get freed */
 	    req->body = 0;
-	    http_response(conn, 200, "OK", 0, 0, 0);
+	    if (wal_sync()) {
+		http_response(conn, 500, "Log Write Failed", 0, 0, 0);
+		return;
+	    }
+	    snprintf(hdr, sizeof(hdr), "ETag: \"%lu\"\r\n", (unsigned long) ver);
+	    http_response(conn, 200, "OK", 0, 0, hdr);
 	    return;
 	}
     }
@@ -111,7 +256,7 @@ static void http_process(http_request_t *req, http_connection_t *conn) {
 	    http_response(conn, 403, "Invalid payload", 0, 0, 0);
 	    return;
 	}
-	e = ev_create(req->body, req->content_length, ev_free_data);
+	e = ev_create(req->body, req->content_length, ev_free_payload);
 	if (e) {
 	    /* queue took ownership */
 	    req->body = 0;
@@ -153,6 +298,8 @@ SEXP C_start_http(SEXP sHost, SEXP sPort, SEXP sThreads) {
 	Rf_error("Invalid number of threads %d", threads);
 
     obj_init();
+    /* bodies of PUT requests are passed to the store */
+    http_body_allocator(obj_payload_alloc, obj_payload_free);
     /* FIXME: this is a hack, we use the deps queue */
     if (!queue) queue = deps_queue();
     if (!therver(host, port, threads, do_process))
@@ -18,25 +18,111 @@ request: "DEL "<key>\n
 reponses:
   "OK\n" - found and removed
   "NF\n" - not found
+  "ERR\n" - removed, but the log could not be written
+
+request: "DROP "<ns>\n
+  removes the namespace <ns> with all its objects
+  (keys "<ns>/<key>" address objects in namespaces)
+reponses:
+  "OK\n" - found and removed
+  "NF\n" - not found
+  "ERR\n" - removed, but the log could not be written
 
 request: "HAS "<key>\n
 responses:
   "OK\n" - object found
   "NF\n"   - object not found
 
-request: "PUT "<key>\n<size>\n
+request: "VER "<key>\n
+responses:
+  "OK "<version>"\n" - object found, <version> changes
+     with every PUT of the key
+  "NF\n"   - object not found
+
+request: "VIEW "<op>\n
+  <op> "begin" pins a view of the store for the connection: GET, HAS,
+  RGET and VER then return the objects as they were at that point
+  (objects put by one commit are either all visible or none).
+  "begin" again replaces the view, "end" (or closing the connection)
+  releases it.
+responses:
+  "OK "<version>"\n" - view pinned (begin), objects up to <version>
+     are visible
+  "OK\n"  - view released (end)
+  "INV\n" - invalid <op>
+  "ERR\n" - error (out of memory)
+
+request: "PUT "<key>\n<size>[ <cond>]\n
+  an existing object of the same key is replaced atomically.
+  Optional <cond> makes the PUT conditional:
+  "nx"          - only store if the key does not exist
+  "ver="<version> - only replace if the current version matches
+  "ttl="<seconds> - the object expires after that time
 responses:
   "OK\n"  - success
+  "FAIL\n" - condition not met, nothing stored
   "INV\n" - invalid parameter (here length)
-  "ERR\n" - error (out of memory)
+  "ERR\n" - error (out of memory or the log could not be written)
+
+  If the write-ahead log is open (see o.wal()), PUT, BCAST, PART
+  (for the last part), DEL and DROP only respond once the change
+  is on disk.
+
+request: "BCAST "<key>\n<size>\n<peers>\n
+  <peers> is a space-separated list of host[:port] entries
+  (can be empty) followed by <size> bytes of payload.
+  The payload is stored locally and at the same time forwarded
+  (while it is still being received) to the first reachable peer
+  as BCAST with the remaining peers, so the object travels along
+  a chain. The response is sent once the downstream chain responded.
+responses:
+  "OK\n"  - stored on this node and all downstream nodes
+  "FWD\n" - stored on this node, but some downstream node failed
+  "INV\n", "ERR\n" - as for PUT
+
+request: "RGET "<key>\n<offset> <length>\n
+  range request, used by striped (parallel) transfers.
+  <length> 0 can be used to query the total size.
+responses:
+  "OK "<n>" "<total>"\n" - object found, followed by <n> bytes
+     of payload starting at <offset>, <total> is the object size
+  "NF\n"     - object not found
+  "INV\n"    - invalid range
+  "UNSUPP\n" - object cannot be accessed by range (SFS)
+
+request: "PART "<key>\n<id> <total> <offset> <size>\n
+  one part of a multi-part upload, followed by <size> bytes
+  of payload. <id> identifies the upload (no spaces, assigned by
+  the client). Parts can be sent in any order and over different
+  connections. The object is added to the store once all <total>
+  bytes have been received. Uploads without any activity for
+  UPLOAD_IDLE seconds are aborted.
+responses:
+  "OK\n"  - part received
+  "INV\n" - invalid parameters or inconsistent with other parts
+            (including parts overlapping with those received or
+            being received)
+  "ERR\n" - error (out of memory or the upload was aborted)
 
 all other requests:
 response:
   "UNSUPP\n" - unsupported
 
+=== forked snapshot server (C_fork):
+
+  serves the same protocol from a forked child which sees the store
+  as it was when it was forked, so SFS objects are serialised in
+  parallel without touching the R session. Only GET, HAS, VER and
+  RGET are supported (they take no locks that other threads of the
+  parent may have held at the time of the fork), anything else
+  responds with "UNSUPP\n" and closes the connection. VIEW is not
+  needed since the snapshot is consistent anyway.
+
 === R API:
 
 SEXP C_start(SEXP sHost, SEXP sPort, SEXP sThreads);
+SEXP C_fork(SEXP sHost, SEXP sPort, SEXP sThreads, SEXP sInterval);
+void osrv_fork_tick();
 
 */
 
@@ -48,9 +134,16 @@ SEXP C_start(SEXP sHost, SEXP sPort, SEXP sThreads);
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <poll.h>
 
 #include "therver.h"
+#include "sconn.h"
 #include "obj.h"
+#include "wal.h"
 
 #include <Rinternals.h>
 
@@ -63,10 +156,13 @@ SEXP C_start(SEXP sHost, SEXP sPort, SEXP sThreads);
 #define MAX_OBUF 2048
 #define MAX_SEND (1024*1024) /* 1Mb */
 
+#define DEFAULT_PORT 9012
+
 typedef struct {
     int  bol, n;
     char buf[MAX_BUF];
     char obuf[MAX_OBUF];
+    char sbuf[OBJ_SMALL_MAX]; /* payload of small PUTs */
 } work_t;
 
 static int send_buf(int s, const char* buf, obj_len_t len) {
@@ -81,11 +177,295 @@ static int send_buf(int s, const char* buf, obj_len_t len) {
     return 0;
 }
 
+/* sends [off, off + len) of the payload of o (inside a read section),
+   straight from the file if it is backed by one */
+static int send_payload(int s, obj_entry_t *o, obj_len_t off, obj_len_t len) {
+    obj_len_t foff;
+    int fd = obj_file(o, &foff);
+    if (fd != -1)
+	return socket_sendfile(s, fd, (off_t) (foff + off), len);
+    obj_will_read(o, off, len);
+    return send_buf(s, ((const char*) o->obj) + off, len);
+}
+
+/* reads one response line (without the newline), returns 0 on success */
+static int recv_line(int s, char *buf, int size) {
+    int p = 0;
+    while (p < size - 1) {
+	int n = recv(s, buf + p, 1, 0);
+	if (n < 1)
+	    return -1;
+	if (buf[p] == '\n')
+	    break;
+	p++;
+    }
+    while (p > 0 && buf[p - 1] == '\r') p--;
+    buf[p] = 0;
+    return 0;
+}
+
+/* connects to the first reachable peer in the (space-separated)
+   peers list and sends the BCAST header with the remaining peers.
+   Unreachable peers are skipped and *skipped is set if so.
+   Returns the socket or -1 if there are no peers left.
+   Also used by the client in ocli.c (C_bcast). */
+int bcast_next(const char *key, long len, char *peers, int *skipped) {
+    while (*peers) {
+	char *host = peers, *c, *hdr;
+	int port = DEFAULT_PORT, fs;
+	while (*host == ' ' || *host == '\t') host++;
+	if (!*host)
+	    break;
+	peers = host;
+	while (*peers && *peers != ' ' && *peers != '\t') peers++;
+	if (*peers)
+	    *(peers++) = 0;
+	if ((c = strrchr(host, ':'))) {
+	    *c = 0;
+	    port = atoi(c + 1);
+	}
+	fs = tcp_connect(host, port);
+	if (fs == -1) {
+	    *skipped = 1;
+	    continue;
+	}
+	if (!(hdr = (char*) malloc(strlen(key) + strlen(peers) + 64))) {
+	    closesocket(fs);
+	    return -1;
+	}
+	sprintf(hdr, "BCAST %s\n%ld\n%s\n", key, len, peers);
+	if (send_buf(fs, hdr, strlen(hdr))) {
+	    free(hdr);
+	    closesocket(fs);
+	    *skipped = 1;
+	    continue;
+	}
+	free(hdr);
+	return fs;
+    }
+    return -1;
+}
+
+/* d points to the (terminated) end of the command line,
+   returns the following line terminated in place and sets *next
+   to the byte following it, or NULL if it is not in the buffer */
+static char *param_line(char *d, char *be, char **next) {
+    char *l, *e;
+    if (d >= be)
+	return 0;
+    l = d + 1;
+    while (l < be && (*l == '\r' || *l == '\n')) l++;
+    e = l;
+    while (e < be && *e != '\n') e++;
+    if (e >= be)
+	return 0;
+    *next = e + 1;
+    *e = 0;
+    if (e > l && e[-1] == '\r') e[-1] = 0;
+    return l;
+}
+
+/* multi-part uploads in progress */
+typedef struct upload_s {
+    struct upload_s *next;
+    char *buf;
+    long total, received;
+    long *parts;    /* claimed ranges (start, end), sorted and disjoint */
+    int nparts, aparts;
+    int refs;       /* parts being received */
+    int aborted;    /* timed out, released once refs drops to 0 */
+    time_t active;  /* last activity */
+    char *key;
+    char id[1];
+} upload_t;
+
+/* uploads without any activity for that long (in seconds)
+   are aborted and their buffer is released */
+#define UPLOAD_IDLE 120
+
+static upload_t *uploads;
+static pthread_mutex_t upload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upload_cond = PTHREAD_COND_INITIALIZER;
+static int upload_reaping;
+
+static time_t upload_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void upload_free(upload_t *u) {
+    if (u->buf)
+	obj_payload_free(u->buf);
+    free(u->parts);
+    free(u);
+}
+
+/* unlinks u, must hold upload_mutex */
+static void upload_unlink(upload_t *u) {
+    upload_t *e = uploads, *prev = 0;
+    while (e && e != u) {
+	prev = e;
+	e = e->next;
+    }
+    if (!e)
+	return;
+    if (prev)
+	prev->next = u->next;
+    else
+	uploads = u->next;
+}
+
+/* aborts idle uploads, must hold upload_mutex */
+static void upload_expire(time_t now) {
+    upload_t *u = uploads;
+    while (u) {
+	upload_t *nx = u->next;
+	if (now - u->active >= UPLOAD_IDLE) {
+	    upload_unlink(u);
+	    if (u->refs)
+		u->aborted = 1;
+	    else
+		upload_free(u);
+	}
+	u = nx;
+    }
+}
+
+/* runs while there are uploads, so that abandoned ones are
+   released even if no other parts arrive */
+static void *upload_reaper(void *arg) {
+    pthread_mutex_lock(&upload_mutex);
+    while (uploads) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 1;
+	pthread_cond_timedwait(&upload_cond, &upload_mutex, &ts);
+	upload_expire(upload_now());
+    }
+    upload_reaping = 0;
+    pthread_mutex_unlock(&upload_mutex);
+    return 0;
+}
+
+/* claims the range off..off+len of an upload (created if needed)
+   for receiving. Returns NULL if inconsistent with other parts
+   (including overlaps) or out of memory, *err is set to 1 for the
+   latter. The caller must call upload_done() for a claimed part. */
+static upload_t *upload_claim(const char *key, const char *id, long total,
+			      long off, long len, int *err) {
+    upload_t *u;
+    int i = 0;
+    time_t now = upload_now();
+    pthread_mutex_lock(&upload_mutex);
+    upload_expire(now);
+    u = uploads;
+    while (u && strcmp(u->id, id))
+	u = u->next;
+    if (u) {
+	if (u->total != total || strcmp(u->key, key))
+	    u = 0;
+    } else if ((u = (upload_t*) calloc(1, sizeof(upload_t) + strlen(id) + strlen(key) + 1))) {
+	strcpy(u->id, id);
+	u->key = u->id + strlen(id) + 1;
+	strcpy(u->key, key);
+	u->total = total;
+	if (!(u->buf = (char*) obj_payload_alloc(total))) {
+	    free(u);
+	    u = 0;
+	    *err = 1;
+	} else {
+	    u->next = uploads;
+	    uploads = u;
+	    if (!upload_reaping) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		/* if we can't start it, uploads are still
+		   expired whenever a part arrives */
+		upload_reaping = !pthread_create(&thread, &attr, upload_reaper, 0);
+		pthread_attr_destroy(&attr);
+	    }
+	}
+    } else
+	*err = 1;
+    if (u) {
+	/* find the insertion point and check for overlaps */
+	while (i < u->nparts && u->parts[2 * i + 1] <= off)
+	    i++;
+	if (i < u->nparts && u->parts[2 * i] < off + len)
+	    u = 0;
+	else if (u->nparts == u->aparts) {
+	    int na = u->aparts ? u->aparts * 2 : 16;
+	    long *np = (long*) realloc(u->parts, sizeof(long) * 2 * na);
+	    if (np) {
+		u->parts = np;
+		u->aparts = na;
+	    } else {
+		u = 0;
+		*err = 1;
+	    }
+	}
+    }
+    if (u) {
+	memmove(u->parts + 2 * i + 2, u->parts + 2 * i, sizeof(long) * 2 * (u->nparts - i));
+	u->parts[2 * i] = off;
+	u->parts[2 * i + 1] = off + len;
+	u->nparts++;
+	u->refs++;
+	u->active = now;
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    return u;
+}
+
+/* releases a part claimed by upload_claim(), ok = 0 if the part was
+   not received (so it can be sent again). Commits the object into the
+   store once all bytes have been received. Returns -1 if the upload
+   was aborted in the meantime. */
+static int upload_done(upload_t *u, long off, long len, int ok) {
+    int complete = 0, res = 0;
+    pthread_mutex_lock(&upload_mutex);
+    u->refs--;
+    u->active = upload_now();
+    if (u->aborted) {
+	res = -1;
+	if (!u->refs)
+	    upload_free(u);
+    } else if (ok) {
+	u->received += len;
+	/* claims are disjoint, so this means all bytes are there
+	   and no other parts can be in flight */
+	if ((complete = (u->received == u->total)))
+	    upload_unlink(u);
+    } else {
+	int i = 0;
+	while (i < u->nparts && u->parts[2 * i] != off)
+	    i++;
+	if (i < u->nparts) {
+	    u->nparts--;
+	    memmove(u->parts + 2 * i, u->parts + 2 * i + 2, sizeof(long) * 2 * (u->nparts - i));
+	}
+    }
+    pthread_mutex_unlock(&upload_mutex);
+    if (complete) {
+	obj_add(u->key, 0, u->buf, u->total);
+	u->buf = 0;
+	upload_free(u);
+    }
+    return res;
+}
+
 /* from fd_store.c */
 void fd_store(int s, SEXP sWhat);
 
+/* set in forked snapshot servers (see C_fork) which only serve reads */
+static int osrv_readonly;
+
 static void do_process(conn_t *c) {
-    int s = c->s, n;
+    int s = c->s, n, viewing = 0;
+    obj_ver_t view = 0;
     work_t *w;
     char *d, *e, *a, *be;
     
@@ -125,39 +505,172 @@ static void do_process(conn_t *c) {
 	*e = 0;
 
 	/* fprintf(stderr, "INFO: cmd='%s', arg='%s'\n", w->buf, a); */
+
+	if (osrv_readonly && strcmp("GET", w->buf) && strcmp("HAS", w->buf) &&
+	    strcmp("RGET", w->buf) && strcmp("VER", w->buf)) {
+	    send_buf(s, "UNSUPP\n", 7);
+	    break;
+	}
 	
 	/* w->buf is cmd, a = arg */
 	if (!strcmp("GET", w->buf) || !strcmp("HAS", w->buf)) {
-	    obj_entry_t *o = obj_get(a, 0);
+	    obj_entry_t *o;
+	    int done = 0;
+	    /* the entry is only valid inside the read section,
+	       so we must not leave the loop before ending it */
+	    obj_read_begin();
+	    o = viewing ? obj_get_at(a, view) : obj_get(a, 0);
 	    /* printf("finding '%s' (%s)\n", a, o ? "OK" : "NF"); */
 	    if (o) {
-		if (w->buf[0] == 'H') { /* HAS -> OK */
-		    if (send_buf(s, "OK\n", 3))
-			break;
-		} else {
+		if (w->buf[0] == 'H') /* HAS -> OK */
+		    done = send_buf(s, "OK\n", 3);
+		else {
 		    if (!o->obj) { /* if obj is NULL if we have to serialise */
 			static const char *ok_ser = "OK ?\n";
-			if (send_buf(s, ok_ser, 5))
-			    break;
-			fd_store(s, o->sWhat);
-			break;
+			/* serialised at put time if we can't do it here */
+			if (!send_buf(s, ok_ser, 5)) {
+			    if (o->sfs)
+				send_buf(s, (const char*) o->sfs, o->sfs_len);
+			    else
+				fd_store(s, o->sWhat);
+			}
+			done = 1;
 		    } else {
 			snprintf(w->obuf, sizeof(w->obuf), "OK %lu\n",
 				 (unsigned long) o->len);
-			if (send_buf(s, w->obuf, strlen(w->obuf)) ||
-			    send_buf(s, o->obj, o->len))
-			    break;
+			done = (send_buf(s, w->obuf, strlen(w->obuf)) ||
+				send_payload(s, o, 0, o->len));
+			if (!done)
+			    obj_served(o, o->len);
 		    }
 		}
-	    } else if (send_buf(s, "NF\n", 3))
+	    } else
+		done = send_buf(s, "NF\n", 3);
+	    obj_read_end();
+	    if (done)
+		break;
+	} else if (!strcmp("RGET", w->buf)) {
+	    unsigned long off, rl;
+	    char *pl = param_line(d, be, &d);
+	    obj_entry_t *o;
+	    int done;
+	    if (!pl || sscanf(pl, "%lu %lu", &off, &rl) != 2) {
+		send_buf(s, "INV\n", 4);
+		break;
+	    }
+	    obj_read_begin();
+	    o = viewing ? obj_get_at(a, view) : obj_get(a, 0);
+	    if (!o)
+		done = send_buf(s, "NF\n", 3);
+	    else if (!o->obj)
+		done = send_buf(s, "UNSUPP\n", 7);
+	    else if (off > o->len)
+		done = send_buf(s, "INV\n", 4);
+	    else {
+		if (rl > o->len - off)
+		    rl = o->len - off;
+		snprintf(w->obuf, sizeof(w->obuf), "OK %lu %lu\n",
+			 rl, (unsigned long) o->len);
+		done = (send_buf(s, w->obuf, strlen(w->obuf)) ||
+			send_payload(s, o, off, rl));
+		if (!done)
+		    obj_served(o, rl);
+	    }
+	    obj_read_end();
+	    if (done)
+		break;
+	} else if (!strcmp("PART", w->buf)) {
+	    char id[64];
+	    long total, off, len, pos = 0;
+	    int err = 0;
+	    upload_t *u;
+	    char *pl = param_line(d, be, &d);
+	    if (!pl || sscanf(pl, "%63s %ld %ld %ld", id, &total, &off, &len) != 4 ||
+		total < 1 || off < 0 || len < 1 || off + len > total) {
+		send_buf(s, "INV\n", 4);
+		break;
+	    }
+	    if (!(u = upload_claim(a, id, total, off, len, &err))) {
+		send_buf(s, err ? "ERR\n" : "INV\n", 4);
+		break;
+	    }
+	    /* claimed parts don't overlap, so we can receive directly
+	       into the upload buffer without holding any locks */
+	    if (d < be) {
+		pos = (long) (be - d);
+		if (pos > len)
+		    pos = len;
+		memcpy(u->buf + off, d, pos);
+	    }
+	    while (pos < len) {
+		int need = (int) (((len - pos) > FETCH_SIZE) ? FETCH_SIZE : (len - pos));
+		int n = recv(s, u->buf + off + pos, need, 0);
+		if (n < 1)
+		    break;
+		pos += n;
+	    }
+	    if (pos < len) {
+		upload_done(u, off, len, 0);
+		break;
+	    }
+	    if ((upload_done(u, off, len, 1) || wal_sync()) ?
+		send_buf(s, "ERR\n", 4) : send_buf(s, "OK\n", 3))
+		break;
+	    if (be - d > len) /* we fetched more than we need, close */
+		break;
+	} else if (!strcmp("VER", w->buf)) {
+	    obj_entry_t *o;
+	    int done;
+	    obj_read_begin();
+	    o = viewing ? obj_get_at(a, view) : obj_get(a, 0);
+	    if (o) {
+		snprintf(w->obuf, sizeof(w->obuf), "OK %lu\n",
+			 (unsigned long) o->version);
+		done = send_buf(s, w->obuf, strlen(w->obuf));
+	    } else
+		done = send_buf(s, "NF\n", 3);
+	    obj_read_end();
+	    if (done)
 		break;
 	} else if (!strcmp("DEL", w->buf)) {
 	    obj_entry_t *o = obj_get(a, 1);
-	    int res = o ? send_buf(s, "OK\n", 3) : send_buf(s, "NF\n", 3);
+	    int res = !o ? send_buf(s, "NF\n", 3) :
+		(wal_sync() ? send_buf(s, "ERR\n", 4) : send_buf(s, "OK\n", 3));
 	    if (res)
 		break;
-	} else if (!strcmp("PUT", w->buf)) {
+	} else if (!strcmp("VIEW", w->buf)) {
+	    int done;
+	    if (!strcmp(a, "begin")) {
+		obj_ver_t nv;
+		if (obj_view_begin(&nv))
+		    done = send_buf(s, "ERR\n", 4);
+		else {
+		    if (viewing)
+			obj_view_end(view);
+		    view = nv;
+		    viewing = 1;
+		    snprintf(w->obuf, sizeof(w->obuf), "OK %lu\n", (unsigned long) view);
+		    done = send_buf(s, w->obuf, strlen(w->obuf));
+		}
+	    } else if (!strcmp(a, "end")) {
+		if (viewing)
+		    obj_view_end(view);
+		viewing = 0;
+		done = send_buf(s, "OK\n", 3);
+	    } else
+		done = send_buf(s, "INV\n", 4);
+	    if (done)
+		break;
+	} else if (!strcmp("DROP", w->buf)) {
+	    if (!obj_ns_drop(a) ? send_buf(s, "NF\n", 3) :
+		(wal_sync() ? send_buf(s, "ERR\n", 4) : send_buf(s, "OK\n", 3)))
+		break;
+	} else if (!strcmp("PUT", w->buf) || !strcmp("BCAST", w->buf)) {
 	    long len = -1;
+	    int bcast = (w->buf[0] == 'B'), fwd = -1, skipped = 0, mode = OBJ_PUT_ALWAYS;
+	    obj_ver_t ver = 0;
+	    unsigned long ttl = 0;
+	    char *peers = 0;
 	    if (d < be) {
 		d++;
 		while (*d == '\r' || *d == '\n') d++;
@@ -168,6 +681,22 @@ static void do_process(conn_t *c) {
 		} else if (*d >= '0' && *d <= '9') {
 		    len = atol(d);
 		    while (*d >= '0' && *d <= '9') d++;
+		    /* optional conditions (PUT only) */
+		    while (*d == ' ' && !bcast) {
+			while (*d == ' ') d++;
+			if (!strncmp(d, "nx", 2) && (d[2] == ' ' || d[2] == '\r' || d[2] == '\n')) {
+			    mode = OBJ_PUT_ABSENT;
+			    d += 2;
+			} else if (!strncmp(d, "ver=", 4) && d[4] >= '0' && d[4] <= '9') {
+			    mode = OBJ_PUT_VERSION;
+			    ver = strtoul(d + 4, &d, 10);
+			} else if (!strncmp(d, "ttl=", 4) && ((d[4] >= '0' && d[4] <= '9') || d[4] == '.')) {
+			    double t = strtod(d + 4, &d);
+			    /* at least 1ms, 0 would mean no expiry */
+			    ttl = (t < 0.001) ? 1 : ((unsigned long) (t * 1000.0));
+			} else
+			    break;
+		    }
 		    if (len < 0 || (*d != '\r' && *d != '\n')) {
 			send_buf(s, "INV\n", 4);
 			break;
@@ -182,31 +711,81 @@ static void do_process(conn_t *c) {
 		send_buf(s, "INV\n", 4);
 		break;
 	    }
+	    if (bcast) { /* peers line follows the size */
+		peers = d;
+		while (d < be && *d != '\n') d++;
+		if (d >= be) {
+		    send_buf(s, "INV\n", 4);
+		    break;
+		}
+		*d = 0;
+		if (d > peers && d[-1] == '\r') d[-1] = 0;
+		d++;
+	    }
 	    if (len > 0) {
-		char *db = (char*) malloc(len);
+		/* small payloads are copied by the store */
+		char *db = (len <= OBJ_SMALL_MAX) ? w->sbuf : (char*) obj_payload_alloc(len);
 		long pos = 0;
 		if (!db) {
 		    send_buf(s, "ERR\n", 4);
 		    break;
 		}
-		if (d < be) { /* buf did include the payload? */
-		    if (be - d >= len) {
-			memcpy(db, d, len);
-			obj_add(a, 0, db, len);
-			send_buf(s, "OK\n", 3);
-			if (be - d > len) /* we fetched more than we need, close */
-			    break;
-		    }
+		/* start the downstream connection first so
+		   we can forward while receiving */
+		if (bcast)
+		    fwd = bcast_next(a, len, peers, &skipped);
+		if (d < be) { /* buf did include (part of) the payload? */
 		    pos = (long) (be - d);
+		    if (pos > len)
+			pos = len;
 		    memcpy(db, d, pos);
 		}
+		if (fwd != -1 && pos && send_buf(fwd, db, pos)) {
+		    closesocket(fwd);
+		    fwd = -1;
+		    skipped = 1;
+		}
 		while (pos < len) {
 		    int need = (int) (((len - pos) > FETCH_SIZE) ? FETCH_SIZE : (len - pos));
 		    int n = recv(s, db + pos, need, 0);
 		    if (n < 1)
 			break;
+		    if (fwd != -1 && send_buf(fwd, db + pos, n)) {
+			closesocket(fwd);
+			fwd = -1;
+			skipped = 1;
+		    }
 		    pos += n;
 		}
+		if (pos < len) { /* incomplete payload, drop it */
+		    if (db != w->sbuf)
+			obj_payload_free(db);
+		    if (fwd != -1)
+			closesocket(fwd);
+		    break;
+		}
+		if (!obj_put_ttl(a, 0, db, len, (db == w->sbuf) ? (mode | OBJ_PUT_COPY) : mode, ver, ttl)) {
+		    /* condition not met */
+		    if (db != w->sbuf)
+			obj_payload_free(db);
+		    if (send_buf(s, "FAIL\n", 5))
+			break;
+		    if (be - d > len)
+			break;
+		    continue;
+		}
+		if (fwd != -1) { /* collect the response of the chain */
+		    char res[16];
+		    if (recv_line(fwd, res, sizeof(res)) || strcmp(res, "OK"))
+			skipped = 1;
+		    closesocket(fwd);
+		}
+		/* the object must be in the log (if any) before we confirm */
+		if (wal_sync() ? send_buf(s, "ERR\n", 4) :
+		    send_buf(s, skipped ? "FWD\n" : "OK\n", skipped ? 4 : 3))
+		    break;
+		if (be - d > len) /* we fetched more than we need, close */
+		    break;
 	    } else { /* we don't support unknown sizes yet */
 		if (send_buf(s, "UNSUPP\n", 7))
 		    break;
@@ -220,6 +799,8 @@ static void do_process(conn_t *c) {
 	   was waiting since we will not
 	   keep previous buffer around */
     }
+    if (viewing)
+	obj_view_end(view);
     closesocket(s);
     c->s = -1;
 }
@@ -246,3 +827,180 @@ SEXP C_start(SEXP sHost, SEXP sPort, SEXP sThreads) {
 
     return ScalarLogical(1);
 }
+
+/* --- forked snapshot server ---
+
+   A forked child serves the store as it was at the time of the fork
+   (copy-on-write) so it can serialise SFS objects from any number
+   of threads while R is busy in the parent. The parent keeps the
+   listening socket and forks a new child at safe points (C_fork()
+   and osrv_fork_tick()). The previous child stops accepting once the
+   parent shuts down its control socket and confirms by closing it,
+   then finishes the connections it is serving (for at most
+   FORK_DRAIN_MS) and exits. */
+
+#define FORK_DRAIN_MS 10000
+#define FORK_MAX_OLD  16
+
+static int fork_ss = -1, fork_ctl = -1, fork_threads, fork_spawning;
+static double fork_interval, fork_last;
+static pid_t fork_pid;
+static pid_t fork_old[FORK_MAX_OLD]; /* draining children */
+
+static double fork_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec) + ((double) ts.tv_nsec) / 1e9;
+}
+
+/* other children (e.g., from mcparallel) must not keep the current
+   child alive or hold the port */
+static void fork_atfork_child() {
+    if (fork_ctl != -1) {
+	close(fork_ctl);
+	fork_ctl = -1;
+    }
+    if (fork_ss != -1 && !fork_spawning) {
+	close(fork_ss);
+	fork_ss = -1;
+    }
+}
+
+static void fork_child(int ctl) {
+    therver_t *th;
+    char b;
+
+    osrv_readonly = 1;
+    obj_freeze();
+    if (!(th = therver_socket(fork_ss, fork_threads, do_process)))
+	_exit(1);
+    /* the parent never writes, so this returns once it shuts down */
+    while (read(ctl, &b, 1) < 0 && errno == EINTR) {}
+    therver_stop(th);
+    close(ctl);
+    therver_drain(th, FORK_DRAIN_MS);
+    _exit(0);
+}
+
+/* reaps children that are done draining */
+static void fork_reap() {
+    int i;
+    for (i = 0; i < FORK_MAX_OLD; i++)
+	if (fork_old[i] && waitpid(fork_old[i], 0, WNOHANG) != 0)
+	    fork_old[i] = 0;
+}
+
+/* asks the current child to drain, if wait is set returns only once
+   it no longer accepts connections */
+static void fork_retire(int wait) {
+    int i;
+    if (fork_ctl != -1) {
+	shutdown(fork_ctl, SHUT_WR);
+	if (wait) {
+	    struct pollfd pfd;
+	    char b;
+	    pfd.fd = fork_ctl;
+	    pfd.events = POLLIN;
+	    /* the child closes the socket, so we get EOF */
+	    while (poll(&pfd, 1, 1000) > 0 && read(fork_ctl, &b, 1) > 0) {}
+	}
+	close(fork_ctl);
+	fork_ctl = -1;
+    }
+    if (fork_pid) {
+	fork_reap();
+	for (i = 0; i < FORK_MAX_OLD; i++)
+	    if (!fork_old[i]) {
+		fork_old[i] = fork_pid;
+		break;
+	    }
+	if (i == FORK_MAX_OLD) /* should not happen, let init reap it */
+	    Rf_warning("too many draining snapshot servers");
+	fork_pid = 0;
+    }
+}
+
+/* forks a new child, returns -1 on error (errno) */
+static int fork_spawn(int wait) {
+    int p[2];
+    pid_t pid;
+
+    obj_gc();
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, p))
+	return -1;
+    fork_spawning = 1;
+    pid = fork();
+    if (pid == 0) { /* our end is closed by fork_atfork_child() */
+	close(p[1]);
+	fork_child(p[0]);
+    }
+    fork_spawning = 0;
+    close(p[0]);
+    if (pid == -1) {
+	int e = errno;
+	close(p[1]);
+	errno = e;
+	return -1;
+    }
+    fork_retire(wait);
+    fork_ctl = p[1];
+    fork_pid = pid;
+    fork_last = fork_now();
+    return 0;
+}
+
+/* called by the R API after changes, forks a new child if the
+   current one is older than the refresh interval */
+void osrv_fork_tick() {
+    if (fork_ss == -1)
+	return;
+    fork_reap();
+    if (fork_interval > 0 && fork_now() - fork_last >= fork_interval &&
+	fork_spawn(0))
+	Rf_warning("unable to refresh the snapshot server: %s", strerror(errno));
+}
+
+/* start/refresh/stop forked snapshot server */
+SEXP C_fork(SEXP sHost, SEXP sPort, SEXP sThreads, SEXP sInterval) {
+    static int atfork;
+    const char *host = (TYPEOF(sHost) == STRSXP && LENGTH(sHost) > 0) ?
+	CHAR(STRING_ELT(sHost, 0)) : 0;
+    int threads = Rf_asInteger(sThreads);
+    double interval = Rf_asReal(sInterval);
+
+    if (sPort == R_NilValue) { /* stop */
+	if (fork_ss == -1)
+	    return ScalarLogical(0);
+	fork_retire(0);
+	close(fork_ss);
+	fork_ss = -1;
+	fork_reap();
+	return ScalarLogical(1);
+    }
+    if (threads < 1 || threads > 1000)
+	Rf_error("Invalid number of threads %d", threads);
+    if (ISNAN(interval) || interval < 0)
+	Rf_error("Invalid interval");
+
+    obj_init();
+    if (!atfork) {
+	pthread_atfork(0, 0, fork_atfork_child);
+	atfork = 1;
+    }
+    if (fork_ss == -1) {
+	int port = Rf_asInteger(sPort);
+	if (port < 1 || port > 65535)
+	    Rf_error("Invalid port %d", port);
+	if ((fork_ss = therver_listen(host, port)) == -1)
+	    Rf_error("Unable to bind %s:%d", host ? host : "*", port);
+	Rprintf("OSRV: snapshot server on %s:%d\n", host ? host : "*", port);
+    }
+    fork_threads = threads;
+    fork_interval = interval;
+    fork_reap();
+    /* changes made so far must be visible once we return */
+    if (fork_spawn(1))
+	Rf_error("Unable to fork: %s", strerror(errno));
+
+    return ScalarInteger((int) fork_pid);
+}
@@ -0,0 +1,243 @@
+/* Striped osrv TCP client: transfers one object over
+   several parallel connections using RGET/PART requests.
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+SEXP C_sget(SEXP sHost, SEXP sPort, SEXP sKey, SEXP sStreams);
+SEXP C_sput(SEXP sHost, SEXP sPort, SEXP sKey, SEXP sWhat, SEXP sStreams);
+
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <Rinternals.h>
+
+#include "sconn.h"
+
+#define FETCH_SIZE (512*1024)
+#define MAX_SEND (1024*1024) /* 1Mb */
+
+/* stripes smaller than this are not worth a separate connection */
+#define MIN_STRIPE (1024*1024)
+
+#define MAX_STREAMS 256
+
+typedef struct stripe_s {
+    const char *host, *key, *id;
+    int port;
+    char *buf;
+    unsigned long off, len, total;
+    const char *err; /* NULL on success */
+    pthread_t thread;
+} stripe_t;
+
+static int send_all(SOCKET s, const char *buf, unsigned long len) {
+    while (len) {
+	int ts = (len > MAX_SEND) ? MAX_SEND : ((int) len);
+	int n = send(s, buf, ts, 0);
+	if (n < 1)
+	    return -1;
+	len -= n;
+	buf += n;
+    }
+    return 0;
+}
+
+static int recv_all(SOCKET s, char *buf, unsigned long len) {
+    while (len) {
+	int need = (len > FETCH_SIZE) ? FETCH_SIZE : ((int) len);
+	int n = recv(s, buf, need, 0);
+	if (n < 1)
+	    return -1;
+	len -= n;
+	buf += n;
+    }
+    return 0;
+}
+
+/* reads a response line byte-by-byte so we never consume payload */
+static int recv_line(SOCKET s, char *buf, int size) {
+    int p = 0;
+    while (p < size - 1) {
+	if (recv(s, buf + p, 1, 0) < 1)
+	    return -1;
+	if (buf[p] == '\n')
+	    break;
+	p++;
+    }
+    while (p > 0 && buf[p - 1] == '\r') p--;
+    buf[p] = 0;
+    return 0;
+}
+
+/* sends the request header and returns the response line */
+static SOCKET stripe_request(stripe_t *st, const char *hdr, const char *payload, unsigned long plen,
+			     char *res, int rlen) {
+    SOCKET s = tcp_connect(st->host, st->port);
+    if (s == INVALID_SOCKET) {
+	st->err = "cannot connect";
+	return s;
+    }
+    if (send_all(s, hdr, strlen(hdr)) || (plen && send_all(s, payload, plen))) {
+	st->err = "error while sending";
+	closesocket(s);
+	return INVALID_SOCKET;
+    }
+    if (recv_line(s, res, rlen)) {
+	st->err = "connection closed unexpectedly";
+	closesocket(s);
+	return INVALID_SOCKET;
+    }
+    return s;
+}
+
+/* NOTE: the threads must not use any R API */
+static void *stripe_get(void *arg) {
+    stripe_t *st = (stripe_t*) arg;
+    char *hdr = (char*) malloc(strlen(st->key) + 64), res[128];
+    unsigned long n, total;
+    SOCKET s;
+    if (!hdr) {
+	st->err = "out of memory";
+	return 0;
+    }
+    sprintf(hdr, "RGET %s\n%lu %lu\n", st->key, st->off, st->len);
+    s = stripe_request(st, hdr, 0, 0, res, sizeof(res));
+    free(hdr);
+    if (s == INVALID_SOCKET)
+	return 0;
+    if (sscanf(res, "OK %lu %lu", &n, &total) != 2 || n != st->len || total != st->total)
+	st->err = "invalid response (object modified?)";
+    else if (recv_all(s, st->buf + st->off, n))
+	st->err = "error while receiving";
+    closesocket(s);
+    return 0;
+}
+
+static void *stripe_put(void *arg) {
+    stripe_t *st = (stripe_t*) arg;
+    char *hdr = (char*) malloc(strlen(st->key) + strlen(st->id) + 96), res[32];
+    SOCKET s;
+    if (!hdr) {
+	st->err = "out of memory";
+	return 0;
+    }
+    sprintf(hdr, "PART %s\n%s %lu %lu %lu\n", st->key, st->id, st->total, st->off, st->len);
+    s = stripe_request(st, hdr, st->buf + st->off, st->len, res, sizeof(res));
+    free(hdr);
+    if (s == INVALID_SOCKET)
+	return 0;
+    if (strcmp(res, "OK"))
+	st->err = "part rejected by the server";
+    closesocket(s);
+    return 0;
+}
+
+/* splits [0, total) into stripes, runs them in parallel and
+   waits for all to finish. Returns the first error or NULL. */
+static const char *run_stripes(stripe_t *proto, int streams, void*(*fn)(void*)) {
+    unsigned long slen = proto->total / streams, off = 0;
+    const char *err = 0;
+    stripe_t st[MAX_STREAMS];
+    int i, n;
+
+    if (slen < MIN_STRIPE)
+	slen = MIN_STRIPE;
+    if (slen * streams < proto->total)
+	slen++;
+    for (n = 0; n < streams && off < proto->total; n++) {
+	st[n] = *proto;
+	st[n].off = off;
+	st[n].len = (proto->total - off > slen) ? slen : (proto->total - off);
+	st[n].err = 0;
+	off += st[n].len;
+	if (pthread_create(&st[n].thread, 0, fn, &st[n])) {
+	    /* run it in this thread instead */
+	    st[n].thread = pthread_self();
+	    fn(&st[n]);
+	}
+    }
+    for (i = 0; i < n; i++) {
+	if (!pthread_equal(st[i].thread, pthread_self()))
+	    pthread_join(st[i].thread, 0);
+	if (st[i].err && !err)
+	    err = st[i].err;
+    }
+    return err;
+}
+
+static void setup(stripe_t *st, SEXP sHost, SEXP sPort, SEXP sKey, SEXP sStreams, int *streams) {
+    memset(st, 0, sizeof(stripe_t));
+    if (TYPEOF(sHost) != STRSXP || LENGTH(sHost) != 1)
+	Rf_error("host must be a string");
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    st->port = asInteger(sPort);
+    if (st->port < 1 || st->port > 65535)
+	Rf_error("invalid port");
+    *streams = asInteger(sStreams);
+    if (*streams < 1 || *streams > MAX_STREAMS)
+	Rf_error("Invalid number of streams, must be between 1 and %d", MAX_STREAMS);
+    st->host = CHAR(STRING_ELT(sHost, 0));
+    st->key = CHAR(STRING_ELT(sKey, 0));
+}
+
+SEXP C_sget(SEXP sHost, SEXP sPort, SEXP sKey, SEXP sStreams) {
+    stripe_t st;
+    int streams;
+    char res[128];
+    unsigned long n;
+    const char *err;
+    SOCKET s;
+    SEXP sRes;
+
+    setup(&st, sHost, sPort, sKey, sStreams, &streams);
+    /* query the size first */
+    {
+	char *hdr = R_alloc(strlen(st.key) + 16, 1);
+	sprintf(hdr, "RGET %s\n0 0\n", st.key);
+	s = stripe_request(&st, hdr, 0, 0, res, sizeof(res));
+    }
+    if (s == INVALID_SOCKET)
+	Rf_error("Size request failed: %s", st.err);
+    closesocket(s);
+    if (!strcmp(res, "NF"))
+	return R_NilValue;
+    if (sscanf(res, "OK %lu %lu", &n, &st.total) != 2)
+	Rf_error("Invalid response: %s", res);
+    sRes = PROTECT(allocVector(RAWSXP, st.total));
+    st.buf = (char*) RAW(sRes);
+    if (st.total && (err = run_stripes(&st, streams, stripe_get)))
+	Rf_error("Striped GET failed: %s", err);
+    UNPROTECT(1);
+    return sRes;
+}
+
+SEXP C_sput(SEXP sHost, SEXP sPort, SEXP sKey, SEXP sWhat, SEXP sStreams) {
+    static unsigned int serial;
+    stripe_t st;
+    int streams;
+    char id[64];
+    const char *err;
+
+    setup(&st, sHost, sPort, sKey, sStreams, &streams);
+    if (TYPEOF(sWhat) != RAWSXP)
+	Rf_error("Value must be a raw vector");
+    if (!(st.total = XLENGTH(sWhat)))
+	Rf_error("Cannot store empty objects in parts");
+    /* the upload id only has to be unique on the server */
+    snprintf(id, sizeof(id), "%lx-%lx-%x", (unsigned long) getpid(),
+	     (unsigned long) time(0), ++serial);
+    st.id = id;
+    st.buf = (char*) RAW(sWhat);
+    if ((err = run_stripes(&st, streams, stripe_put)))
+	Rf_error("Striped PUT failed: %s", err);
+    return ScalarLogical(1);
+}
@@ -1,25 +1,456 @@
 /* Interface from R to the object store */
 
+#include <string.h>
+#include <errno.h>
+
 #include "obj.h"
 #include "sfs.h"
+#include "shm.h"
+#include "wal.h"
+#include "altraw.h"
+
+/* raw payloads of at least this size are returned without copying */
+#define GET_REF_MIN 65536
+
+/* osrv.c */
+void osrv_fork_tick();
+
+/* changes are only confirmed once they are in the log (if open),
+   they also give the snapshot server a chance to refresh */
+static void sync_log() {
+    if (wal_sync())
+	Rf_error("Unable to write the log");
+    osrv_fork_tick();
+}
 
-SEXP C_put(SEXP sKey, SEXP sWhat, SEXP sSFS) {
-    int use_sfs = asInteger(sSFS);
+SEXP C_put(SEXP sKey, SEXP sWhat, SEXP sSFS, SEXP sAbsent, SEXP sVer, SEXP sTTL) {
+    int use_sfs = asInteger(sSFS), mode = OBJ_PUT_ALWAYS;
+    obj_ver_t ver = 0;
+    unsigned long ttl = 0;
     if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
 	Rf_error("Invalid key, must be a string");
     if (!use_sfs && TYPEOF(sWhat) != RAWSXP)
 	Rf_error("Value must be a raw vector unless SFS is used");
+    if (asInteger(sAbsent) == 1 && sVer != R_NilValue)
+	Rf_error("if.absent and version cannot be used together");
+    if (asInteger(sAbsent) == 1)
+	mode = OBJ_PUT_ABSENT;
+    else if (sVer != R_NilValue) {
+	double v = asReal(sVer);
+	if (ISNAN(v) || v < 1)
+	    Rf_error("Invalid version");
+	mode = OBJ_PUT_VERSION;
+	ver = (obj_ver_t) v;
+    }
+    if (sTTL != R_NilValue) {
+	double t = asReal(sTTL);
+	if (ISNAN(t) || t <= 0)
+	    Rf_error("Invalid TTL");
+	/* at least 1ms, 0 would mean no expiry */
+	ttl = (t < 0.001) ? 1 : ((unsigned long) (t * 1000.0));
+    }
+    obj_init();
+    /* this is a safe point to release removed R objects */
+    obj_gc();
+    if (use_sfs && shm_min_size()) {
+	/* publish a serialised snapshot for other processes */
+	shm_seg_t *seg = shm_seg_sfs(sWhat);
+	if (seg) {
+	    obj_ver_t res = obj_put_shared(CHAR(STRING_ELT(sKey, 0)), sWhat, seg, mode, ver, ttl);
+	    if (!res)
+		shm_seg_free(seg);
+	    else
+		sync_log();
+	    return ScalarLogical(res ? 1 : 0);
+	}
+    }
+    if (!obj_put_ttl(CHAR(STRING_ELT(sKey, 0)), sWhat,
+		     use_sfs ? 0 : RAW(sWhat), use_sfs ? 0 : XLENGTH(sWhat), mode, ver, ttl))
+	return ScalarLogical(0);
+    sync_log();
+    return ScalarLogical(1);
+}
+
+SEXP C_put_file(SEXP sKey, SEXP sPath, SEXP sTTL) {
+    unsigned long ttl = 0;
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    if (TYPEOF(sPath) != STRSXP || LENGTH(sPath) != 1)
+	Rf_error("Invalid path, must be a string");
+    if (sTTL != R_NilValue) {
+	double t = asReal(sTTL);
+	if (ISNAN(t) || t <= 0)
+	    Rf_error("Invalid TTL");
+	ttl = (t < 0.001) ? 1 : ((unsigned long) (t * 1000.0));
+    }
+    obj_init();
+    obj_gc();
+    if (!obj_put_file(CHAR(STRING_ELT(sKey, 0)), CHAR(STRING_ELT(sPath, 0)), ttl))
+	Rf_error("Unable to put '%s': %s", CHAR(STRING_ELT(sPath, 0)), strerror(errno));
+    sync_log();
+    return ScalarLogical(1);
+}
+
+/* puts values (named by keys) as one commit, the values are
+   protected by one holder instead of preserving each of them */
+static obj_ver_t put_all(SEXP sKeys, SEXP sValues, int use_sfs) {
+    int i, n = LENGTH(sValues);
+    obj_item_t *items = (obj_item_t*) R_alloc(n ? n : 1, sizeof(obj_item_t));
+    /* our own list, so the values cannot be replaced behind our back */
+    SEXP sHold = PROTECT(allocVector(VECSXP, n));
+    obj_hold_t *hold;
+    obj_ver_t ver;
+    for (i = 0; i < n; i++) {
+	SEXP sWhat = VECTOR_ELT(sValues, i);
+	if (!*CHAR(STRING_ELT(sKeys, i)))
+	    Rf_error("Keys must not be empty");
+	if (!use_sfs && TYPEOF(sWhat) != RAWSXP)
+	    Rf_error("Values must be raw vectors unless SFS is used");
+	SET_VECTOR_ELT(sHold, i, sWhat);
+	items[i].key = CHAR(STRING_ELT(sKeys, i));
+	items[i].sWhat = sWhat;
+	items[i].data = use_sfs ? 0 : RAW(sWhat);
+	items[i].len = use_sfs ? 0 : XLENGTH(sWhat);
+    }
+    obj_init();
+    obj_gc();
+    if (!(hold = obj_hold_new(sHold)))
+	Rf_error("Out of memory");
+    ver = obj_commit(items, n, OBJ_PUT_ALWAYS, hold);
+    obj_hold_release(hold);
+    UNPROTECT(1);
+    if (!ver)
+	Rf_error("Out of memory, commit is incomplete");
+    sync_log();
+    return ver;
+}
+
+SEXP C_commit(SEXP sValues, SEXP sSFS) {
+    SEXP sNames = getAttrib(sValues, R_NamesSymbol);
+    if (TYPEOF(sValues) != VECSXP || TYPEOF(sNames) != STRSXP)
+	Rf_error("Values must be a named list");
+    return ScalarReal((double) put_all(sNames, sValues, asInteger(sSFS)));
+}
+
+SEXP C_mput(SEXP sKeys, SEXP sValues, SEXP sSFS) {
+    if (TYPEOF(sKeys) != STRSXP)
+	Rf_error("Invalid keys, must be a character vector");
+    if (TYPEOF(sValues) != VECSXP || LENGTH(sValues) != LENGTH(sKeys))
+	Rf_error("Values must be a list of the same length as keys");
+    return ScalarReal((double) put_all(sKeys, sValues, asInteger(sSFS)));
+}
+
+static void view_fin(SEXP sView) {
+    obj_ver_t *v = (obj_ver_t*) R_ExternalPtrAddr(sView);
+    if (v) {
+	obj_view_end(*v);
+	free(v);
+	R_SetExternalPtrAddr(sView, 0);
+    }
+}
+
+SEXP C_view() {
+    obj_ver_t *v = (obj_ver_t*) malloc(sizeof(obj_ver_t));
+    SEXP res;
+    if (!v)
+	Rf_error("Out of memory");
+    obj_init();
+    if (obj_view_begin(v)) {
+	free(v);
+	Rf_error("Out of memory");
+    }
+    res = PROTECT(R_MakeExternalPtr(v, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(res, view_fin, TRUE);
+    setAttrib(res, R_ClassSymbol, mkString("osrv_view"));
+    setAttrib(res, install("version"), ScalarReal((double) *v));
+    UNPROTECT(1);
+    return res;
+}
+
+static obj_ver_t *R2view(SEXP sView) {
+    obj_ver_t *v;
+    if (TYPEOF(sView) != EXTPTRSXP || !Rf_inherits(sView, "osrv_view"))
+	Rf_error("Invalid view");
+    if (!(v = (obj_ver_t*) R_ExternalPtrAddr(sView)))
+	Rf_error("The view has been closed");
+    return v;
+}
+
+SEXP C_view_close(SEXP sView) {
+    R2view(sView);
+    view_fin(sView);
+    return ScalarLogical(1);
+}
+
+SEXP C_version(SEXP sKey) {
+    obj_entry_t *o;
+    obj_ver_t ver = 0;
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    obj_init();
+    obj_read_begin();
+    if ((o = obj_get(CHAR(STRING_ELT(sKey, 0)), 0)))
+	ver = o->version;
+    obj_read_end();
+    return ver ? ScalarReal((double) ver) : R_NilValue;
+}
+
+static const char *policy_names[] = { "gdsf", "lru", "lfu", 0 };
+
+SEXP C_budget(SEXP sLimit, SEXP sPolicy, SEXP sNS) {
+    obj_mem_stat_t st;
+    const char *ns = 0;
+    SEXP res, nam;
+    if (sNS != R_NilValue) {
+	if (TYPEOF(sNS) != STRSXP || LENGTH(sNS) != 1)
+	    Rf_error("Invalid namespace, must be a string or NULL");
+	ns = CHAR(STRING_ELT(sNS, 0));
+    }
+    obj_init();
+    if (sLimit != R_NilValue) {
+	double limit = asReal(sLimit);
+	const char *pn;
+	int policy = 0;
+	if (ISNAN(limit) || limit < 0)
+	    Rf_error("Invalid limit");
+	if (TYPEOF(sPolicy) != STRSXP || LENGTH(sPolicy) != 1)
+	    Rf_error("Invalid policy");
+	pn = CHAR(STRING_ELT(sPolicy, 0));
+	while (policy_names[policy] && strcmp(policy_names[policy], pn))
+	    policy++;
+	if (!policy_names[policy])
+	    Rf_error("Unknown policy '%s'", pn);
+	if (!obj_set_budget(ns, (size_t) limit, policy))
+	    Rf_error("Namespace '%s' does not exist", ns);
+    }
+    if (!obj_mem_stat(ns, &st))
+	Rf_error("Namespace '%s' does not exist", ns);
+    {
+	const char *names[] = { "limit", "used", "entries", "evicted", "evicted.bytes",
+				"spill.limit", "spilled", "spilled.entries", "spills",
+				"promoted", "expired", "policy" };
+	double val[] = { st.limit, st.used, st.entries, st.evicted, st.evicted_bytes,
+			 st.spill_limit, st.spill_used, st.spill_entries, st.spills,
+			 st.promoted, st.expired };
+	int i, n = sizeof(names) / sizeof(names[0]);
+	res = PROTECT(allocVector(VECSXP, n));
+	nam = allocVector(STRSXP, n);
+	setAttrib(res, R_NamesSymbol, nam);
+	for (i = 0; i < n; i++) {
+	    SET_STRING_ELT(nam, i, mkChar(names[i]));
+	    if (i < n - 1)
+		SET_VECTOR_ELT(res, i, ScalarReal(val[i]));
+	}
+	SET_VECTOR_ELT(res, n - 1, mkString(policy_names[st.policy]));
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+SEXP C_spill(SEXP sDir, SEXP sLimit) {
+    double limit = asReal(sLimit);
+    if (sDir != R_NilValue && (TYPEOF(sDir) != STRSXP || LENGTH(sDir) != 1))
+	Rf_error("Invalid directory, must be a string or NULL");
+    if (ISNAN(limit) || limit < 0)
+	Rf_error("Invalid limit");
+    obj_init();
+    if (obj_set_spill((sDir == R_NilValue) ? 0 : CHAR(STRING_ELT(sDir, 0)), (size_t) limit))
+	Rf_error("Out of memory");
+    return ScalarLogical(1);
+}
+
+SEXP C_ns(SEXP sName) {
+    char *names, *c;
+    int n = 0;
+    SEXP res;
+    obj_init();
+    if (sName != R_NilValue) {
+	int r;
+	if (TYPEOF(sName) != STRSXP || LENGTH(sName) != 1)
+	    Rf_error("Invalid namespace, must be a string");
+	if ((r = obj_ns_create(CHAR(STRING_ELT(sName, 0)))) < 0)
+	    Rf_error("Cannot create namespace '%s' (names must be non-empty and not contain /)",
+		     CHAR(STRING_ELT(sName, 0)));
+	return ScalarLogical(r);
+    }
+    if (!(names = obj_ns_names()))
+	Rf_error("Out of memory");
+    for (c = names; *c; c += strlen(c) + 1)
+	n++;
+    res = PROTECT(allocVector(STRSXP, n));
+    for (c = names, n = 0; *c; c += strlen(c) + 1)
+	SET_STRING_ELT(res, n++, mkChar(c));
+    free(names);
+    UNPROTECT(1);
+    return res;
+}
+
+SEXP C_drop(SEXP sName) {
+    if (TYPEOF(sName) != STRSXP || LENGTH(sName) != 1)
+	Rf_error("Invalid namespace, must be a string");
     obj_init();
-    obj_add(CHAR(STRING_ELT(sKey, 0)), sWhat, use_sfs ? 0 : RAW(sWhat), use_sfs ? 0 : XLENGTH(sWhat));
+    if (!obj_ns_drop(CHAR(STRING_ELT(sName, 0))))
+	return ScalarLogical(0);
+    sync_log();
     return ScalarLogical(1);
 }
 
+SEXP C_track(SEXP sK) {
+    int k = asInteger(sK);
+    if (k == NA_INTEGER || k < 0 || k > 65536)
+	Rf_error("Invalid number of counters");
+    obj_init();
+    if (obj_set_tracking(k))
+	Rf_error("Out of memory");
+    return ScalarLogical(1);
+}
+
+SEXP C_stats(SEXP sKey) {
+    obj_key_stat_t ks;
+    SEXP res, nam;
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    obj_init();
+    if (!obj_key_stat(CHAR(STRING_ELT(sKey, 0)), &ks))
+	return R_NilValue;
+    {
+	const char *names[] = { "size", "version", "hits", "served", "created", "accessed" };
+	/* times are in seconds, NA if not known */
+	double val[] = { ks.len, ks.version, ks.hits, ks.served,
+			 ks.created ? ((double) ks.created) / 1000.0 : NA_REAL,
+			 ks.accessed ? ((double) ks.accessed) / 1000.0 : NA_REAL };
+	int i, n = sizeof(names) / sizeof(names[0]);
+	res = PROTECT(allocVector(VECSXP, n));
+	nam = allocVector(STRSXP, n);
+	setAttrib(res, R_NamesSymbol, nam);
+	for (i = 0; i < n; i++) {
+	    SET_STRING_ELT(nam, i, mkChar(names[i]));
+	    SET_VECTOR_ELT(res, i, ScalarReal(val[i]));
+	}
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+SEXP C_hot(SEXP sN) {
+    int n = asInteger(sN), i;
+    obj_hot_t *hot;
+    SEXP res, nam, sKeys, sCount, sErr;
+    if (n == NA_INTEGER || n < 0)
+	Rf_error("Invalid number of keys");
+    obj_init();
+    hot = (obj_hot_t*) R_alloc(n ? n : 1, sizeof(obj_hot_t));
+    if ((n = obj_hot(hot, n)) < 0)
+	Rf_error("Out of memory");
+    res = PROTECT(allocVector(VECSXP, 3));
+    nam = allocVector(STRSXP, 3);
+    setAttrib(res, R_NamesSymbol, nam);
+    SET_STRING_ELT(nam, 0, mkChar("key"));
+    SET_STRING_ELT(nam, 1, mkChar("hits"));
+    SET_STRING_ELT(nam, 2, mkChar("error"));
+    sKeys = SET_VECTOR_ELT(res, 0, allocVector(STRSXP, n));
+    sCount = SET_VECTOR_ELT(res, 1, allocVector(REALSXP, n));
+    sErr = SET_VECTOR_ELT(res, 2, allocVector(REALSXP, n));
+    for (i = 0; i < n; i++) {
+	SET_STRING_ELT(sKeys, i, mkChar(hot[i].key));
+	REAL(sCount)[i] = (double) hot[i].count;
+	REAL(sErr)[i] = (double) hot[i].error;
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+SEXP C_dedup(SEXP sMin) {
+    obj_dedup_stat_t ds;
+    SEXP res, nam;
+    obj_init();
+    if (sMin != R_NilValue) {
+	double min = asReal(sMin);
+	if (ISNAN(min) || min < 0)
+	    Rf_error("Invalid minimal size");
+	obj_set_dedup((size_t) min);
+    }
+    obj_dedup_stat(&ds);
+    {
+	const char *names[] = { "min.size", "payloads", "bytes", "entries", "logical",
+				"hits", "ratio" };
+	/* ratio of the size of all deduplicated entries to the memory they use */
+	double val[] = { ds.min_size, ds.blobs, ds.bytes, ds.refs, ds.logical, ds.hits,
+			 ds.bytes ? ((double) ds.logical) / ((double) ds.bytes) : 1.0 };
+	int i, n = sizeof(names) / sizeof(names[0]);
+	res = PROTECT(allocVector(VECSXP, n));
+	nam = allocVector(STRSXP, n);
+	setAttrib(res, R_NamesSymbol, nam);
+	for (i = 0; i < n; i++) {
+	    SET_STRING_ELT(nam, i, mkChar(names[i]));
+	    SET_VECTOR_ELT(res, i, ScalarReal(val[i]));
+	}
+    }
+    UNPROTECT(1);
+    return res;
+}
+
+static const char *huge_names[] = { "none", "thp", "hugetlb", 0 };
+
+SEXP C_alloc(SEXP sHuge) {
+    obj_alloc_stat_t st;
+    SEXP res, nam;
+    obj_init();
+    if (sHuge != R_NilValue) {
+	const char *hn;
+	int mode = 0;
+	if (TYPEOF(sHuge) != STRSXP || LENGTH(sHuge) != 1)
+	    Rf_error("Invalid huge pages mode");
+	hn = CHAR(STRING_ELT(sHuge, 0));
+	while (huge_names[mode] && strcmp(huge_names[mode], hn))
+	    mode++;
+	if (!huge_names[mode])
+	    Rf_error("Unknown huge pages mode '%s'", hn);
+	obj_set_hugepages(mode);
+    }
+    obj_alloc_stat(&st);
+    res = PROTECT(allocVector(VECSXP, 4));
+    nam = allocVector(STRSXP, 4);
+    setAttrib(res, R_NamesSymbol, nam);
+    SET_VECTOR_ELT(res, 0, ScalarReal((double) st.mapped));
+    SET_STRING_ELT(nam, 0, mkChar("mapped"));
+    SET_VECTOR_ELT(res, 1, ScalarReal((double) st.resident));
+    SET_STRING_ELT(nam, 1, mkChar("resident"));
+    SET_VECTOR_ELT(res, 2, ScalarReal((double) st.slab));
+    SET_STRING_ELT(nam, 2, mkChar("slab"));
+    SET_VECTOR_ELT(res, 3, mkString(huge_names[st.hugepages]));
+    SET_STRING_ELT(nam, 3, mkChar("hugepages"));
+    UNPROTECT(1);
+    return res;
+}
+
+SEXP C_promote(SEXP sKey) {
+    int res;
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    obj_init();
+    if ((res = obj_promote(CHAR(STRING_ELT(sKey, 0)))) < 0)
+	Rf_error("Out of memory");
+    return ScalarLogical(res);
+}
+
+SEXP C_pin(SEXP sKey, SEXP sPin) {
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    obj_init();
+    return ScalarLogical(obj_pin(CHAR(STRING_ELT(sKey, 0)), asInteger(sPin) == 1));
+}
+
 struct fetch_api {
     fetch_fn_t  fetch;
     const char *fbuf;
     sfs_len_t   flen;
 };
 
+static void get_unref(void *ctx) {
+    obj_unref((obj_entry_t*) ctx);
+}
+
 static void fetch_buf(fetch_api_t *api, void *buf, sfs_len_t len) {
     if (api->flen < len)
 	Rf_error("Read error: need %lu, got %lu\n", len, api->flen);
@@ -28,42 +459,116 @@ static void fetch_buf(fetch_api_t *api, void *buf, sfs_len_t len) {
     api->flen -= len;
 }
 
-SEXP C_get(SEXP sKey, SEXP sSFS, SEXP sRM) {
+typedef struct get_arg_s {
+    const char *key;
+    int use_sfs, rm;
+    obj_ver_t *view;
+} get_arg_t;
+
+/* runs inside a read section which is ended by get_done()
+   even if we long-jump */
+static SEXP get_(void *arg) {
+    get_arg_t *a = (get_arg_t*) arg;
     SEXP res = R_NilValue;
-    int use_sfs = asInteger(sSFS);
-    int rm = asInteger(sRM);
-    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
-	Rf_error("Invalid key, must be a string");
-    obj_init();
-    obj_entry_t *o = obj_get(CHAR(STRING_ELT(sKey, 0)), rm);
+    obj_entry_t *o = a->view ? obj_get_at(a->key, *a->view) : obj_get(a->key, a->rm);
     if (o) {
 	if (o->sWhat)
 	    return o->sWhat;
-	if (use_sfs) {
+	if (a->use_sfs) {
 	    fetch_api_t api;
 	    api.fbuf  = (const char*) o->obj;
 	    api.flen  = o->len;
 	    api.fetch = fetch_buf;
 	    res = sfs_load(&api);
+	} else if (o->len >= GET_REF_MIN) {
+	    /* the vector points to the payload and holds a reference to
+	       the entry until it is released or modified. It is not
+	       cached in sWhat, since that would keep the entry alive.
+	       altraw_new() drops the reference if it fails */
+	    obj_ref(o);
+	    return altraw_new(o->obj, (R_xlen_t) o->len, get_unref, o);
 	} else {
 	    res = Rf_allocVector(RAWSXP, o->len);
 	    if (o->obj && o->len)
 		memcpy(RAW(res), o->obj, o->len);
 	}
 	/* don't bother with updating sWhat if rm is set */
-	if (rm)
+	if (a->rm)
 	    return res ? res : R_NilValue;
-	if (res) {
-	    o->sWhat = res;
-	    if (res != R_NilValue)
-		R_PreserveObject(res);
-	}
+	if (res && res != R_NilValue)
+	    obj_cache(o, res);
     }
     return res;
-}   
+}
+
+static void get_done(void *arg) {
+    obj_read_end();
+}
+
+SEXP C_get(SEXP sKey, SEXP sSFS, SEXP sRM, SEXP sView) {
+    get_arg_t a;
+    SEXP res;
+    a.use_sfs = asInteger(sSFS);
+    a.rm = asInteger(sRM);
+    a.view = (sView == R_NilValue) ? 0 : R2view(sView);
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    if (a.view && a.rm)
+	Rf_error("Objects cannot be removed from a view");
+    a.key = CHAR(STRING_ELT(sKey, 0));
+    obj_init();
+    obj_gc();
+    /* payloads not backed by R objects may be released by any thread
+       once removed, so we have to hold a read section while using it */
+    obj_read_begin();
+    res = R_ExecWithCleanup(get_, &a, get_done, 0);
+    if (a.rm && res != R_NilValue) {
+	PROTECT(res);
+	sync_log();
+	UNPROTECT(1);
+    }
+    return res;
+}
+
+typedef struct mget_arg_s {
+    SEXP sKeys, sRes;
+    int use_sfs;
+} mget_arg_t;
+
+/* all keys are retrieved in one read section */
+static SEXP mget_(void *arg) {
+    mget_arg_t *m = (mget_arg_t*) arg;
+    get_arg_t a;
+    int i, n = LENGTH(m->sKeys);
+    a.use_sfs = m->use_sfs;
+    a.rm = 0;
+    a.view = 0;
+    for (i = 0; i < n; i++) {
+	a.key = CHAR(STRING_ELT(m->sKeys, i));
+	SET_VECTOR_ELT(m->sRes, i, get_(&a));
+    }
+    return m->sRes;
+}
+
+SEXP C_mget(SEXP sKeys, SEXP sSFS) {
+    mget_arg_t m;
+    if (TYPEOF(sKeys) != STRSXP)
+	Rf_error("Invalid keys, must be a character vector");
+    m.sKeys = sKeys;
+    m.use_sfs = asInteger(sSFS);
+    m.sRes = PROTECT(allocVector(VECSXP, LENGTH(sKeys)));
+    setAttrib(m.sRes, R_NamesSymbol, sKeys);
+    obj_init();
+    obj_gc();
+    obj_read_begin();
+    R_ExecWithCleanup(mget_, &m, get_done, 0);
+    UNPROTECT(1);
+    return m.sRes;
+}
 
 SEXP C_clean() {
     obj_init();
     obj_gc();
+    osrv_fork_tick();
     return ScalarLogical(1);
 }
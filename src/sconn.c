@@ -1,5 +1,16 @@
 #include "sconn.h"
 
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 ssize_t socket_send(socket_connection_t *c, const void *buf, size_t len) {
     return (ssize_t) send(c->s, buf, len, 0);
 }
@@ -8,3 +19,62 @@ ssize_t socket_recv(socket_connection_t *c, void *buf, size_t len) {
     return (ssize_t) recv(c->s, buf, len, 0);
 }
 
+/* uses getaddrinfo() so it is safe to call from worker threads */
+SOCKET tcp_connect(const char *host, int port) {
+    struct addrinfo hints, *ai, *a;
+    char sport[16];
+    SOCKET s = INVALID_SOCKET;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(sport, sizeof(sport), "%d", port);
+    if (getaddrinfo(host, sport, &hints, &ai))
+	return INVALID_SOCKET;
+    for (a = ai; a; a = a->ai_next) {
+	s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+	if (s == INVALID_SOCKET)
+	    continue;
+	if (!connect(s, a->ai_addr, a->ai_addrlen))
+	    break;
+	closesocket(s);
+	s = INVALID_SOCKET;
+    }
+    freeaddrinfo(ai);
+    if (s != INVALID_SOCKET) {
+	int opt = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const void*) &opt, sizeof(opt));
+    }
+    return s;
+}
+
+/* sends len bytes of the file fd starting at off to the socket s
+   without copying them through user space (where supported) */
+int socket_sendfile(SOCKET s, int fd, off_t off, size_t len) {
+#ifdef __linux__
+    while (len) {
+	ssize_t n = sendfile(s, fd, &off, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 1) /* also if the file was truncated */
+	    return (n < 0) ? -1 : 1;
+	len -= n;
+    }
+#else
+    char buf[65536];
+    while (len) {
+	ssize_t n = pread(fd, buf, (len > sizeof(buf)) ? sizeof(buf) : len, off), i = 0;
+	if (n < 1)
+	    return -1;
+	while (i < n) {
+	    ssize_t w = send(s, buf + i, n - i, 0);
+	    if (w < 1)
+		return (w < 0) ? -1 : 1;
+	    i += w;
+	}
+	off += n;
+	len -= n;
+    }
+#endif
+    return 0;
+}
@@ -25,4 +25,14 @@ struct socket_connection {
 ssize_t socket_send(socket_connection_t *c, const void *buf, size_t len);
 ssize_t socket_recv(socket_connection_t *c, void *buf, size_t len);
 
+/* sends len bytes of the file fd from off (using sendfile() where
+   available). Returns 0 on success, 1 if the connection was closed
+   and -1 on error */
+int socket_sendfile(SOCKET s, int fd, off_t off, size_t len);
+
+/* connect to host:port (TCP_NODELAY is set), does not use R API
+   so it can be used from any thread.
+   Returns INVALID_SOCKET on failure. */
+SOCKET tcp_connect(const char *host, int port);
+
 #endif
@@ -8,26 +8,321 @@
 
 #include "sfs.h"
 
+#include <limits.h>
+#include <Rversion.h>
+
 /* this is a "virtual" type, not defined by R, but used
    in our protocol to denote that an object has attributes
    and they are stored first */
 #define ATTRSXP 255
 
+/* reference to a string (CHARSXP), symbol or environment written
+   before, the length is its index: both sides number all environments
+   and all strings and symbols (except NA and empty symbols) in the
+   order in which they are written, but only up to SFS_MAX_REFS strings
+   and symbols */
+#define SFS_REF 254
+#define SFS_MAX_REFS 65536
+
+/* compact integer sequence (ALTREP), stored as the first and
+   last element (INTSXP with length 2) */
+#define SFS_ISEQ 253
+
+/* compact real sequence (ALTREP), stored as the first and
+   last element (REALSXP with length 2) */
+#define SFS_RSEQ 252
+
+/* number of elements of ALTREP vectors that are stored at once
+   if their content is not in memory */
+#define SFS_CHUNK 1024
+
 #define SFS_EMPTY_ENV   0xf0000000000000
 #define SFS_GLOBAL_ENV  0xf0000000000001
 #define SFS_BASE_ENV    0xf0000000000002
+/* followed by the namespace spec / package name */
+#define SFS_NS_ENV      0xf0000000000003
+#define SFS_PKG_ENV     0xf0000000000004
+#define SFS_BASE_NS     0xf0000000000005
+
+/* any other environment has the number of bindings (<< 4) and flags
+   as length and is followed by its enclosure, attributes, binding
+   flags (RAWSXP, optional) and tag/value pairs of the bindings.
+   Length 0 is an environment that was not serialised */
+#define SFS_ENV_LOCKED  1
+#define SFS_ENV_FLAGS   2 /* binding flags follow */
+#define SFS_ENV_S4      4
+#define SFS_ENV_CONTENT 8 /* always set */
+
+#define SFS_BIND_LOCKED 1
+#define SFS_BIND_ACTIVE 2
+
+/* environments with at least that many bindings are restored hashed,
+   otherwise defining the bindings takes quadratic time */
+#define SFS_HASH_MIN 32
 
 struct store_api {
     store_fn_t store;
     /* implementations can add anything here... */
 };
 
+/* ALTREP classes of compact integer and real sequences
+   (NULL if not available) */
+static SEXP intseq_class, realseq_class;
+
+/* calls first:last */
+static SEXP colon(int first, int last) {
+    SEXP res = PROTECT(lang3(install(":"), R_NilValue, R_NilValue));
+    SETCADR(res, ScalarInteger(first));
+    SETCADDR(res, ScalarInteger(last));
+    res = eval(res, R_BaseEnv);
+    UNPROTECT(1);
+    return res;
+}
+
+/* compact real sequences are created by seq_len() (and seq_along())
+   for lengths beyond the integer range, any other : gives the same
+   values (but expanded) */
+static SEXP rseq(double first, double last) {
+    SEXP res;
+    if (first == 1 && last >= 1) {
+	res = PROTECT(lang2(install("seq_len"), R_NilValue));
+	SETCADR(res, ScalarReal(last));
+    } else {
+	res = PROTECT(lang3(install(":"), R_NilValue, R_NilValue));
+	SETCADR(res, ScalarReal(first));
+	SETCADDR(res, ScalarReal(last));
+    }
+    res = eval(res, R_BaseEnv);
+    UNPROTECT(1);
+    return res;
+}
+
+void sfs_init(void) {
+    SEXP x = colon(1, 2);
+    /* classes are never released so no need to preserve them */
+    if (ALTREP(x)) {
+	intseq_class = ALTREP_CLASS(x);
+	/* seq_len() is compact like :, so nothing is allocated */
+	x = rseq(1, 2147483648.0);
+	if (ALTREP(x) && TYPEOF(x) == REALSXP)
+	    realseq_class = ALTREP_CLASS(x);
+    }
+}
+
+/* is x a compact integer sequence that was not expanded
+   (once expanded the content may have been modified) */
+static int is_intseq(SEXP x) {
+    return intseq_class && ALTREP(x) && ALTREP_CLASS(x) == intseq_class &&
+	R_altrep_data2(x) == R_NilValue && XLENGTH(x) > 1;
+}
+
+/* the same for compact real sequences */
+static int is_realseq(SEXP x) {
+    return realseq_class && ALTREP(x) && ALTREP_CLASS(x) == realseq_class &&
+	R_altrep_data2(x) == R_NilValue && XLENGTH(x) > 1;
+}
+
+/* is x an ALTREP vector whose content is not in memory, so that
+   INTEGER() etc. would expand it */
+static int is_altvec(SEXP x) {
+    return ALTREP(x) && !DATAPTR_OR_NULL(x);
+}
+
 struct fetch_api {
     fetch_fn_t fetch;
     /* implementations can add anything here... */
 };
 
-static void store(store_api_t *api, SEXP sWhat) {
+/* state of one sfs_store() call, it may be called from any thread
+   so we can't use R memory */
+typedef struct enc_s {
+    store_api_t *api;
+    SEXP *key;           /* open addressing table of written strings */
+    unsigned int *ref;   /* and their index */
+    unsigned long size, used;
+    unsigned long n, strs; /* numbered objects, of which strings */
+} enc_t;
+
+static unsigned long enc_hash(SEXP x, unsigned long size) {
+    return ((((unsigned long) (size_t) x) >> 4) * 0x9E3779B97F4A7C15UL) & (size - 1);
+}
+
+/* returns the slot of x (key is 0 if not found) or -1 if there is no table */
+static long enc_find(enc_t *enc, SEXP x) {
+    unsigned long i;
+    if (!enc->size)
+	return -1;
+    i = enc_hash(x, enc->size);
+    while (enc->key[i] && enc->key[i] != x)
+	i = (i + 1) & (enc->size - 1);
+    return (long) i;
+}
+
+/* adds x which was not found with the next number, returns -1 if the
+   table cannot grow (for strings that only means that repeats will
+   be written again) */
+static int enc_add(enc_t *enc, SEXP x, long slot) {
+    if (enc->size == 0 || (enc->used + 1) * 2 > enc->size) {
+	unsigned long i, ns = enc->size ? enc->size * 2 : 256;
+	SEXP *nk = (SEXP*) calloc(ns, sizeof(SEXP));
+	unsigned int *nr = (unsigned int*) malloc(ns * sizeof(unsigned int));
+	if (!nk || !nr) {
+	    free(nk);
+	    free(nr);
+	    return -1;
+	}
+	for (i = 0; i < enc->size; i++)
+	    if (enc->key[i]) {
+		unsigned long j = enc_hash(enc->key[i], ns);
+		while (nk[j])
+		    j = (j + 1) & (ns - 1);
+		nk[j] = enc->key[i];
+		nr[j] = enc->ref[i];
+	    }
+	free(enc->key);
+	free(enc->ref);
+	enc->key = nk;
+	enc->ref = nr;
+	enc->size = ns;
+	slot = enc_find(enc, x);
+    }
+    enc->key[slot] = x;
+    enc->ref[slot] = (unsigned int) enc->n;
+    enc->used++;
+    return 0;
+}
+
+/* writes a string or a symbol (x) with the content c, or a reference
+   if it was written before. The table is keyed by address, so x must
+   stay alive until the end: if keep is 0 (x may be collected and its
+   address re-used) it is written in full and only takes its number */
+static void store_str(enc_t *enc, sfs_ts ts, SEXP x, const char *c, int keep) {
+    sfs_len_t len = *c ? strlen(c) + 1 : 0;
+    if (ts == CHARSXP) /* "" has length 1, 0 is NA */
+	len = (x == NA_STRING) ? 0 : strlen(c) + 1;
+    if (len && enc->strs < SFS_MAX_REFS) {
+	if (keep) {
+	    long slot = enc_find(enc, x);
+	    if (slot >= 0 && enc->key[slot]) {
+		enc->api->store(enc->api, SFS_REF, 0, enc->ref[slot], 0);
+		return;
+	    }
+	    enc_add(enc, x, slot);
+	}
+	enc->n++;
+	enc->strs++;
+    }
+    enc->api->store(enc->api, ts, 1, len, c);
+}
+
+/* collects the binding cells of env into a malloc'd array,
+   returns their count or -1 if out of memory */
+static long env_cells(SEXP env, SEXP **cells) {
+    SEXP tab = HASHTAB(env), *c = 0;
+    long n = 0, m = 0, i, k = (tab == R_NilValue) ? 1 : XLENGTH(tab);
+    for (i = 0; i < k; i++) {
+	SEXP x = (tab == R_NilValue) ? FRAME(env) : VECTOR_ELT(tab, i);
+	while (x != R_NilValue) {
+	    if (n == m) {
+		SEXP *nc = (SEXP*) realloc(c, sizeof(SEXP) * (m = m ? m * 2 : 16));
+		if (!nc) {
+		    free(c);
+		    return -1;
+		}
+		c = nc;
+	    }
+	    c[n++] = x;
+	    x = CDR(x);
+	}
+    }
+    *cells = c;
+    return n;
+}
+
+static void store(enc_t *enc, SEXP sWhat);
+
+/* writes a custom environment (or a reference if it was written
+   before). It is numbered before its content, so cycles end up
+   as references. We don't evaluate anything: promises are stored
+   as they are and active bindings as their functions. */
+static void store_env(enc_t *enc, SEXP env) {
+    store_api_t *api = enc->api;
+    long slot = enc_find(enc, env), n, i;
+    SEXP *cells = 0;
+    unsigned char *bf = 0;
+    sfs_len_t flags = SFS_ENV_CONTENT;
+    if (slot >= 0 && enc->key[slot]) {
+	api->store(api, SFS_REF, 0, enc->ref[slot], 0);
+	return;
+    }
+    if ((n = env_cells(env, &cells)) < 0 ||
+	(n && !(bf = (unsigned char*) calloc(n, 1))) ||
+	enc_add(enc, env, slot)) {
+	free(cells);
+	free(bf);
+	api->store(api, ENVSXP, 0, 0, 0);
+	return;
+    }
+    enc->n++;
+    for (i = 0; i < n; i++) {
+	SEXP sym = TAG(cells[i]);
+	if (R_BindingIsLocked(sym, env))
+	    bf[i] |= SFS_BIND_LOCKED;
+	if (R_BindingIsActive(sym, env))
+	    bf[i] |= SFS_BIND_ACTIVE;
+	if (bf[i])
+	    flags |= SFS_ENV_FLAGS;
+    }
+    if (R_EnvironmentIsLocked(env))
+	flags |= SFS_ENV_LOCKED;
+    if (IS_S4_OBJECT(env))
+	flags |= SFS_ENV_S4;
+    api->store(api, ENVSXP, 0, (((sfs_len_t) n) << 4) | flags, 0);
+    store(enc, ENCLOS(env));
+    store(enc, ATTRIB(env));
+    if (flags & SFS_ENV_FLAGS)
+	api->store(api, RAWSXP, 1, n, bf);
+    for (i = 0; i < n; i++) {
+	SEXP sym = TAG(cells[i]);
+	store(enc, sym);
+	/* active bindings hold the function, for others we have to go
+	   through the API since R may keep scalar values unboxed */
+	store(enc, (bf[i] & SFS_BIND_ACTIVE) ? CAR(cells[i]) :
+	      findVarInFrame3(env, sym, TRUE));
+    }
+    free(cells);
+    free(bf);
+}
+
+/* stores a vector with el-byte elements without expanding ALTREP
+   vectors: if their content is not in memory the header is stored
+   first, then the content in chunks fetched with the region methods
+   (which fall back to the element methods) */
+static void store_vec(store_api_t *api, SEXP x, sfs_len_t el) {
+    Rcomplex buf[SFS_CHUNK]; /* the largest element */
+    sfs_len_t i = 0, n = XLENGTH(x);
+    const void *data = ALTREP(x) ? DATAPTR_OR_NULL(x) : DATAPTR_RO(x);
+    if (data) {
+	api->store(api, TYPEOF(x), el, n, data);
+	return;
+    }
+    api->store(api, TYPEOF(x), el, n, 0);
+    while (i < n) {
+	R_xlen_t k = (n - i > SFS_CHUNK) ? SFS_CHUNK : (R_xlen_t) (n - i);
+	switch (TYPEOF(x)) {
+	case LGLSXP: k = LOGICAL_GET_REGION(x, i, k, (int*) buf); break;
+	case INTSXP: k = INTEGER_GET_REGION(x, i, k, (int*) buf); break;
+	case REALSXP: k = REAL_GET_REGION(x, i, k, (double*) buf); break;
+	case CPLXSXP: k = COMPLEX_GET_REGION(x, i, k, buf); break;
+	case RAWSXP: k = RAW_GET_REGION(x, i, k, (Rbyte*) buf); break;
+	}
+	api->store(api, SFS_DATA, el, k, buf);
+	i += k;
+    }
+}
+
+static void store(enc_t *enc, SEXP sWhat) {
+    store_api_t *api = enc->api;
     /* store attributes first if present */
     switch (TYPEOF(sWhat)) {
     case LGLSXP:
@@ -48,8 +343,8 @@ static void store(store_api_t *api, SEXP sWhat) {
 	    api->store(api, ATTRSXP, 0, l, 0);
 	    x = ATTRIB(sWhat);
 	    while (x != R_NilValue) {
-		store(api, TAG(x));
-		store(api, CAR(x));
+		store(enc, TAG(x));
+		store(enc, CAR(x));
 		x = CDR(x);
 	    }
 	}
@@ -58,21 +353,36 @@ static void store(store_api_t *api, SEXP sWhat) {
     /* then the object itself */
     switch (TYPEOF(sWhat)) {
     case INTSXP:
+	if (is_intseq(sWhat)) {
+	    /* don't use INTEGER() which would expand it */
+	    int v[2];
+	    v[0] = INTEGER_ELT(sWhat, 0);
+	    v[1] = INTEGER_ELT(sWhat, XLENGTH(sWhat) - 1);
+	    api->store(api, SFS_ISEQ, 4, 2, v);
+	    break;
+	}
+	/* fall through */
     case LGLSXP:
-	api->store(api, TYPEOF(sWhat), 4, XLENGTH(sWhat), INTEGER(sWhat));
+	store_vec(api, sWhat, 4);
 	break;
     case REALSXP:
-	api->store(api, TYPEOF(sWhat), 8, XLENGTH(sWhat), REAL(sWhat));
+	if (is_realseq(sWhat)) {
+	    double v[2];
+	    v[0] = REAL_ELT(sWhat, 0);
+	    v[1] = REAL_ELT(sWhat, XLENGTH(sWhat) - 1);
+	    api->store(api, SFS_RSEQ, 8, 2, v);
+	} else
+	    store_vec(api, sWhat, 8);
 	break;
     case CPLXSXP:
-	api->store(api, TYPEOF(sWhat), 16, XLENGTH(sWhat), COMPLEX(sWhat));
+	store_vec(api, sWhat, 16);
 	break;
     case VECSXP:
 	{
 	    sfs_len_t i = 0 , n = XLENGTH(sWhat);
 	    api->store(api, TYPEOF(sWhat), 0, n, 0);
 	    while (i < n) {
-		store(api, VECTOR_ELT(sWhat, i));
+		store(enc, VECTOR_ELT(sWhat, i));
 		i++;
 	    }
 	    break;
@@ -80,10 +390,14 @@ static void store(store_api_t *api, SEXP sWhat) {
     case STRSXP:
 	{
 	    sfs_len_t i = 0 , n = XLENGTH(sWhat);
+	    /* ALTREP elements may be created by STRING_ELT() and
+	       released right away (only on the R thread, see
+	       sfs_needs_r()) */
+	    int keep = !is_altvec(sWhat);
 	    api->store(api, TYPEOF(sWhat), 0, n, 0);
 	    while (i < n) {
-		const char *c = CHAR(STRING_ELT(sWhat, i));
-		api->store(api, CHARSXP, 1, strlen(c) + 1, c);
+		SEXP c = STRING_ELT(sWhat, i);
+		store_str(enc, CHARSXP, c, CHAR(c), keep);
 		i++;
 	    }
 	    break;
@@ -93,30 +407,43 @@ static void store(store_api_t *api, SEXP sWhat) {
 	api->store(api, TYPEOF(sWhat), 0, 0, 0);
 	break;
     case RAWSXP:
-	api->store(api, TYPEOF(sWhat), 1, XLENGTH(sWhat), RAW(sWhat));
+	store_vec(api, sWhat, 1);
 	break;
     case SYMSXP:
 	{
-	    const char *p = CHAR(PRINTNAME(sWhat));
-	    api->store(api, TYPEOF(sWhat), 1, *p ? strlen(p) + 1 : 0, p);
+	    store_str(enc, SYMSXP, sWhat, CHAR(PRINTNAME(sWhat)), 1);
 	    break;
 	}
     case CLOSXP:
 	api->store(api, TYPEOF(sWhat), 0, 3, 0);
-	store(api, FORMALS(sWhat));
+	store(enc, FORMALS(sWhat));
 	/* FIXME: until we know how to handle byte code
 	   we store the expression, not the byte code */
 	if (TYPEOF(BODY(sWhat)) == BCODESXP)
-	    store(api, BODY_EXPR(sWhat));
+	    store(enc, BODY_EXPR(sWhat));
 	else
-	    store(api, BODY(sWhat));
-	store(api, CLOENV(sWhat));
+	    store(enc, BODY(sWhat));
+	store(enc, CLOENV(sWhat));
 	break;
 
-	/*case BCODESXP: FIXME: how to handle byte code? */
+    case BCODESXP: /* can only be the code of a promise,
+		      we store the expression */
+	store(enc, LENGTH(CDR(sWhat)) ? VECTOR_ELT(CDR(sWhat), 0) : R_NilValue);
+	break;
+
+    case PROMSXP: /* forced promises are stored as their value */
+	if (PRVALUE(sWhat) != R_UnboundValue)
+	    store(enc, PRVALUE(sWhat));
+	else {
+	    api->store(api, PROMSXP, 0, 2, 0);
+	    store(enc, PRCODE(sWhat));
+	    store(enc, PRENV(sWhat));
+	}
+	break;
 
     case LISTSXP:
     case LANGSXP:
+    case DOTSXP:
 	{
 	    sfs_len_t l = 0;
 	    SEXP x = sWhat;
@@ -127,8 +454,8 @@ static void store(store_api_t *api, SEXP sWhat) {
 	    api->store(api, TYPEOF(sWhat), 0, l, 0);
 	    x = sWhat;
 	    while (x != R_NilValue) {
-		store(api, TAG(x));
-		store(api, CAR(x));
+		store(enc, TAG(x));
+		store(enc, CAR(x));
 		x = CDR(x);
 	    }
 	    break;
@@ -141,8 +468,16 @@ static void store(store_api_t *api, SEXP sWhat) {
 	    api->store(api, TYPEOF(sWhat), 0, SFS_EMPTY_ENV, 0);
 	else if (sWhat == R_BaseEnv)
 	    api->store(api, TYPEOF(sWhat), 0, SFS_BASE_ENV, 0);
-	else /* unsupported ! */
-	    api->store(api, TYPEOF(sWhat), 0, 0, 0);
+	else if (sWhat == R_BaseNamespace)
+	    api->store(api, TYPEOF(sWhat), 0, SFS_BASE_NS, 0);
+	else if (R_IsNamespaceEnv(sWhat)) {
+	    api->store(api, TYPEOF(sWhat), 0, SFS_NS_ENV, 0);
+	    store(enc, R_NamespaceEnvSpec(sWhat));
+	} else if (R_IsPackageEnv(sWhat)) {
+	    api->store(api, TYPEOF(sWhat), 0, SFS_PKG_ENV, 0);
+	    store(enc, R_PackageEnvName(sWhat));
+	} else
+	    store_env(enc, sWhat);
 	break;
 
     default:
@@ -150,10 +485,171 @@ static void store(store_api_t *api, SEXP sWhat) {
     }
 }
 
+int sfs_needs_r(SEXP sWhat) {
+    /* this follows store() */
+    switch (TYPEOF(sWhat)) {
+    case LGLSXP:
+    case INTSXP:
+    case REALSXP:
+    case CPLXSXP:
+    case STRSXP:
+    case RAWSXP:
+	/* the methods of other classes may use the R API */
+	if (is_altvec(sWhat) && !is_intseq(sWhat) && !is_realseq(sWhat))
+	    return 1;
+	/* fall through */
+    case S4SXP:
+	return sfs_needs_r(ATTRIB(sWhat));
+    case VECSXP:
+	{
+	    sfs_len_t i = 0 , n = XLENGTH(sWhat);
+	    while (i < n)
+		if (sfs_needs_r(VECTOR_ELT(sWhat, i++)))
+		    return 1;
+	    return sfs_needs_r(ATTRIB(sWhat));
+	}
+    case CLOSXP:
+	return sfs_needs_r(FORMALS(sWhat)) || sfs_needs_r(CLOENV(sWhat)) ||
+	    sfs_needs_r((TYPEOF(BODY(sWhat)) == BCODESXP) ? BODY_EXPR(sWhat) : BODY(sWhat));
+    case BCODESXP:
+	return LENGTH(CDR(sWhat)) && sfs_needs_r(VECTOR_ELT(CDR(sWhat), 0));
+    case PROMSXP:
+	if (PRVALUE(sWhat) != R_UnboundValue)
+	    return sfs_needs_r(PRVALUE(sWhat));
+	return sfs_needs_r(PRCODE(sWhat)) || sfs_needs_r(PRENV(sWhat));
+    case LISTSXP:
+    case LANGSXP:
+    case DOTSXP:
+	while (sWhat != R_NilValue) {
+	    if (sfs_needs_r(CAR(sWhat)))
+		return 1;
+	    sWhat = CDR(sWhat);
+	}
+	return 0;
+    case ENVSXP:
+	return sWhat != R_GlobalEnv && sWhat != R_EmptyEnv &&
+	    sWhat != R_BaseEnv && sWhat != R_BaseNamespace;
+    }
+    return 0;
+}
+
 /* static scratch buffer for decoding symbols and strings */
 static char dec_buf[8192];
 
-static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
+/* state of one sfs_load() call: table of strings, symbols and
+   environments that can be referenced by SFS_REF */
+typedef struct dec_s {
+    fetch_api_t *api;
+    SEXP tab;
+    unsigned long n, strs;
+    PROTECT_INDEX ipx;
+} dec_t;
+
+static SEXP load(dec_t *dec);
+
+/* registers a decoded object (strings and symbols only if numbered) */
+static SEXP dec_add(dec_t *dec, SEXP x, int str) {
+    if (str && dec->strs >= SFS_MAX_REFS)
+	return x;
+    if (str)
+	dec->strs++;
+    if (dec->n >= XLENGTH(dec->tab)) {
+	unsigned long i = 0, n = XLENGTH(dec->tab);
+	SEXP nt;
+	PROTECT(x);
+	nt = allocVector(VECSXP, n * 2);
+	while (i < n) {
+	    SET_VECTOR_ELT(nt, i, VECTOR_ELT(dec->tab, i));
+	    i++;
+	}
+	REPROTECT(dec->tab = nt, dec->ipx);
+	UNPROTECT(1);
+    }
+    SET_VECTOR_ELT(dec->tab, dec->n++, x);
+    return x;
+}
+
+/* sets attributes, flags the object if it has a class */
+static void dec_attrib(SEXP x, SEXP attr) {
+    SEXP c = attr;
+    while (c != R_NilValue) {
+	if (TAG(c) == R_ClassSymbol) {
+	    SET_OBJECT(x, 1);
+	    break;
+	}
+	c = CDR(c);
+    }
+    SET_ATTRIB(x, attr);
+}
+
+/* environment with content, len has the count and flags */
+/* new environment for n bindings, the enclosure is set later */
+static SEXP new_env(sfs_len_t n) {
+#if R_VERSION >= R_Version(4,1,0)
+    if (n >= SFS_HASH_MIN) /* the table grows if needed */
+	return R_NewEnv(R_EmptyEnv, TRUE, (n > INT_MAX) ? INT_MAX : ((int) n));
+#endif
+    return NewEnvironment(R_NilValue, R_NilValue, R_EmptyEnv);
+}
+
+static SEXP decode_env(dec_t *dec, sfs_len_t len) {
+    sfs_len_t i = 0, n = len >> 4;
+    SEXP env = dec_add(dec, new_env(n), 0);
+    SEXP v = load(dec), flags = R_NilValue;
+    if (TYPEOF(v) != ENVSXP)
+	Rf_error("Invalid environment in serialized data");
+    SET_ENCLOS(env, v);
+    v = load(dec);
+    if (v != R_NilValue)
+	dec_attrib(env, v);
+    if (len & SFS_ENV_S4)
+	SET_S4_OBJECT(env);
+    if (len & SFS_ENV_FLAGS) {
+	flags = load(dec);
+	if (TYPEOF(flags) != RAWSXP || XLENGTH(flags) != n)
+	    Rf_error("Invalid environment in serialized data");
+    }
+    PROTECT(flags);
+    while (i < n) {
+	SEXP sym = PROTECT(load(dec));
+	int bf = (flags == R_NilValue) ? 0 : RAW(flags)[i];
+	if (TYPEOF(sym) != SYMSXP)
+	    Rf_error("Invalid environment in serialized data");
+	v = load(dec);
+	if (bf & SFS_BIND_ACTIVE)
+	    R_MakeActiveBinding(sym, v, env);
+	else
+	    defineVar(sym, v, env);
+	if (bf & SFS_BIND_LOCKED)
+	    R_LockBinding(sym, env);
+	UNPROTECT(1);
+	i++;
+    }
+    UNPROTECT(1);
+    if (len & SFS_ENV_LOCKED)
+	R_LockEnvironment(env, FALSE);
+    return env;
+}
+
+/* fetches a string of len bytes and calls fn on it */
+static SEXP dec_str(dec_t *dec, sfs_len_t len, SEXP (*fn)(const char*)) {
+    SEXP res;
+    char *buf;
+    if (len < sizeof(dec_buf)) {
+	dec->api->fetch(dec->api, dec_buf, len);
+	return fn(dec_buf);
+    }
+    buf = (char*) malloc(len);
+    if (!buf)
+	Rf_error("Cannot allocate memory for string (%lu bytes)", len);
+    dec->api->fetch(dec->api, buf, len);
+    res = fn(buf);
+    free(buf);
+    return res;
+}
+
+static SEXP decode_one(dec_t *dec, sfs_len_t hdr) {
+    fetch_api_t *api = dec->api;
     sfs_len_t len;
     sfs_ts ts;
     SEXP res = R_NilValue;
@@ -176,22 +672,35 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	res = allocVector(ts, len);
 	api->fetch(api, COMPLEX(res), len * 16);
 	break;
+    case RAWSXP:
+	res = allocVector(ts, len);
+	api->fetch(api, RAW(res), len);
+	break;
+    case SFS_ISEQ:
+	{
+	    int v[2];
+	    if (len != 2)
+		Rf_error("Invalid sequence in serialized data");
+	    api->fetch(api, v, sizeof(v));
+	    res = colon(v[0], v[1]);
+	    break;
+	}
+    case SFS_RSEQ:
+	{
+	    double v[2];
+	    if (len != 2)
+		Rf_error("Invalid sequence in serialized data");
+	    api->fetch(api, v, sizeof(v));
+	    res = rseq(v[0], v[1]);
+	    break;
+	}
     case SYMSXP:
 	{
 	    if (len == 0) {
 		res = R_MissingArg;
 		break;
 	    }
-	    if (len < sizeof(dec_buf)) {
-		api->fetch(api, dec_buf, len);
-		res = Rf_install(dec_buf);
-	    } else {
-		char *buf = (char*) malloc(len);
-		if (!buf)
-		    Rf_error("Cannot allocate memory for symbol (%lu bytes)", len);
-		res = Rf_install(buf);
-		free(buf);
-	    }
+	    res = dec_add(dec, dec_str(dec, len, Rf_install), 1);
 	    break;
 	}
     case VECSXP:
@@ -199,7 +708,7 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	    sfs_len_t i = 0;
 	    res = PROTECT(allocVector(ts, len));
 	    while (i < len) {
-		SET_VECTOR_ELT(res, i, sfs_load(api));
+		SET_VECTOR_ELT(res, i, load(dec));
 		i++;
 	    }
 	    UNPROTECT(1);
@@ -210,7 +719,7 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	    sfs_len_t i = 0;
 	    res = PROTECT(allocVector(ts, len));
 	    while (i < len) {
-		SET_STRING_ELT(res, i, sfs_load(api));
+		SET_STRING_ELT(res, i, load(dec));
 		i++;
 	    }
 	    UNPROTECT(1);
@@ -218,46 +727,59 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	}
     case CHARSXP:
 	{
-	    if (len < sizeof(dec_buf)) {
-		api->fetch(api, dec_buf, len);
-		res = mkChar(dec_buf);
-	    } else {
-		char *buf = (char*) malloc(len);
-		if (!buf)
-		    Rf_error("Cannot allocate memory for string (%lu bytes)", len);
-		res = mkChar(buf);
-		free(buf);
-	    }
+	    if (len == 0) /* NA */
+		return NA_STRING;
+	    res = dec_add(dec, dec_str(dec, len, Rf_mkChar), 1);
 	    break;
 	}
 
+    case SFS_REF:
+	if (len >= dec->n)
+	    Rf_error("Invalid reference in serialized data");
+	return VECTOR_ELT(dec->tab, len);
+
     case CLOSXP:
 	{
 	    SEXP v;
 	    res = PROTECT(allocSExp(CLOSXP));
-	    v = sfs_load(api);
+	    v = load(dec);
 	    if (v != R_NilValue)
 		SET_FORMALS(res, v);
-	    v = sfs_load(api);
+	    v = load(dec);
 	    if (v != R_NilValue)
 		SET_BODY(res, v);
-	    v = sfs_load(api);
+	    v = load(dec);
 	    if (v != R_NilValue)
 		SET_CLOENV(res, v);
 	    UNPROTECT(1);
 	    break;
 	}
 
+    case PROMSXP:
+	{
+	    SEXP v;
+	    res = PROTECT(allocSExp(PROMSXP));
+	    SET_PRVALUE(res, R_UnboundValue);
+	    SET_PRCODE(res, load(dec));
+	    v = load(dec);
+	    if (TYPEOF(v) != ENVSXP)
+		Rf_error("Invalid promise in serialized data");
+	    SET_PRENV(res, v);
+	    UNPROTECT(1);
+	    break;
+	}
+
     case ATTRSXP:
     case LISTSXP:
     case LANGSXP:
+    case DOTSXP:
 	{
 	    sfs_len_t i = 0;
 	    SEXP at = R_NilValue;
 	    res = R_NilValue;
 	    while (i < len) {
-		SEXP tag = PROTECT(sfs_load(api));
-		SEXP val = PROTECT(sfs_load(api));
+		SEXP tag = PROTECT(load(dec));
+		SEXP val = PROTECT(load(dec));
 		SEXP x = PROTECT((ts == LANGSXP) ?
 				 LCONS(val, R_NilValue) :
 				 CONS(val, R_NilValue));
@@ -274,6 +796,8 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	    }
 	    if (i > 0)
 		UNPROTECT(3);
+	    if (ts == DOTSXP && res != R_NilValue)
+		SET_TYPEOF(res, DOTSXP);
 	    break;
 	}
     case ENVSXP:
@@ -283,6 +807,16 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 	    return R_EmptyEnv;
 	if (len == SFS_BASE_ENV)
 	    return R_BaseEnv;
+	if (len == SFS_BASE_NS)
+	    return R_BaseNamespace;
+	if (len == SFS_NS_ENV || len == SFS_PKG_ENV) {
+	    SEXP info = PROTECT(load(dec));
+	    res = (len == SFS_NS_ENV) ? R_FindNamespace(info) : R_FindPackageEnv(info);
+	    UNPROTECT(1);
+	    return res;
+	}
+	if (len & SFS_ENV_CONTENT)
+	    return decode_env(dec, len);
 	Rf_warning("Custom environments are not serialized.");
 	return R_BaseEnv;
 	break;
@@ -294,35 +828,41 @@ static SEXP decode_one(fetch_api_t *api, sfs_len_t hdr) {
 
 /* API entry for store */
 void sfs_store(store_api_t *api, SEXP sWhat) {
-    store(api, sWhat);
+    enc_t enc;
+    memset(&enc, 0, sizeof(enc));
+    enc.api = api;
+    store(&enc, sWhat);
+    free(enc.key);
+    free(enc.ref);
 }
 
-/* API entry for load */
-SEXP sfs_load(fetch_api_t *api) {
+static SEXP load(dec_t *dec) {
+    fetch_api_t *api = dec->api;
     sfs_len_t hdr;
     SEXP res, attr = R_NilValue;
     api->fetch(api, &hdr, sizeof(hdr));
     if ((hdr & 255) == ATTRSXP) {
-	attr = decode_one(api, hdr);
+	attr = decode_one(dec, hdr);
 	if (attr != R_NilValue)
 	    PROTECT(attr);
 	api->fetch(api, &hdr, sizeof(hdr));
     }
-    res = decode_one(api, hdr);
+    res = decode_one(dec, hdr);
     if (attr != R_NilValue) {
-	SEXP c = attr;
-	/* check for the "class" attribute
-	   so we can flag the object */
-	while (c != R_NilValue) {
-	    if (TAG(c) == R_ClassSymbol) {
-		SET_OBJECT(res, 1);
-		break;
-	    }
-	    c = CDR(c);
-	}
-	PROTECT(res);
-	SET_ATTRIB(res, attr);
-	UNPROTECT(2);
+	dec_attrib(res, attr);
+	UNPROTECT(1);
     }
     return res;
 }
+
+/* API entry for load */
+SEXP sfs_load(fetch_api_t *api) {
+    dec_t dec;
+    SEXP res;
+    dec.api = api;
+    dec.n = dec.strs = 0;
+    PROTECT_WITH_INDEX(dec.tab = allocVector(VECSXP, 64), &dec.ipx);
+    res = load(&dec);
+    UNPROTECT(1);
+    return res;
+}
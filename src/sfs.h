@@ -20,6 +20,14 @@ typedef struct fetch_api fetch_api_t;
 typedef void(*store_fn_t)(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const void *buf);
 typedef void(*fetch_fn_t)(fetch_api_t *api, void *buf, sfs_len_t len);
 
+/* the store function writes a header with the type and length
+   followed by len * el bytes of buf (none if buf is NULL). The pseudo
+   type SFS_DATA writes len * el bytes of buf without a header: it is
+   used for content that is stored in chunks after its header was
+   stored with buf = NULL (ALTREP vectors), so it never appears in
+   the output */
+#define SFS_DATA 251
+
 /* implementations need to define store_api and fetch_api
    structs with at least the following:
 
@@ -35,8 +43,19 @@ struct fetch_api {
 
 */
 
+/* looks up the ALTREP classes that SFS stores in compact form,
+   called from R_init_osrv() */
+void sfs_init(void);
+
 void sfs_store(store_api_t *api, SEXP sWhat);
 
+/* returns 1 if sfs_store() of sWhat uses the R API (environments
+   other than the global, base and empty ones, ALTREP vectors other
+   than compact sequences whose content is not in memory), so it may
+   only be called on the R thread, 0 if it can be called from any
+   thread */
+int sfs_needs_r(SEXP sWhat);
+
 /* FIXME: sfs_load() currently uses Rf_error() and
    Rf_warning() - we should let the API decide what to do */
 SEXP sfs_load(fetch_api_t *api);
@@ -0,0 +1,550 @@
+/* shared memory publishing of payloads for processes on the same host
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+SEXP C_shm(SEXP sName, SEXP sSlots, SEXP sMin);
+SEXP C_map(SEXP sKey, SEXP sName);
+
+   The index "/osrv.idx.<name>" is a header followed by a fixed
+   number of slots (open addressing with linear probing). Only the
+   owner writes to it (under shm_mutex), each slot is protected by a
+   sequence lock: the owner makes the sequence odd while it modifies
+   the slot, readers copy the slot and retry if the sequence changed.
+   The payload of a slot is in the segment "/osrv.seg.<pid>.<serial>"
+   where pid is the owner and serial is unique for each segment of
+   the owner, so names are never re-used. The segment starts with a
+   header (shm_seg_hdr_t) which readers check against the slot.
+
+   Segments are unlinked as soon as their entry is released, readers
+   that find a slot whose segment is gone simply look again. The
+   system keeps the memory of unlinked segments until the last map is
+   gone, which serves as the reference count: the owner never frees
+   memory that another process maps.
+
+   If the owner dies, the index and segments stay behind (POSIX shared
+   memory is not tied to a process), they are removed when the next
+   owner starts an index of the same name.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "shm.h"
+#include "obj.h"
+#include "sfs.h"
+#include "altraw.h"
+
+#define SHM_MAGIC   "OSRVSHM1"
+#define SHM_KEY_MAX 208 /* including the terminating 0 */
+#define SHM_SEG_HDR 64  /* keeps the payload aligned */
+#define SHM_TOMB    (~((uint64_t) 0))
+
+typedef struct shm_slot_s {
+    uint64_t seq;    /* odd while the owner modifies the slot */
+    uint64_t serial; /* 0 = empty, SHM_TOMB = removed */
+    uint64_t hash, len, version;
+    uint32_t flags, klen;
+    char key[SHM_KEY_MAX];
+} shm_slot_t;
+
+typedef struct shm_index_s {
+    char magic[8];
+    uint64_t pid, slots;
+    uint64_t res[5];
+    shm_slot_t slot[1];
+} shm_index_t;
+
+typedef struct shm_seg_hdr_s {
+    uint64_t serial, len;
+} shm_seg_hdr_t;
+
+struct shm_seg_s {
+    uint64_t serial, pid;
+    void *map;
+    size_t map_len;
+    int flags;
+    char *key; /* set once published */
+};
+
+#define SHM_INDEX_SIZE(N) (offsetof(shm_index_t, slot) + sizeof(shm_slot_t) * (N))
+
+/* owner state, modified under shm_mutex */
+static shm_index_t *shm_idx;
+static char shm_name[256];
+static size_t shm_min, shm_fill;
+static uint64_t shm_serial;
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t shm_hash(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    while (len--)
+	h = (h ^ ((unsigned char) *(key++))) * 1099511628211ull;
+    return h;
+}
+
+static int shm_index_name(char *buf, size_t size, const char *name) {
+    if (!*name || strchr(name, '/') || strlen(name) > 200) {
+	errno = EINVAL;
+	return -1;
+    }
+    snprintf(buf, size, "/osrv.idx.%s", name);
+    return 0;
+}
+
+static void shm_seg_name(char *buf, size_t size, uint64_t pid, uint64_t serial) {
+    snprintf(buf, size, "/osrv.seg.%lu.%lu", (unsigned long) pid, (unsigned long) serial);
+}
+
+/* copies a consistent state of the slot */
+static void shm_slot_read(shm_slot_t *s, shm_slot_t *c) {
+    while (1) {
+	uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+	if (!(seq & 1)) {
+	    memcpy(c, s, sizeof(shm_slot_t));
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+		return;
+	}
+	sched_yield();
+    }
+}
+
+/* the writer side of shm_slot_read(), key may be NULL to keep it */
+static void shm_slot_write(shm_slot_t *s, uint64_t serial, uint64_t hash, uint64_t len,
+			   uint64_t version, int flags, const char *key, size_t kl) {
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->serial = serial;
+    s->hash = hash;
+    s->len = len;
+    s->version = version;
+    s->flags = flags;
+    if (key) {
+	s->klen = (uint32_t) kl;
+	memcpy(s->key, key, kl + 1);
+    }
+    __atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* --- owner --- */
+
+/* unlinks the names of all segments in the index */
+static void shm_unlink_all(shm_index_t *idx) {
+    char sn[64];
+    uint64_t i;
+    for (i = 0; i < idx->slots; i++)
+	if (idx->slot[i].serial && idx->slot[i].serial != SHM_TOMB) {
+	    shm_seg_name(sn, sizeof(sn), idx->pid, idx->slot[i].serial);
+	    shm_unlink(sn);
+	}
+}
+
+void shm_stop() {
+    pthread_mutex_lock(&shm_mutex);
+    if (shm_idx) {
+	__atomic_store_n(&shm_min, 0, __ATOMIC_RELAXED);
+	/* a forked child must not touch the index of the parent */
+	if (shm_idx->pid == (uint64_t) getpid()) {
+	    shm_unlink_all(shm_idx);
+	    shm_unlink(shm_name);
+	}
+	munmap(shm_idx, SHM_INDEX_SIZE(shm_idx->slots));
+	shm_idx = 0;
+    }
+    pthread_mutex_unlock(&shm_mutex);
+}
+
+int shm_start(const char *name, unsigned long slots, size_t min_size) {
+    char iname[256];
+    unsigned long n = 64;
+    shm_index_t *idx;
+    struct stat st;
+    int fd;
+
+    if (shm_index_name(iname, sizeof(iname), name))
+	return -1;
+    while (n < slots && n < (1ul << 24))
+	n <<= 1;
+    shm_stop();
+    /* remove a stale index */
+    if ((fd = shm_open(iname, O_RDWR, 0)) != -1) {
+	if (!fstat(fd, &st) && st.st_size >= SHM_INDEX_SIZE(0) &&
+	    (idx = (shm_index_t*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+	    if (!memcmp(idx->magic, SHM_MAGIC, sizeof(idx->magic)) &&
+		st.st_size >= SHM_INDEX_SIZE(idx->slots)) {
+		if ((pid_t) idx->pid != getpid() && (!kill((pid_t) idx->pid, 0) || errno == EPERM)) {
+		    munmap(idx, st.st_size);
+		    close(fd);
+		    errno = EEXIST;
+		    return -1;
+		}
+		shm_unlink_all(idx);
+	    }
+	    munmap(idx, st.st_size);
+	}
+	close(fd);
+	shm_unlink(iname);
+    }
+    if ((fd = shm_open(iname, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1)
+	return -1;
+    if (ftruncate(fd, SHM_INDEX_SIZE(n)) ||
+	(idx = (shm_index_t*) mmap(0, SHM_INDEX_SIZE(n), PROT_READ | PROT_WRITE,
+				   MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	int e = errno;
+	close(fd);
+	shm_unlink(iname);
+	errno = e;
+	return -1;
+    }
+    close(fd);
+    idx->pid = (uint64_t) getpid();
+    idx->slots = n;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(idx->magic, SHM_MAGIC, sizeof(idx->magic));
+    pthread_mutex_lock(&shm_mutex);
+    strcpy(shm_name, iname);
+    shm_idx = idx;
+    shm_fill = 0;
+    __atomic_store_n(&shm_min, min_size ? min_size : 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shm_mutex);
+    return 0;
+}
+
+size_t shm_min_size() {
+    return __atomic_load_n(&shm_min, __ATOMIC_RELAXED);
+}
+
+shm_seg_t *shm_seg_new(size_t len, int flags) {
+    shm_seg_t *seg = (shm_seg_t*) calloc(1, sizeof(shm_seg_t));
+    shm_seg_hdr_t *hdr;
+    char sn[64];
+    int fd;
+    if (!seg)
+	return 0;
+    seg->serial = __atomic_add_fetch(&shm_serial, 1, __ATOMIC_RELAXED);
+    seg->pid = (uint64_t) getpid();
+    seg->map_len = SHM_SEG_HDR + len;
+    seg->flags = flags;
+    shm_seg_name(sn, sizeof(sn), seg->pid, seg->serial);
+    if ((fd = shm_open(sn, O_RDWR | O_CREAT | O_EXCL, 0600)) == -1) {
+	free(seg);
+	return 0;
+    }
+    if (ftruncate(fd, seg->map_len) ||
+	(seg->map = mmap(0, seg->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	shm_unlink(sn);
+	free(seg);
+	return 0;
+    }
+    close(fd);
+    hdr = (shm_seg_hdr_t*) seg->map;
+    hdr->serial = seg->serial;
+    hdr->len = len;
+    return seg;
+}
+
+void *shm_seg_data(shm_seg_t *seg) {
+    return ((char*) seg->map) + SHM_SEG_HDR;
+}
+
+size_t shm_seg_len(shm_seg_t *seg) {
+    return seg->map_len - SHM_SEG_HDR;
+}
+
+/* slot of key or NULL, *free is set to the first usable slot.
+   Must be called with shm_mutex held */
+static shm_slot_t *shm_find(const char *key, size_t kl, uint64_t hash, shm_slot_t **free) {
+    uint64_t mask = shm_idx->slots - 1, i = hash & mask, n = shm_idx->slots;
+    *free = 0;
+    while (n--) {
+	shm_slot_t *s = &shm_idx->slot[i];
+	if (!s->serial) {
+	    if (!*free)
+		*free = s;
+	    break;
+	}
+	if (s->serial == SHM_TOMB) {
+	    if (!*free)
+		*free = s;
+	} else if (s->hash == hash && s->klen == kl && !memcmp(s->key, key, kl))
+	    return s;
+	i = (i + 1) & mask;
+    }
+    return 0;
+}
+
+int shm_publish(shm_seg_t *seg, const char *key, uint64_t version) {
+    size_t kl = strlen(key);
+    uint64_t hash = shm_hash(key, kl);
+    shm_slot_t *s, *fs;
+    int res = 0;
+    if (kl >= SHM_KEY_MAX || seg->key || !(seg->key = strdup(key)))
+	return 0;
+    pthread_mutex_lock(&shm_mutex);
+    if (shm_idx && shm_idx->pid == seg->pid && seg->pid == (uint64_t) getpid()) {
+	if ((s = shm_find(key, kl, hash, &fs))) {
+	    if (s->version < version) {
+		shm_slot_write(s, seg->serial, hash, seg->map_len - SHM_SEG_HDR, version,
+			       seg->flags, 0, 0);
+		res = 1;
+	    }
+	} else if (fs && (fs->serial || (shm_fill + 1) * 4 <= shm_idx->slots * 3)) {
+	    if (!fs->serial)
+		shm_fill++;
+	    shm_slot_write(fs, seg->serial, hash, seg->map_len - SHM_SEG_HDR, version,
+			   seg->flags, key, kl);
+	    res = 1;
+	}
+    }
+    pthread_mutex_unlock(&shm_mutex);
+    return res;
+}
+
+void shm_seg_free(shm_seg_t *seg) {
+    char sn[64];
+    /* segments inherited by a forked child are only unmapped */
+    if (seg->pid != (uint64_t) getpid()) {
+	munmap(seg->map, seg->map_len);
+	free(seg->key);
+	free(seg);
+	return;
+    }
+    if (seg->key) {
+	size_t kl = strlen(seg->key);
+	shm_slot_t *s, *fs;
+	pthread_mutex_lock(&shm_mutex);
+	/* only if it was not replaced by a newer segment */
+	if (shm_idx && shm_idx->pid == seg->pid &&
+	    (s = shm_find(seg->key, kl, shm_hash(seg->key, kl), &fs)) &&
+	    s->serial == seg->serial)
+	    shm_slot_write(s, SHM_TOMB, s->hash, 0, 0, 0, 0, 0);
+	pthread_mutex_unlock(&shm_mutex);
+	free(seg->key);
+    }
+    shm_seg_name(sn, sizeof(sn), seg->pid, seg->serial);
+    shm_unlink(sn);
+    munmap(seg->map, seg->map_len);
+    free(seg);
+}
+
+/* --- reader --- */
+
+int shm_view(const char *name, const char *key, shm_view_t *v) {
+    char iname[256], sn[64];
+    size_t kl = strlen(key);
+    uint64_t hash = shm_hash(key, kl), mask, i, n;
+    shm_index_t *idx;
+    shm_slot_t c;
+    struct stat st;
+    size_t ilen;
+    int fd, attempt, res = 0;
+
+    if (shm_index_name(iname, sizeof(iname), name))
+	return -1;
+    if (kl >= SHM_KEY_MAX)
+	return 0;
+    if ((fd = shm_open(iname, O_RDONLY, 0)) == -1)
+	return -1;
+    if (fstat(fd, &st) || st.st_size < SHM_INDEX_SIZE(0) ||
+	(idx = (shm_index_t*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	errno = EINVAL;
+	return -1;
+    }
+    close(fd);
+    ilen = st.st_size;
+    if (memcmp(idx->magic, SHM_MAGIC, sizeof(idx->magic)) ||
+	ilen < SHM_INDEX_SIZE(idx->slots) || !idx->slots || (idx->slots & (idx->slots - 1))) {
+	munmap(idx, ilen);
+	errno = EINVAL;
+	return -1;
+    }
+    mask = idx->slots - 1;
+    /* the segment can be removed between the look-up and opening it
+       in which case we look again (the slot has changed by then) */
+    for (attempt = 0; attempt < 16 && !res; attempt++) {
+	int found = 0;
+	for (i = hash & mask, n = idx->slots; n; n--, i = (i + 1) & mask) {
+	    shm_slot_read(&idx->slot[i], &c);
+	    if (!c.serial)
+		break;
+	    if (c.serial != SHM_TOMB && c.hash == hash && c.klen == kl &&
+		!memcmp(c.key, key, kl)) {
+		found = 1;
+		break;
+	    }
+	}
+	if (!found)
+	    break;
+	shm_seg_name(sn, sizeof(sn), idx->pid, c.serial);
+	if ((fd = shm_open(sn, O_RDONLY, 0)) == -1) {
+	    if (errno == ENOENT)
+		continue;
+	    res = -1;
+	    break;
+	}
+	v->map_len = SHM_SEG_HDR + c.len;
+	if (fstat(fd, &st) || st.st_size < v->map_len ||
+	    (v->map = mmap(0, v->map_len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+	    close(fd);
+	    continue;
+	}
+	close(fd);
+	if (((shm_seg_hdr_t*) v->map)->serial != c.serial) {
+	    munmap(v->map, v->map_len);
+	    continue;
+	}
+	v->data = ((const char*) v->map) + SHM_SEG_HDR;
+	v->len = c.len;
+	v->version = c.version;
+	v->flags = c.flags;
+	res = 1;
+    }
+    munmap(idx, ilen);
+    return res;
+}
+
+void shm_view_release(shm_view_t *v) {
+    if (v->map) {
+	munmap(v->map, v->map_len);
+	v->map = 0;
+    }
+}
+
+/* --- R API --- */
+
+/* SFS serialisation into a segment: the first pass only computes
+   the size, the second writes the payload */
+struct store_api {
+    store_fn_t store;
+    char *buf;
+    sfs_len_t pos, cap;
+};
+
+/* only writes what fits in the segment, but counts everything */
+static void shm_put(store_api_t *api, const void *what, sfs_len_t len) {
+    if (api->buf && api->pos <= api->cap && len <= api->cap - api->pos)
+	memcpy(api->buf + api->pos, what, len);
+    api->pos += len;
+}
+
+static void shm_store(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const void *buf) {
+    sfs_len_t hdr = len;
+    hdr <<= 8;
+    hdr |= ts;
+    if (el > 1)
+	len *= el;
+    if (ts != SFS_DATA)
+	shm_put(api, &hdr, sizeof(hdr));
+    if (buf)
+	shm_put(api, buf, len);
+}
+
+shm_seg_t *shm_seg_sfs(SEXP sWhat) {
+    store_api_t api;
+    shm_seg_t *seg;
+    size_t min = shm_min_size();
+    memset(&api, 0, sizeof(api));
+    api.store = shm_store;
+    if (!min)
+	return 0;
+    sfs_store(&api, sWhat);
+    if (api.pos < min || !(seg = shm_seg_new(api.pos, SHM_SFS)))
+	return 0;
+    api.buf = (char*) shm_seg_data(seg);
+    api.cap = api.pos;
+    api.pos = 0;
+    sfs_store(&api, sWhat);
+    /* the passes may differ (see buf_store()) */
+    if (api.pos != api.cap) {
+	shm_seg_free(seg);
+	return 0;
+    }
+    return seg;
+}
+
+SEXP C_shm(SEXP sName, SEXP sSlots, SEXP sMin) {
+    double slots = asReal(sSlots), min = asReal(sMin);
+    if (sName == R_NilValue) {
+	shm_stop();
+	return ScalarLogical(1);
+    }
+    if (TYPEOF(sName) != STRSXP || LENGTH(sName) != 1)
+	Rf_error("Invalid name, must be a string or NULL");
+    if (ISNAN(slots) || slots < 1 || ISNAN(min) || min < 0)
+	Rf_error("Invalid parameters");
+    obj_init();
+    if (shm_start(CHAR(STRING_ELT(sName, 0)), (unsigned long) slots, (size_t) min))
+	Rf_error("Unable to create shared index '%s': %s", CHAR(STRING_ELT(sName, 0)),
+		 (errno == EEXIST) ? "used by another process" : strerror(errno));
+    return ScalarLogical(1);
+}
+
+struct fetch_api {
+    fetch_fn_t  fetch;
+    const char *fbuf;
+    sfs_len_t   flen;
+};
+
+static void shm_fetch(fetch_api_t *api, void *buf, sfs_len_t len) {
+    if (api->flen < len)
+	Rf_error("Read error: need %lu, got %lu\n", len, api->flen);
+    memcpy(buf, api->fbuf, len);
+    api->fbuf += len;
+    api->flen -= len;
+}
+
+static SEXP shm_load(void *arg) {
+    shm_view_t *v = (shm_view_t*) arg;
+    fetch_api_t api;
+    api.fetch = shm_fetch;
+    api.fbuf = (const char*) v->data;
+    api.flen = v->len;
+    return sfs_load(&api);
+}
+
+static void shm_load_done(void *arg) {
+    shm_view_release((shm_view_t*) arg);
+}
+
+static void shm_view_free(void *arg) {
+    shm_view_release((shm_view_t*) arg);
+    free(arg);
+}
+
+SEXP C_map(SEXP sKey, SEXP sName) {
+    shm_view_t *v;
+    int res;
+    if (TYPEOF(sKey) != STRSXP || LENGTH(sKey) != 1)
+	Rf_error("Invalid key, must be a string");
+    if (TYPEOF(sName) != STRSXP || LENGTH(sName) != 1)
+	Rf_error("Invalid name, must be a string");
+    if (!(v = (shm_view_t*) calloc(1, sizeof(shm_view_t))))
+	Rf_error("Out of memory");
+    res = shm_view(CHAR(STRING_ELT(sName, 0)), CHAR(STRING_ELT(sKey, 0)), v);
+    if (res < 1) {
+	free(v);
+	if (res < 0)
+	    Rf_error("Unable to access shared index '%s': %s", CHAR(STRING_ELT(sName, 0)),
+		     strerror(errno));
+	return R_NilValue;
+    }
+    if (v->flags & SHM_SFS) {
+	shm_view_t lv = *v;
+	free(v);
+	return R_ExecWithCleanup(shm_load, &lv, shm_load_done, &lv);
+    }
+    /* the vector keeps the map until it is collected */
+    return altraw_new(v->data, (R_xlen_t) v->len, shm_view_free, v);
+}
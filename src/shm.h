@@ -0,0 +1,79 @@
+/* shared memory publishing of payloads for processes on the same host
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+   The owner (the process running the store) puts payloads into POSIX
+   shared memory segments (one per payload) and publishes them in a
+   shared index under their key. Other processes look up the key in
+   the index and map the segment read-only, so they can use the
+   payload without any copies.
+
+   Segments are unlinked by the owner once their entry is released,
+   but a segment is only freed by the system once no process maps it
+   anymore, so readers can keep using their maps as long as they like.
+*/
+
+#ifndef OSRV_SHM_H_
+#define OSRV_SHM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct shm_seg_s shm_seg_t;
+
+/* segment flags */
+#define SHM_SFS 0x01 /* payload is SFS-serialised */
+
+/* --- owner side --- */
+
+/* creates the index (with slots entries, rounded up to a power of 2)
+   and starts publishing payloads of at least min_size bytes. A stale
+   index of the same name (whose owner is gone) is removed together
+   with its segments. Returns 0 on success, otherwise -1 and errno is
+   set (EEXIST if another process owns the index). */
+int shm_start(const char *name, unsigned long slots, size_t min_size);
+/* stops publishing and removes the index and all published names */
+void shm_stop();
+
+/* minimal size of published payloads, 0 = publishing is off */
+size_t shm_min_size();
+
+/* creates a segment with space for len bytes, NULL on error */
+shm_seg_t *shm_seg_new(size_t len, int flags);
+void *shm_seg_data(shm_seg_t *seg);
+/* size of the data of the segment */
+size_t shm_seg_len(shm_seg_t *seg);
+/* makes the segment visible under key, replacing the segment of an
+   older version. Returns 0 if the index is full or publishing is off.
+   Calls for the same key must be serialised by the caller. */
+int shm_publish(shm_seg_t *seg, const char *key, uint64_t version);
+/* removes the segment from the index (unless it has been replaced),
+   unlinks and unmaps it */
+void shm_seg_free(shm_seg_t *seg);
+
+/* --- reader side --- */
+
+typedef struct shm_view_s {
+    const void *data;
+    size_t len;
+    uint64_t version;
+    int flags;
+    void *map;      /* for shm_view_release() */
+    size_t map_len;
+} shm_view_t;
+
+/* maps the payload of key published in the index name. Returns 1 on
+   success, 0 if not found and -1 on error (errno is set). */
+int shm_view(const char *name, const char *key, shm_view_t *v);
+void shm_view_release(shm_view_t *v);
+
+/* --- R --- */
+
+#include <Rinternals.h>
+
+/* SFS-serialises sWhat into a new segment, NULL if publishing is off,
+   the result is smaller than the minimal size or on error */
+shm_seg_t *shm_seg_sfs(SEXP sWhat);
+
+#endif
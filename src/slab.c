@@ -0,0 +1,355 @@
+/* size-class slab allocator for small blocks
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+   Size classes are 16 bytes apart up to 128 and then four classes
+   per power of two up to SLAB_MAX. Free blocks are kept in singly
+   linked lists (the link is stored in the block itself): one global
+   list per class guarded by a mutex and a per-thread cache which
+   is refilled from (and flushed to) the global list in batches.
+
+   Large blocks are anonymous maps with a header holding the size
+   and links to the list of all maps (needed for statistics).
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+#define SLAB_CLASSES   24
+#define SLAB_CHUNK     (64*1024)
+/* blocks moved between the thread cache and the global list at once */
+#define SLAB_BATCH     32
+
+typedef struct slab_block_s {
+    struct slab_block_s *next;
+} slab_block_t;
+
+typedef struct slab_class_s {
+    pthread_mutex_t mutex;
+    slab_block_t *free;
+    char *chunk;        /* current chunk being carved */
+    size_t chunk_left;
+} slab_class_t;
+
+typedef struct slab_cache_s {
+    slab_block_t *free;
+    int n;
+} slab_cache_t;
+
+static slab_class_t slab_class[SLAB_CLASSES];
+static size_t slab_size[SLAB_CLASSES];
+static size_t slab_reserved_;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static __thread slab_cache_t *slab_tc;
+
+/* returns the blocks to the global lists when a thread exits */
+static void slab_thread_exit(void *arg) {
+    slab_cache_t *tc = (slab_cache_t*) arg;
+    int i;
+    for (i = 0; i < SLAB_CLASSES; i++)
+	if (tc[i].free) {
+	    slab_block_t *last = tc[i].free;
+	    while (last->next)
+		last = last->next;
+	    pthread_mutex_lock(&slab_class[i].mutex);
+	    last->next = slab_class[i].free;
+	    slab_class[i].free = tc[i].free;
+	    pthread_mutex_unlock(&slab_class[i].mutex);
+	}
+    free(tc);
+    /* a later call in this thread will create a new cache */
+    slab_tc = 0;
+}
+
+static void slab_init() {
+    int i;
+    size_t sz = 16, step = 16;
+    for (i = 0; i < SLAB_CLASSES; i++) {
+	pthread_mutex_init(&slab_class[i].mutex, 0);
+	slab_size[i] = sz;
+	if (sz >= 128 && !(sz & (sz - 1))) /* power of 2: 4 classes until the next */
+	    step = sz / 4;
+	sz += step;
+    }
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+static int slab_class_of(size_t size) {
+    int i;
+    if (size <= 128)
+	return (size <= 16) ? 0 : (int) ((size - 1) / 16);
+    /* 4 classes per power of 2 above 128 */
+    i = 7;
+    while (slab_size[i] < size)
+	i++;
+    return i;
+}
+
+static slab_cache_t *slab_cache() {
+    if (!slab_tc) {
+	slab_tc = (slab_cache_t*) calloc(SLAB_CLASSES, sizeof(slab_cache_t));
+	if (slab_tc)
+	    pthread_setspecific(slab_key, slab_tc);
+    }
+    return slab_tc;
+}
+
+/* moves up to SLAB_BATCH blocks from the global list to the cache */
+static void slab_refill(slab_cache_t *tc, int cl) {
+    slab_class_t *c = &slab_class[cl];
+    size_t bs = slab_size[cl];
+    int n = 0;
+    pthread_mutex_lock(&c->mutex);
+    while (n < SLAB_BATCH) {
+	slab_block_t *b = c->free;
+	if (b)
+	    c->free = b->next;
+	else {
+	    if (c->chunk_left < bs) {
+		if (!(c->chunk = (char*) malloc(SLAB_CHUNK)))
+		    break;
+		c->chunk_left = SLAB_CHUNK;
+		__atomic_add_fetch(&slab_reserved_, SLAB_CHUNK, __ATOMIC_RELAXED);
+	    }
+	    b = (slab_block_t*) c->chunk;
+	    c->chunk += bs;
+	    c->chunk_left -= bs;
+	}
+	b->next = tc->free;
+	tc->free = b;
+	n++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    tc->n += n;
+}
+
+void *slab_alloc(size_t size) {
+    slab_cache_t *tc;
+    slab_block_t *b;
+    int cl;
+    if (size > SLAB_MAX)
+	return malloc(size);
+    pthread_once(&slab_once, slab_init);
+    if (!(tc = slab_cache()))
+	return 0;
+    cl = slab_class_of(size);
+    if (!tc[cl].free)
+	slab_refill(&tc[cl], cl);
+    if (!(b = tc[cl].free))
+	return 0;
+    tc[cl].free = b->next;
+    tc[cl].n--;
+    return b;
+}
+
+void slab_free(void *ptr, size_t size) {
+    slab_cache_t *tc;
+    slab_block_t *b = (slab_block_t*) ptr;
+    int cl;
+    if (!ptr)
+	return;
+    if (size > SLAB_MAX) {
+	free(ptr);
+	return;
+    }
+    cl = slab_class_of(size);
+    if (!(tc = slab_cache())) { /* no cache, go directly to the global list */
+	pthread_mutex_lock(&slab_class[cl].mutex);
+	b->next = slab_class[cl].free;
+	slab_class[cl].free = b;
+	pthread_mutex_unlock(&slab_class[cl].mutex);
+	return;
+    }
+    b->next = tc[cl].free;
+    tc[cl].free = b;
+    /* keep the caches small, so blocks freed by one thread
+       (e.g. in reclamation) can be used by others */
+    if (++tc[cl].n > 2 * SLAB_BATCH) {
+	slab_block_t *head = tc[cl].free, *last = head;
+	int n = 1;
+	while (n < SLAB_BATCH) {
+	    last = last->next;
+	    n++;
+	}
+	tc[cl].free = last->next;
+	tc[cl].n -= SLAB_BATCH;
+	pthread_mutex_lock(&slab_class[cl].mutex);
+	last->next = slab_class[cl].free;
+	slab_class[cl].free = head;
+	pthread_mutex_unlock(&slab_class[cl].mutex);
+    }
+}
+
+size_t slab_reserved() {
+    return __atomic_load_n(&slab_reserved_, __ATOMIC_RELAXED);
+}
+
+/* --- large blocks --- */
+
+/* header at the start of each map, keeps the payload 64-byte aligned */
+typedef struct big_hdr_s {
+    struct big_hdr_s *prev, *next;
+    size_t size;   /* size of the map */
+    size_t page;   /* its page size (huge pages with MAP_HUGETLB) */
+    char pad[64 - 2 * sizeof(void*) - 2 * sizeof(size_t)];
+} big_hdr_t;
+
+/* number of freed maps kept for re-use */
+#define BIG_CACHE 4
+#define HUGE_PAGE (2*1024*1024)
+
+static pthread_mutex_t big_mutex = PTHREAD_MUTEX_INITIALIZER;
+static big_hdr_t *big_live, *big_cache[BIG_CACHE];
+static size_t big_mapped;
+static int big_huge_ = BIG_HUGE_NONE;
+
+void big_config(int huge) {
+    big_huge_ = huge;
+}
+
+int big_huge() {
+    return big_huge_;
+}
+
+/* sets *page to the page size of the map */
+static void *big_map(size_t size, int flags, size_t *page) {
+    void *m = MAP_FAILED;
+    int mf = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+    if (flags & BIG_POPULATE)
+	mf |= MAP_POPULATE;
+#endif
+#ifdef MAP_HUGETLB
+    if (big_huge_ == BIG_HUGE_HUGETLB)
+	m = mmap(0, size, PROT_READ | PROT_WRITE, mf | MAP_HUGETLB, -1, 0);
+#endif
+    *page = HUGE_PAGE;
+    if (m == MAP_FAILED) {
+	*page = (size_t) sysconf(_SC_PAGESIZE);
+	/* without MAP_POPULATE we want the huge pages before the first touch */
+#ifdef MAP_POPULATE
+	if (big_huge_ != BIG_HUGE_NONE)
+	    mf &= ~MAP_POPULATE;
+#endif
+	m = mmap(0, size, PROT_READ | PROT_WRITE, mf, -1, 0);
+	if (m == MAP_FAILED)
+	    return 0;
+#ifdef MADV_HUGEPAGE
+	if (big_huge_ != BIG_HUGE_NONE)
+	    madvise(m, size, MADV_HUGEPAGE);
+#endif
+#if defined MADV_POPULATE_WRITE && defined MAP_POPULATE
+	if (big_huge_ != BIG_HUGE_NONE && (flags & BIG_POPULATE))
+	    madvise(m, size, MADV_POPULATE_WRITE);
+#endif
+    }
+    return m;
+}
+
+void *big_alloc(size_t size, int flags) {
+    size_t ps = (big_huge_ != BIG_HUGE_NONE) ? HUGE_PAGE : (size_t) sysconf(_SC_PAGESIZE);
+    big_hdr_t *h = 0;
+    int i;
+    /* round to whole pages */
+    size = (size + sizeof(big_hdr_t) + ps - 1) & ~(ps - 1);
+    pthread_mutex_lock(&big_mutex);
+    /* re-use a cached map if it's not too big */
+    for (i = 0; i < BIG_CACHE; i++)
+	if (big_cache[i] && big_cache[i]->size >= size && big_cache[i]->size / 2 < size) {
+	    h = big_cache[i];
+	    big_cache[i] = 0;
+	    break;
+	}
+    pthread_mutex_unlock(&big_mutex);
+    if (h) {
+#ifdef MADV_POPULATE_WRITE
+	if (flags & BIG_POPULATE)
+	    madvise(h, h->size, MADV_POPULATE_WRITE);
+#endif
+    } else {
+	size_t page;
+	if (!(h = (big_hdr_t*) big_map(size, flags, &page)))
+	    return 0;
+	h->size = size;
+	h->page = page;
+	__atomic_add_fetch(&big_mapped, size, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_lock(&big_mutex);
+    h->prev = 0;
+    if ((h->next = big_live))
+	big_live->prev = h;
+    big_live = h;
+    pthread_mutex_unlock(&big_mutex);
+    return h + 1;
+}
+
+void big_free(void *ptr) {
+    big_hdr_t *h = ((big_hdr_t*) ptr) - 1;
+    int i = 0;
+    if (!ptr)
+	return;
+    pthread_mutex_lock(&big_mutex);
+    if (h->prev)
+	h->prev->next = h->next;
+    else
+	big_live = h->next;
+    if (h->next)
+	h->next->prev = h->prev;
+    while (i < BIG_CACHE && big_cache[i])
+	i++;
+    pthread_mutex_unlock(&big_mutex);
+    if (i < BIG_CACHE) {
+	/* keep the address space, but give the memory back (except
+	   for the page holding the header). This has to happen before
+	   the map is in the cache, once it is there big_alloc() may
+	   hand it out */
+	if (h->size > h->page)
+	    madvise(((char*) h) + h->page, h->size - h->page, MADV_DONTNEED);
+	pthread_mutex_lock(&big_mutex);
+	for (i = 0; i < BIG_CACHE; i++)
+	    if (!big_cache[i]) {
+		big_cache[i] = h;
+		break;
+	    }
+	pthread_mutex_unlock(&big_mutex);
+    }
+    if (i == BIG_CACHE) {
+	__atomic_sub_fetch(&big_mapped, h->size, __ATOMIC_RELAXED);
+	munmap(h, h->size);
+    }
+}
+
+static size_t big_resident(big_hdr_t *h) {
+    size_t ps = (size_t) sysconf(_SC_PAGESIZE), n = h->size / ps, i, res = 0;
+    unsigned char *vec = (unsigned char*) malloc(n);
+    if (!vec)
+	return 0;
+    if (!mincore(h, h->size, vec))
+	for (i = 0; i < n; i++)
+	    if (vec[i] & 1)
+		res += ps;
+    free(vec);
+    return res;
+}
+
+void big_stat(size_t *mapped, size_t *resident) {
+    big_hdr_t *h;
+    size_t res = 0;
+    int i;
+    pthread_mutex_lock(&big_mutex);
+    for (h = big_live; h; h = h->next)
+	res += big_resident(h);
+    for (i = 0; i < BIG_CACHE; i++)
+	if (big_cache[i])
+	    res += big_resident(big_cache[i]);
+    pthread_mutex_unlock(&big_mutex);
+    *mapped = __atomic_load_n(&big_mapped, __ATOMIC_RELAXED);
+    *resident = res;
+}
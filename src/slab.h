@@ -0,0 +1,52 @@
+/* size-class slab allocator for small blocks and map-based
+   allocator for large blocks
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+   Blocks up to SLAB_MAX bytes are carved from large chunks which
+   are never returned to the system. Each thread keeps a small cache
+   of free blocks per size class so most allocations don't touch
+   any locks. Larger blocks are passed on to malloc()/free().
+
+   The caller must pass the same size to slab_free() that was used
+   in slab_alloc(). Blocks can be freed by any thread.
+*/
+
+#ifndef SLAB_H__
+#define SLAB_H__
+
+#include <stddef.h>
+
+/* largest size served from slabs */
+#define SLAB_MAX 2048
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+
+/* bytes allocated from the system for slabs */
+size_t slab_reserved();
+
+/* Large blocks are mapped directly (with a small header), so they
+   don't fragment the heap and are returned to the system once freed.
+   Recently freed maps are kept for re-use, but their pages are
+   released with MADV_DONTNEED. */
+
+/* big_alloc() flags */
+#define BIG_POPULATE 0x01 /* pre-fault all pages (the block will be written) */
+
+/* huge page modes for big_config() */
+#define BIG_HUGE_NONE    0
+#define BIG_HUGE_THP     1 /* advise transparent huge pages */
+#define BIG_HUGE_HUGETLB 2 /* MAP_HUGETLB, falls back to THP if not available */
+
+void *big_alloc(size_t size, int flags);
+void big_free(void *ptr);
+void big_config(int huge);
+int big_huge();
+
+/* mapped: bytes of address space mapped for large blocks,
+   resident: bytes thereof actually backed by memory */
+void big_stat(size_t *mapped, size_t *resident);
+
+#endif
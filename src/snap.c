@@ -0,0 +1,326 @@
+/* Snapshots of the object store: the whole store is written into
+   one indexed file which can be restored by mapping it.
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+SEXP C_snapshot(SEXP sPath);
+SEXP C_restore(SEXP sPath);
+
+   File layout (native byte order):
+   - header (snap_hdr_t)
+   - payloads, each aligned to SNAP_ALIGN bytes
+   - index: one snap_rec_t per entry followed by the key
+     (0-terminated and padded to 8 bytes)
+
+   Payloads are written as-is, entries that only hold an R object
+   are serialised with SFS (so they have to be retrieved with
+   sfs=TRUE once restored). The index is at the end since the
+   size of serialised objects is only known after writing them.
+   The file is written under a temporary name and renamed once
+   complete, so an existing snapshot (which may be mapped) is
+   never modified.
+
+   Restore maps the file and registers the entries pointing into
+   the map, so no payloads are read until they are used. Namespaces
+   of the entries are re-created as needed (with no budget).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "obj.h"
+#include "sfs.h"
+
+#define SNAP_MAGIC "OSRVSNP1"
+#define SNAP_ORDER 0x01020304
+#define SNAP_ALIGN 16
+
+typedef struct snap_hdr_s {
+    char magic[8];
+    uint32_t order, res;
+    uint64_t n, index, index_len;
+} snap_hdr_t;
+
+typedef struct snap_rec_s {
+    uint64_t off, len;
+    uint32_t klen, flags;
+} snap_rec_t;
+
+/* snap_rec_t.flags */
+#define SNAP_SFS    0x01 /* payload is SFS-serialised */
+#define SNAP_PINNED 0x02
+#define SNAP_NS     0x04 /* key is <ns>/<key> of a namespace */
+
+#define SNAP_REC_SIZE(kl) (sizeof(snap_rec_t) + ((((size_t) (kl)) + 8) & ~((size_t) 7)))
+
+/* entry waiting to be serialised */
+typedef struct snap_sfs_s {
+    size_t rec; /* offset of the record in the index */
+    SEXP sWhat;
+} snap_sfs_t;
+
+typedef struct snap_s {
+    int fd, done;
+    const char *path;
+    char *tmp;
+    uint64_t off, n; /* write position, number of entries */
+    char *idx;
+    size_t ilen, icap;
+    snap_sfs_t *sfs;
+    size_t nsfs, csfs;
+} snap_t;
+
+static int snap_write(snap_t *s, const void *buf, uint64_t len) {
+    const char *c = (const char*) buf;
+    while (len) {
+	ssize_t n = write(s->fd, c, (len > (1024*1024*128)) ? (1024*1024*128) : len);
+	if (n < 1) {
+	    if (n == -1 && errno == EINTR)
+		continue;
+	    return -1;
+	}
+	c += n;
+	len -= n;
+	s->off += n;
+    }
+    return 0;
+}
+
+static int snap_pad(snap_t *s) {
+    static const char zero[SNAP_ALIGN];
+    return (s->off % SNAP_ALIGN) ? snap_write(s, zero, SNAP_ALIGN - (s->off % SNAP_ALIGN)) : 0;
+}
+
+/* appends an index record, returns its offset or -1 if out of memory */
+static long snap_rec(snap_t *s, const char *key, uint64_t off, uint64_t len, int flags) {
+    size_t kl = strlen(key), rs = SNAP_REC_SIZE(kl);
+    snap_rec_t *r;
+    long pos;
+    if (s->ilen + rs > s->icap) {
+	size_t nc = s->icap ? s->icap * 2 : (1024*1024);
+	char *ni;
+	while (nc < s->ilen + rs)
+	    nc *= 2;
+	if (!(ni = (char*) realloc(s->idx, nc)))
+	    return -1;
+	s->idx = ni;
+	s->icap = nc;
+    }
+    pos = (long) s->ilen;
+    memset(s->idx + pos, 0, rs);
+    r = (snap_rec_t*) (s->idx + pos);
+    r->off = off;
+    r->len = len;
+    r->klen = (uint32_t) kl;
+    r->flags = flags;
+    memcpy(s->idx + pos + sizeof(snap_rec_t), key, kl);
+    s->ilen += rs;
+    s->n++;
+    return pos;
+}
+
+/* called inside a read section, so no R API here. R objects of the
+   entries stay valid until obj_gc() which we don't call meanwhile */
+static int snap_entry(const char *key, obj_entry_t *e, int iflags, void *arg) {
+    snap_t *s = (snap_t*) arg;
+    int flags = ((iflags & OBJ_ITER_PINNED) ? SNAP_PINNED : 0) |
+	((iflags & OBJ_ITER_NS) ? SNAP_NS : 0);
+    long pos;
+    if (e->sWhat && !e->obj) {
+	if (s->nsfs == s->csfs) {
+	    size_t nc = s->csfs ? s->csfs * 2 : 256;
+	    snap_sfs_t *ns = (snap_sfs_t*) realloc(s->sfs, nc * sizeof(snap_sfs_t));
+	    if (!ns)
+		return -1;
+	    s->sfs = ns;
+	    s->csfs = nc;
+	}
+	if ((pos = snap_rec(s, key, 0, 0, flags | SNAP_SFS)) < 0)
+	    return -1;
+	s->sfs[s->nsfs].rec = (size_t) pos;
+	s->sfs[s->nsfs++].sWhat = e->sWhat;
+	return 0;
+    }
+    if (snap_pad(s) || snap_rec(s, key, s->off, e->len, flags) < 0)
+	return -1;
+    obj_will_read(e, 0, e->len);
+    return snap_write(s, e->obj, e->len);
+}
+
+struct store_api {
+    store_fn_t store;
+    snap_t *s;
+};
+
+static void snap_store(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const void *buf) {
+    sfs_len_t hdr = len;
+    hdr <<= 8;
+    hdr |= ts;
+    if (el > 1)
+	len *= el;
+    if ((ts != SFS_DATA && snap_write(api->s, &hdr, sizeof(hdr))) ||
+	(buf && snap_write(api->s, buf, len)))
+	Rf_error("Failed to write snapshot: %s", strerror(errno));
+}
+
+static SEXP snapshot_(void *arg) {
+    snap_t *s = (snap_t*) arg;
+    snap_hdr_t hdr;
+    store_api_t api;
+    size_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    /* the header is written last, so an incomplete file is invalid */
+    if (snap_write(s, &hdr, sizeof(hdr)) || snap_pad(s))
+	Rf_error("Failed to write snapshot: %s", strerror(errno));
+    errno = 0;
+    if (obj_foreach(snap_entry, s))
+	Rf_error("Failed to write snapshot: %s", errno ? strerror(errno) : "out of memory");
+    api.store = snap_store;
+    api.s = s;
+    for (i = 0; i < s->nsfs; i++) {
+	snap_rec_t *r;
+	uint64_t off;
+	if (snap_pad(s))
+	    Rf_error("Failed to write snapshot: %s", strerror(errno));
+	off = s->off;
+	sfs_store(&api, s->sfs[i].sWhat);
+	r = (snap_rec_t*) (s->idx + s->sfs[i].rec);
+	r->off = off;
+	r->len = s->off - off;
+    }
+    if (snap_pad(s))
+	Rf_error("Failed to write snapshot: %s", strerror(errno));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.order = SNAP_ORDER;
+    hdr.n = s->n;
+    hdr.index = s->off;
+    hdr.index_len = s->ilen;
+    if (snap_write(s, s->idx, s->ilen) ||
+	pwrite(s->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	fsync(s->fd))
+	Rf_error("Failed to write snapshot: %s", strerror(errno));
+    close(s->fd);
+    s->fd = -1;
+    if (rename(s->tmp, s->path))
+	Rf_error("Unable to rename snapshot to '%s': %s", s->path, strerror(errno));
+    s->done = 1;
+    return ScalarReal((double) s->n);
+}
+
+static void snapshot_done(void *arg) {
+    snap_t *s = (snap_t*) arg;
+    if (s->fd != -1)
+	close(s->fd);
+    if (!s->done)
+	unlink(s->tmp);
+    free(s->tmp);
+    free(s->idx);
+    free(s->sfs);
+}
+
+SEXP C_snapshot(SEXP sPath) {
+    snap_t s;
+    if (TYPEOF(sPath) != STRSXP || LENGTH(sPath) != 1)
+	Rf_error("path must be a string");
+    obj_init();
+    obj_gc();
+    memset(&s, 0, sizeof(s));
+    s.path = CHAR(STRING_ELT(sPath, 0));
+    if (!(s.tmp = (char*) malloc(strlen(s.path) + 32)))
+	Rf_error("Out of memory");
+    snprintf(s.tmp, strlen(s.path) + 32, "%s.%ld.tmp", s.path, (long) getpid());
+    s.fd = open(s.tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (s.fd == -1) {
+	free(s.tmp);
+	Rf_error("Unable to create '%s': %s", s.path, strerror(errno));
+    }
+    return R_ExecWithCleanup(snapshot_, &s, snapshot_done, &s);
+}
+
+SEXP C_restore(SEXP sPath) {
+    const char *fn, *err = 0;
+    struct stat st;
+    snap_hdr_t *hdr;
+    obj_map_t *map;
+    char *m, *p, *end;
+    uint64_t i, n = 0;
+    int fd;
+
+    if (TYPEOF(sPath) != STRSXP || LENGTH(sPath) != 1)
+	Rf_error("path must be a string");
+    fn = CHAR(STRING_ELT(sPath, 0));
+    obj_init();
+    obj_gc();
+    fd = open(fn, O_RDONLY);
+    if (fd == -1)
+	Rf_error("Unable to open '%s': %s", fn, strerror(errno));
+    if (fstat(fd, &st) || st.st_size < sizeof(snap_hdr_t)) {
+	close(fd);
+	Rf_error("'%s' is not a valid snapshot", fn);
+    }
+    m = (char*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+	Rf_error("Unable to map '%s': %s", fn, strerror(errno));
+    hdr = (snap_hdr_t*) m;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) || hdr->order != SNAP_ORDER ||
+	hdr->index > st.st_size || hdr->index_len > st.st_size - hdr->index) {
+	munmap(m, st.st_size);
+	Rf_error("'%s' is not a valid snapshot", fn);
+    }
+    if (!(map = obj_map_new(m, st.st_size))) {
+	munmap(m, st.st_size);
+	Rf_error("Out of memory");
+    }
+    p = m + hdr->index;
+    end = p + hdr->index_len;
+    for (i = 0; i < hdr->n; i++) {
+	snap_rec_t *r = (snap_rec_t*) p;
+	const char *key = p + sizeof(snap_rec_t);
+	/* the key (and its terminator) must be inside the index
+	   before we look at it */
+	if (end - p < sizeof(snap_rec_t) ||
+	    r->klen >= (size_t) (end - p) - sizeof(snap_rec_t) ||
+	    end - p < SNAP_REC_SIZE(r->klen) || key[r->klen] ||
+	    r->len > hdr->index || r->off > hdr->index - r->len) {
+	    err = "corrupted index";
+	    break;
+	}
+	if (r->flags & SNAP_NS) {
+	    const char *c = strchr(key, '/');
+	    char ns[256];
+	    if (!c || c == key || c - key >= sizeof(ns)) {
+		err = "corrupted index";
+		break;
+	    }
+	    memcpy(ns, key, c - key);
+	    ns[c - key] = 0;
+	    if (obj_ns_create(ns) < 0) {
+		err = "out of memory";
+		break;
+	    }
+	}
+	if (!obj_put_map(key, m + r->off, r->len, map, 0)) {
+	    err = "out of memory";
+	    break;
+	}
+	if (r->flags & SNAP_PINNED)
+	    obj_pin(key, 1);
+	n++;
+	p += SNAP_REC_SIZE(r->klen);
+    }
+    /* the entries hold the map from now on */
+    obj_map_release(map);
+    if (err)
+	Rf_error("Restoring '%s' failed after %lu entries: %s", fn, (unsigned long) n, err);
+    return ScalarReal((double) n);
+}
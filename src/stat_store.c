@@ -17,12 +17,19 @@ struct store_api {
     store_fn_t store;
     sfs_len_t cs[256];
     sfs_len_t ls[256];
+    sfs_ts last;
 };
 
 static void add(store_api_t *api, sfs_ts ts, sfs_len_t el, sfs_len_t len, const void *buf) {
     len *= el;
+    /* content stored in chunks counts towards its object */
+    if (ts == SFS_DATA) {
+	api->ls[api->last] += len;
+	return;
+    }
     api->cs[ts]++;
     api->ls[ts] += len;
+    api->last = ts;
 }
 
 SEXP C_stat_store(SEXP sWhat, SEXP sVerb) {
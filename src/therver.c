@@ -30,6 +30,8 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <pthread.h>
 
 #define FETCH_SIZE (512*1024)
@@ -48,6 +50,7 @@ typedef struct qentry_s {
 
 struct therver_s {
     volatile int active;
+    volatile int draining, accepting; /* see therver_drain() */
     int ss;
 
     process_fn_t process;
@@ -56,6 +59,7 @@ struct therver_s {
     pthread_t accept_thread;
 
     qentry_t root;
+    qentry_t busy; /* connections being processed */
     pthread_mutex_t pool_mutex;
     pthread_cond_t pool_work_cond;
 
@@ -90,7 +94,11 @@ static void *worker_thread(void *arg) {
 	/* remove us from the queue */
 	t->root.next = me->next;
 	if (me->next) me->next->prev = &t->root;
-	/* we don't care to update our prev/next since we never use it */
+	/* and add us to the busy list so fork() can find us */
+	me->next = t->busy.next;
+	me->prev = &t->busy;
+	t->busy.next->prev = me;
+	t->busy.next = me;
 
 	/* release queue lock */
 	pthread_mutex_unlock(&t->pool_mutex);
@@ -101,6 +109,11 @@ static void *worker_thread(void *arg) {
 	t->process(&me->c);
 	data = me->c.data;
 
+	pthread_mutex_lock(&t->pool_mutex);
+	me->prev->next = me->next;
+	me->next->prev = me->prev;
+	pthread_mutex_unlock(&t->pool_mutex);
+
 	/* clean up */
 	if (me->c.s != -1)
 	    close(me->c.s);
@@ -177,6 +190,15 @@ static void forked_child() {
 	    me->c.s = -1;
 	    me = me->next;
 	}
+	/* and those being served, otherwise the connections would
+	   stay open as long as the child lives */
+	me = t->busy.next;
+	while (me && me != &t->busy) {
+	    if (me->c.s != -1)
+		closesocket(me->c.s);
+	    me->c.s = -1;
+	    me = me->next;
+	}
 	pthread_mutex_unlock(&t->pool_mutex);
 	t = t->next;
     }
@@ -188,13 +210,25 @@ static void *accept_thread_run(void *th) {
     int s;
     socklen_t cli_al;
     struct sockaddr_in sin_cli;
+    struct pollfd pfd;
     /* printf("accept_thread %p is a go\n", (void*)&s); */
-    while (t->active) {
+    pfd.fd = t->ss;
+    pfd.events = POLLIN;
+    /* the socket can be shared with other processes which may take
+       the connection between poll() and accept() */
+    fcntl(t->ss, F_SETFL, fcntl(t->ss, F_GETFL) | O_NONBLOCK);
+    while (t->active && !t->draining) {
+	/* wake up regularly so a shutdown is noticed, and leave
+	   pending connections to others (e.g., a newer process) */
+	if (poll(&pfd, 1, 100) < 1 || !t->active || t->draining)
+	    continue;
 	cli_al = sizeof(sin_cli);
 	s = accept(t->ss, (struct sockaddr*) &sin_cli, &cli_al);
 	/* printf("accept_thread: accept=%d\n", s); */
 	if (s != -1) {
 	    qentry_t *me = (qentry_t*) calloc(1, sizeof(qentry_t));
+	    /* some systems inherit the flag from the server socket */
+	    fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
 	    if (me) {
 		/* once enqueued the task takes ownership of me.
 		   On any kind of error we have to free it. */
@@ -212,6 +246,7 @@ static void *accept_thread_run(void *th) {
     }
     close(t->ss);
     t->ss = -1;
+    t->accepting = 0;
     return 0;
 }
 
@@ -225,6 +260,8 @@ static int start_threads(therver_t *t, int max_threads) {
 
     t->root.next = t->root.prev = &t->root;
     t->root.c.s = -1;
+    t->busy.next = t->busy.prev = &t->busy;
+    t->busy.c.s = -1;
 
     if (!(t->worker_threads = malloc(sizeof(pthread_t) * max_threads)))
 	return -1;
@@ -258,15 +295,11 @@ static int start_threads(therver_t *t, int max_threads) {
     return 0;
 }
 
-therver_t *therver(const char *host, int port, int max_threads, process_fn_t process_fn) {
-    therver_t *t;
+int therver_listen(const char *host, int port) {
     int i, ss;
     struct sockaddr_in sin;
     struct hostent *haddr;
 
-    if (!(t = (therver_t*) calloc(1, sizeof(therver_t))))
-	return 0;
-
     ss = socket(AF_INET, SOCK_STREAM, 0);
 
     i = 1;
@@ -279,8 +312,8 @@ therver_t *therver(const char *host, int port, int max_threads, process_fn_t pro
             if (!(haddr = gethostbyname(host))) { /* DNS failed, */
                 closesocket(ss);
                 ss = -1;
-            }
-            sin.sin_addr.s_addr = *((uint32_t*) haddr->h_addr); /* pick first address */
+            } else
+		sin.sin_addr.s_addr = *((uint32_t*) haddr->h_addr); /* pick first address */
         }
     } else
         sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -289,14 +322,27 @@ therver_t *therver(const char *host, int port, int max_threads, process_fn_t pro
         closesocket(ss);
 	ss = -1;
     }
-    if (ss == -1) {
+    if (ss == -1)
         perror("ERROR: failed to bind or listen");
-	free(t);
-        return 0;
+    return ss;
+}
+
+therver_t *therver(const char *host, int port, int max_threads, process_fn_t process_fn) {
+    int ss = therver_listen(host, port);
+    return (ss == -1) ? 0 : therver_socket(ss, max_threads, process_fn);
+}
+
+therver_t *therver_socket(int ss, int max_threads, process_fn_t process_fn) {
+    therver_t *t;
+
+    if (!(t = (therver_t*) calloc(1, sizeof(therver_t)))) {
+	close(ss);
+	return 0;
     }
 
     t->ss = ss;
     t->active = 1;
+    t->accepting = 1;
     t->process = process_fn;
 
     /* record this one in the list of thervers for fork() handling */
@@ -331,3 +377,34 @@ int therver_shutdown(therver_t *th) {
     }
     return -1; /* invalid th */
 }
+
+void therver_stop(therver_t *th) {
+    if (th) {
+	th->draining = 1;
+	while (th->accepting)
+	    usleep(1000);
+    }
+}
+
+int therver_drain(therver_t *th, int timeout_ms) {
+    int pending = 0, waited = 0;
+    if (!th)
+	return -1;
+    therver_stop(th);
+    while (waited < timeout_ms) {
+	qentry_t *me;
+	pending = 0;
+	pthread_mutex_lock(&th->pool_mutex);
+	for (me = th->root.next; me && me != &th->root; me = me->next)
+	    pending++;
+	for (me = th->busy.next; me && me != &th->busy; me = me->next)
+	    pending++;
+	pthread_mutex_unlock(&th->pool_mutex);
+	if (!pending)
+	    break;
+	usleep(10000);
+	waited += 10;
+    }
+    therver_shutdown(th);
+    return pending;
+}
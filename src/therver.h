@@ -26,9 +26,29 @@ typedef struct therver_s therver_t;
    Returns non-zero for errors. */
 therver_t *therver(const char *host, int port, int max_threads, process_fn_t process_fn);
 
-/* shuts down the therver, the handle may no longer be used. */
+/* binds host/port and listens, returns the socket or -1 on error */
+int therver_listen(const char *host, int port);
+
+/* same as therver() but accepts connections on the listening
+   socket ss (e.g., from therver_listen()) which is closed once
+   the therver is shut down. Note that forked children close the
+   sockets of all thervers, but not sockets that are only bound. */
+therver_t *therver_socket(int ss, int max_threads, process_fn_t process_fn);
+
+/* shuts down the therver (it stops accepting connections within
+   0.1s), the handle may no longer be used. */
 int therver_shutdown(therver_t *th);
 
+/* stops accepting connections (pending connections are left to other
+   processes listening on the same socket) and returns once no more
+   connections are accepted, those accepted so far are still served */
+void therver_stop(therver_t *th);
+
+/* therver_stop(), then waits until all accepted connections
+   are served (but at most timeout_ms) and shuts down the therver.
+   Returns the number of connections that were still pending. */
+int therver_drain(therver_t *th, int timeout_ms);
+
 /* NOTE: To avoid threading issues, thervers are never actually
    released. They can be asked to shut down, but the resources
    associated with a therver are possibly never released in case
@@ -0,0 +1,862 @@
+/* write-ahead log of the object store
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+SEXP C_wal(SEXP sStat, SEXP sDir, SEXP sMin, SEXP sCompact);
+
+   Once opened, every change of the store (put, removal, dropping a
+   namespace) is appended to the current log segment. The store does
+   that after releasing the shard lock of the key. Appending only
+   reserves the space of the record under wal_mutex, the record is
+   written at that position without holding any lock, so a large
+   payload doesn't hold up other writers. Records of a key can thus
+   end up in a different order than the changes, replay resolves
+   that by version (see below). Servers call wal_sync() before
+   acknowledging a change. Syncs are shared (group commit): the first
+   thread that needs a sync becomes the leader and syncs all records
+   written so far while the others wait for it, records appended in
+   the meantime are covered by the next leader. So there is only one
+   fdatasync() at a time, regardless of the number of writers. A sync
+   only covers records up to the first one still being written, since
+   replay stops at the first incomplete record.
+
+   Files in the log directory (<seq> is 16 hex digits):
+   <seq>.wal  - segment with the records since compaction <seq>
+   <seq>.snap - snapshot of all objects at compaction <seq>
+   Both are a header followed by records. Compaction starts a new
+   segment, writes all objects into a new snapshot (while the records
+   of new changes go to the new segment) and then removes the older
+   files. Since the snapshot overlaps with the new segment, records
+   are not ordered across files, so for each key the record with the
+   highest version wins. A removal has the version of the removed
+   object so it wins against it, dropping a namespace removes all its
+   objects of lower versions. A record is only valid if it is followed
+   by its trailer, so records torn by a crash are ignored.
+
+   Replay maps the newest snapshot and the segments since and puts
+   the winning objects into the store pointing into the maps (so
+   nothing is copied). Versions start over in each process, so the
+   highest replayed version is added to all versions logged after
+   that. Replay is followed by a compaction. Objects without payload
+   (R objects stored with SFS) are not durable, putting one removes
+   the key from the log. Evicted objects are not removed from the log.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "obj.h"
+#include "wal.h"
+
+#define WAL_MAGIC  "OSRVWAL1"
+#define WAL_ORDER  0x01020304
+#define WAL_REC    0x4c415752 /* record start */
+#define WAL_END    0x444e4557454e4452ULL /* record trailer */
+
+typedef struct wal_hdr_s {
+    char magic[8];
+    uint32_t order, res;
+    uint64_t seq;
+} wal_hdr_t;
+
+/* followed by the key (not terminated), payload, padding
+   to 8 bytes and the trailer */
+typedef struct wal_rec_s {
+    uint32_t magic;
+    uint16_t type, flags;
+    uint32_t klen, res;
+    uint64_t len, version, expires;
+} wal_rec_t;
+
+/* wal_rec_t.type */
+#define WAL_PUT  1
+#define WAL_DEL  2
+#define WAL_DROP 3 /* key is the namespace */
+
+/* wal_rec_t.flags */
+#define WAL_NS   0x01 /* key is <ns>/<key> of a namespace */
+
+#define WAL_PAD(X) (((X) + 7) & ~((uint64_t) 7))
+#define WAL_REC_SIZE(kl, len) (WAL_PAD(sizeof(wal_rec_t) + (kl) + (len)) + sizeof(uint64_t))
+
+/* record being written by wal_append(), linked on its stack */
+typedef struct wal_pending_s {
+    struct wal_pending_s *prev, *next;
+    uint64_t pos; /* position of the record */
+} wal_pending_t;
+
+/* all of the following is protected by wal_mutex */
+static pthread_mutex_t wal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+static int wal_on;          /* also read without the lock */
+static int wal_fd = -1, wal_err, wal_syncing, wal_compacting;
+static int wal_rotating;    /* no appends while set */
+static char *wal_dir;
+static uint64_t wal_seq;    /* sequence of the current segment */
+/* positions in the stream of all records (never reset), written
+   is the end of the last reserved record */
+static uint64_t wal_written, wal_synced;
+static uint64_t wal_seg_pos; /* position of the current segment */
+/* records being written, in the order of their positions */
+static wal_pending_t *wal_pending, *wal_pending_last;
+static uint64_t wal_since, wal_snap_len, wal_compact_min;
+static uint64_t wal_base;   /* added to versions (see above) */
+static uint64_t wal_records, wal_syncs, wal_compactions, wal_replayed;
+
+/* position after the last record appended by this thread */
+static __thread uint64_t wal_my_pos;
+
+static uint64_t wal_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *wal_path(uint64_t seq, const char *ext) {
+    size_t n = strlen(wal_dir) + 32;
+    char *fn = (char*) malloc(n);
+    if (fn)
+	snprintf(fn, n, "%s/%016llx.%s", wal_dir, (unsigned long long) seq, ext);
+    return fn;
+}
+
+/* makes new names in the directory durable */
+static int wal_sync_dir() {
+    int fd = open(wal_dir, O_RDONLY), res;
+    if (fd == -1)
+	return -1;
+    res = fsync(fd);
+    close(fd);
+    return res;
+}
+
+/* writes all of iov at off or at the current position if off < 0 */
+static int wal_writev_all(int fd, struct iovec *iov, int n, off_t off) {
+    while (n) {
+	ssize_t w = (off < 0) ? writev(fd, iov, n) : pwritev(fd, iov, n, off);
+	if (w < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (off >= 0)
+	    off += w;
+	while (n && w >= (ssize_t) iov->iov_len) {
+	    w -= iov->iov_len;
+	    iov++;
+	    n--;
+	}
+	if (n) {
+	    iov->iov_base = ((char*) iov->iov_base) + w;
+	    iov->iov_len -= w;
+	}
+    }
+    return 0;
+}
+
+/* fills iov (4 entries) for a record, tail must have space for
+   16 bytes. Returns the size of the record. */
+static uint64_t wal_rec_iov(struct iovec *iov, wal_rec_t *r, char *tail, int type, int flags,
+			    const char *key, const void *data, uint64_t len,
+			    uint64_t version, uint64_t expires) {
+    size_t kl = strlen(key);
+    uint64_t size = WAL_REC_SIZE(kl, len), end = WAL_END;
+    size_t pad = (size_t) (size - sizeof(uint64_t) - sizeof(wal_rec_t) - kl - len);
+    memset(r, 0, sizeof(wal_rec_t));
+    r->magic = WAL_REC;
+    r->type = type;
+    r->flags = flags;
+    r->klen = (uint32_t) kl;
+    r->len = len;
+    r->version = version;
+    r->expires = expires;
+    memset(tail, 0, pad);
+    memcpy(tail + pad, &end, sizeof(end));
+    iov[0].iov_base = r;
+    iov[0].iov_len = sizeof(wal_rec_t);
+    iov[1].iov_base = (void*) key;
+    iov[1].iov_len = kl;
+    iov[2].iov_base = (void*) data;
+    iov[2].iov_len = data ? len : 0;
+    iov[3].iov_base = tail;
+    iov[3].iov_len = pad + sizeof(end);
+    return size;
+}
+
+/* reserves the space of the record under the lock and writes it
+   without holding the lock */
+static void wal_append(int type, int flags, const char *key, const void *data, uint64_t len,
+		       uint64_t version, uint64_t expires) {
+    struct iovec iov[4];
+    wal_rec_t r;
+    wal_pending_t pend;
+    char tail[16];
+    uint64_t size, off;
+    int fd, err = 0;
+    if (!__atomic_load_n(&wal_on, __ATOMIC_ACQUIRE))
+	return;
+    if (!data)
+	len = 0;
+    size = wal_rec_iov(iov, &r, tail, type, flags, key, data, len, version + wal_base, expires);
+    pthread_mutex_lock(&wal_mutex);
+    while (wal_rotating)
+	pthread_cond_wait(&wal_cond, &wal_mutex);
+    if (wal_fd == -1 || wal_err) {
+	pthread_mutex_unlock(&wal_mutex);
+	return;
+    }
+    fd = wal_fd;
+    off = sizeof(wal_hdr_t) + wal_written - wal_seg_pos;
+    pend.pos = wal_written;
+    pend.next = 0;
+    if ((pend.prev = wal_pending_last))
+	wal_pending_last->next = &pend;
+    else
+	wal_pending = &pend;
+    wal_pending_last = &pend;
+    wal_written += size;
+    wal_since += size;
+    wal_records++;
+    wal_my_pos = wal_written;
+    pthread_mutex_unlock(&wal_mutex);
+
+    if (wal_writev_all(fd, iov, 4, (off_t) off))
+	err = errno ? errno : EIO;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (err && !wal_err)
+	wal_err = err;
+    if (pend.next)
+	pend.next->prev = pend.prev;
+    else
+	wal_pending_last = pend.prev;
+    if (pend.prev)
+	pend.prev->next = pend.next;
+    else { /* the first one, syncs can cover more now */
+	wal_pending = pend.next;
+	pthread_cond_broadcast(&wal_cond);
+    }
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+/* waits until all reserved records are written, new appends wait
+   until wal_rotating is cleared. Must be called with wal_mutex held. */
+static void wal_drain() {
+    wal_rotating = 1;
+    while (wal_pending || wal_syncing)
+	pthread_cond_wait(&wal_cond, &wal_mutex);
+}
+
+void wal_put(const char *key, int ns, const void *data, uint64_t len,
+	     uint64_t version, uint64_t expires) {
+    wal_append(WAL_PUT, ns ? WAL_NS : 0, key, data ? data : "", len, version, expires);
+}
+
+void wal_del(const char *key, int ns, uint64_t version) {
+    wal_append(WAL_DEL, ns ? WAL_NS : 0, key, 0, 0, version, 0);
+}
+
+void wal_drop(const char *name, uint64_t version) {
+    wal_append(WAL_DROP, 0, name, 0, 0, version, 0);
+}
+
+static void *wal_compact_thread(void *arg);
+
+int wal_sync() {
+    uint64_t pos = wal_my_pos;
+    int res, compact;
+    pthread_mutex_lock(&wal_mutex);
+    while (!wal_err && wal_synced < pos && wal_fd != -1) {
+	/* records before the first one being written are complete */
+	uint64_t target = wal_pending ? wal_pending->pos : wal_written;
+	if (wal_syncing || target < pos)
+	    pthread_cond_wait(&wal_cond, &wal_mutex);
+	else { /* we are the leader */
+	    int fd = wal_fd, r;
+	    wal_syncing = 1;
+	    pthread_mutex_unlock(&wal_mutex);
+	    r = fdatasync(fd);
+	    pthread_mutex_lock(&wal_mutex);
+	    wal_syncing = 0;
+	    if (r)
+		wal_err = errno;
+	    else {
+		if (target > wal_synced)
+		    wal_synced = target;
+		wal_syncs++;
+	    }
+	    pthread_cond_broadcast(&wal_cond);
+	}
+    }
+    res = (wal_err || (wal_synced < pos && !wal_on)) ? -1 : 0;
+    if ((compact = (wal_on && !wal_compacting && wal_since >= wal_compact_min &&
+		    wal_since >= 2 * wal_snap_len)))
+	wal_compacting = 1;
+    pthread_mutex_unlock(&wal_mutex);
+    if (compact) {
+	pthread_t thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, wal_compact_thread, 0)) {
+	    pthread_mutex_lock(&wal_mutex);
+	    wal_compacting = 0;
+	    pthread_cond_broadcast(&wal_cond);
+	    pthread_mutex_unlock(&wal_mutex);
+	}
+	pthread_attr_destroy(&attr);
+    }
+    return res;
+}
+
+/* starts segment seq, the current one is synced and closed.
+   Must be called with wal_mutex held. */
+static int wal_rotate(uint64_t seq) {
+    wal_hdr_t hdr;
+    char *fn;
+    int fd, res = -1;
+    wal_drain();
+    if (!(fn = wal_path(seq, "wal")))
+	goto done;
+    /* records are written at their positions */
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    free(fn);
+    if (fd == -1)
+	goto done;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.order = WAL_ORDER;
+    hdr.seq = seq;
+    if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || wal_sync_dir()) {
+	close(fd);
+	goto done;
+    }
+    if (wal_fd != -1) {
+	if (fdatasync(wal_fd)) {
+	    close(fd);
+	    goto done;
+	}
+	close(wal_fd);
+	wal_synced = wal_written;
+    }
+    wal_fd = fd;
+    wal_seq = seq;
+    wal_seg_pos = wal_written;
+    res = 0;
+ done:
+    wal_rotating = 0;
+    pthread_cond_broadcast(&wal_cond);
+    return res;
+}
+
+/* --- snapshot --- */
+
+typedef struct wal_snap_s {
+    int fd, err;
+    uint64_t len;
+    char *buf;
+    size_t bpos;
+} wal_snap_t;
+
+#define WAL_SNAP_BUF (1024*1024)
+
+static int wal_snap_flush(wal_snap_t *s) {
+    size_t pos = 0;
+    while (pos < s->bpos) {
+	ssize_t n = write(s->fd, s->buf + pos, s->bpos - pos);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	pos += n;
+    }
+    s->bpos = 0;
+    return 0;
+}
+
+/* called inside a read section, so no R API */
+static int wal_snap_entry(const char *key, obj_entry_t *e, int flags, void *arg) {
+    wal_snap_t *s = (wal_snap_t*) arg;
+    struct iovec iov[4];
+    wal_rec_t r;
+    char tail[16];
+    uint64_t size, exp;
+    int i;
+    if (!e->obj) /* R objects are not logged */
+	return 0;
+    exp = obj_expiry(e);
+    size = wal_rec_iov(iov, &r, tail, WAL_PUT, (flags & OBJ_ITER_NS) ? WAL_NS : 0,
+		       key, e->obj, e->len, e->version + wal_base, exp);
+    if (size > WAL_SNAP_BUF - s->bpos) {
+	if (wal_snap_flush(s))
+	    return -1;
+	/* large records are written directly */
+	if (size > WAL_SNAP_BUF) {
+	    obj_will_read(e, 0, e->len);
+	    if (wal_writev_all(s->fd, iov, 4, -1))
+		return -1;
+	    s->len += size;
+	    return 0;
+	}
+    }
+    for (i = 0; i < 4; i++) {
+	memcpy(s->buf + s->bpos, iov[i].iov_base, iov[i].iov_len);
+	s->bpos += iov[i].iov_len;
+    }
+    s->len += size;
+    return 0;
+}
+
+/* writes <seq>.snap with all objects in the store */
+static int wal_write_snap(uint64_t seq, uint64_t *len) {
+    char *fn = wal_path(seq, "snap"), *tmp = wal_path(seq, "snap.tmp");
+    wal_hdr_t hdr;
+    wal_snap_t s;
+    int res = -1;
+    memset(&s, 0, sizeof(s));
+    if (!fn || !tmp || !(s.buf = (char*) malloc(WAL_SNAP_BUF)))
+	goto done;
+    if ((s.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+	goto done;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, WAL_MAGIC, sizeof(hdr.magic));
+    hdr.order = WAL_ORDER;
+    hdr.seq = seq;
+    memcpy(s.buf, &hdr, sizeof(hdr));
+    s.bpos = sizeof(hdr);
+    if (obj_foreach(wal_snap_entry, &s) || wal_snap_flush(&s) || fdatasync(s.fd)) {
+	close(s.fd);
+	unlink(tmp);
+	goto done;
+    }
+    close(s.fd);
+    /* the snapshot only counts once complete */
+    if (rename(tmp, fn) || wal_sync_dir()) {
+	unlink(tmp);
+	goto done;
+    }
+    *len = s.len;
+    res = 0;
+ done:
+    free(s.buf);
+    free(fn);
+    free(tmp);
+    return res;
+}
+
+/* parses <seq>.<ext>, returns 0 if the name doesn't match */
+static int wal_name(const char *name, uint64_t *seq, const char *ext) {
+    unsigned long long s;
+    char e[8];
+    int n = 0;
+    if (sscanf(name, "%16llx.%7[a-z]%n", &s, e, &n) != 2 || name[n] || strcmp(e, ext))
+	return 0;
+    *seq = (uint64_t) s;
+    return 1;
+}
+
+/* removes all files older than seq */
+static void wal_remove_old(uint64_t seq) {
+    DIR *d = opendir(wal_dir);
+    struct dirent *de;
+    if (!d)
+	return;
+    while ((de = readdir(d))) {
+	uint64_t s;
+	if ((wal_name(de->d_name, &s, "wal") || wal_name(de->d_name, &s, "snap")) && s < seq) {
+	    char *fn = (char*) malloc(strlen(wal_dir) + strlen(de->d_name) + 2);
+	    if (fn) {
+		sprintf(fn, "%s/%s", wal_dir, de->d_name);
+		unlink(fn);
+		free(fn);
+	    }
+	}
+    }
+    closedir(d);
+}
+
+/* caller must have set wal_compacting */
+static int wal_compact_() {
+    uint64_t seq, len = 0;
+    int res;
+    pthread_mutex_lock(&wal_mutex);
+    seq = wal_seq + 1;
+    /* new changes go to the new segment, everything before
+       is in the store by now, so it will be in the snapshot */
+    if (!(res = wal_rotate(seq)))
+	wal_since = 0;
+    pthread_mutex_unlock(&wal_mutex);
+    if (!res && !(res = wal_write_snap(seq, &len)))
+	wal_remove_old(seq);
+    pthread_mutex_lock(&wal_mutex);
+    wal_compacting = 0;
+    if (!res) {
+	wal_snap_len = len;
+	wal_compactions++;
+    }
+    pthread_cond_broadcast(&wal_cond);
+    pthread_mutex_unlock(&wal_mutex);
+    return res;
+}
+
+static void *wal_compact_thread(void *arg) {
+    wal_compact_();
+    return 0;
+}
+
+int wal_compact() {
+    int busy;
+    pthread_mutex_lock(&wal_mutex);
+    if (!(busy = (!wal_on || wal_compacting)))
+	wal_compacting = 1;
+    pthread_mutex_unlock(&wal_mutex);
+    return busy ? 0 : wal_compact_();
+}
+
+/* --- replay --- */
+
+/* winning record of a key */
+typedef struct wal_win_s {
+    const char *key; /* points into the map */
+    uint32_t klen;
+    uint16_t type, flags;
+    uint64_t version, expires, len;
+    const char *data;
+} wal_win_t;
+
+typedef struct wal_replay_s {
+    wal_win_t *tab;
+    size_t size, used; /* size is a power of 2 */
+    wal_win_t *drops;  /* namespaces with their highest drop version */
+    size_t ndrops, cdrops;
+    uint64_t max_version;
+} wal_replay_t;
+
+/* FNV-1a */
+static uint64_t wal_hash(const char *key, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--)
+	h = (h ^ (unsigned char) *(key++)) * 0x100000001b3ULL;
+    return h;
+}
+
+static wal_win_t *wal_slot(wal_win_t *tab, size_t size, const char *key, size_t kl) {
+    size_t i = wal_hash(key, kl) & (size - 1);
+    while (tab[i].key && (tab[i].klen != kl || memcmp(tab[i].key, key, kl)))
+	i = (i + 1) & (size - 1);
+    return &tab[i];
+}
+
+static int wal_win(wal_replay_t *rp, wal_rec_t *r, const char *key, const char *data) {
+    wal_win_t *w;
+    if (r->version > rp->max_version)
+	rp->max_version = r->version;
+    if (r->type == WAL_DROP) {
+	size_t i;
+	for (i = 0; i < rp->ndrops; i++)
+	    if (rp->drops[i].klen == r->klen && !memcmp(rp->drops[i].key, key, r->klen))
+		break;
+	if (i == rp->ndrops) {
+	    if (rp->ndrops == rp->cdrops) {
+		size_t nc = rp->cdrops ? rp->cdrops * 2 : 16;
+		wal_win_t *nd = (wal_win_t*) realloc(rp->drops, nc * sizeof(wal_win_t));
+		if (!nd)
+		    return -1;
+		rp->drops = nd;
+		rp->cdrops = nc;
+	    }
+	    rp->drops[i].key = key;
+	    rp->drops[i].klen = r->klen;
+	    rp->drops[i].version = 0;
+	    rp->ndrops++;
+	}
+	if (r->version > rp->drops[i].version)
+	    rp->drops[i].version = r->version;
+	return 0;
+    }
+    if ((rp->used + 1) * 4 > rp->size * 3) {
+	size_t ns = rp->size ? rp->size * 2 : 1024, i;
+	wal_win_t *nt = (wal_win_t*) calloc(ns, sizeof(wal_win_t));
+	if (!nt)
+	    return -1;
+	for (i = 0; i < rp->size; i++)
+	    if (rp->tab[i].key)
+		*wal_slot(nt, ns, rp->tab[i].key, rp->tab[i].klen) = rp->tab[i];
+	free(rp->tab);
+	rp->tab = nt;
+	rp->size = ns;
+    }
+    w = wal_slot(rp->tab, rp->size, key, r->klen);
+    if (!w->key)
+	rp->used++;
+    /* a removal wins against the object it removed */
+    else if (r->version < w->version || (r->version == w->version && w->type == WAL_DEL))
+	return 0;
+    w->key = key;
+    w->klen = r->klen;
+    w->type = r->type;
+    w->flags = r->flags;
+    w->version = r->version;
+    w->expires = r->expires;
+    w->len = r->len;
+    w->data = data;
+    return 0;
+}
+
+/* a mapped log file */
+typedef struct wal_file_s {
+    obj_map_t *map;
+    char *addr;
+    size_t len;
+} wal_file_t;
+
+/* maps the file and collects its records, returns 0 on success */
+static int wal_scan(wal_replay_t *rp, uint64_t seq, const char *ext, wal_file_t *f) {
+    char *fn = wal_path(seq, ext), *m, *p, *end;
+    struct stat st;
+    int fd;
+    if (!fn)
+	return -1;
+    fd = open(fn, O_RDONLY);
+    free(fn);
+    if (fd == -1)
+	return -1;
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(wal_hdr_t)) {
+	close(fd);
+	return -1;
+    }
+    m = (char*) mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+	return -1;
+    if (memcmp(((wal_hdr_t*) m)->magic, WAL_MAGIC, 8) || ((wal_hdr_t*) m)->order != WAL_ORDER ||
+	!(f->map = obj_map_new(m, st.st_size))) {
+	munmap(m, st.st_size);
+	return -1;
+    }
+    f->addr = m;
+    f->len = st.st_size;
+    p = m + sizeof(wal_hdr_t);
+    end = m + st.st_size;
+    /* stop at the first incomplete record (torn by a crash) */
+    while ((size_t) (end - p) >= sizeof(wal_rec_t) + sizeof(uint64_t)) {
+	wal_rec_t *r = (wal_rec_t*) p;
+	uint64_t size, tr;
+	if (r->magic != WAL_REC || r->len > (uint64_t) (end - p) ||
+	    r->klen > (uint64_t) (end - p) ||
+	    (size = WAL_REC_SIZE(r->klen, r->len)) > (uint64_t) (end - p))
+	    break;
+	memcpy(&tr, p + size - sizeof(tr), sizeof(tr));
+	if (tr != WAL_END || !r->klen ||
+	    wal_win(rp, r, p + sizeof(wal_rec_t), p + sizeof(wal_rec_t) + r->klen))
+	    break;
+	p += size;
+    }
+    return 0;
+}
+
+/* puts the winning objects into the store, returns their number */
+static long wal_apply(wal_replay_t *rp, wal_file_t *files, int nf) {
+    uint64_t now = wal_now();
+    char *key = 0;
+    size_t kcap = 0, i, j;
+    long n = 0;
+    for (i = 0; i < rp->size; i++) {
+	wal_win_t *w = &rp->tab[i];
+	const char *sl;
+	int f;
+	if (!w->key || w->type != WAL_PUT || (w->expires && w->expires <= now))
+	    continue;
+	if (w->klen + 1 > kcap) {
+	    char *nk = (char*) realloc(key, kcap = w->klen * 2 + 64);
+	    if (!nk)
+		break;
+	    key = nk;
+	}
+	memcpy(key, w->key, w->klen);
+	key[w->klen] = 0;
+	if ((w->flags & WAL_NS) && (sl = strchr(key, '/'))) {
+	    size_t nl = sl - key;
+	    /* dropped after this version? */
+	    for (j = 0; j < rp->ndrops; j++)
+		if (rp->drops[j].klen == nl && !memcmp(rp->drops[j].key, key, nl))
+		    break;
+	    if (j < rp->ndrops && rp->drops[j].version >= w->version)
+		continue;
+	    key[nl] = 0;
+	    obj_ns_create(key);
+	    key[nl] = '/';
+	}
+	for (f = 0; f < nf; f++)
+	    if (w->data >= files[f].addr && w->data < files[f].addr + files[f].len)
+		break;
+	if (f < nf && obj_put_map(key, (void*) w->data, w->len, files[f].map,
+				  w->expires ? w->expires - now : 0))
+	    n++;
+    }
+    free(key);
+    return n;
+}
+
+long wal_open(const char *dir, size_t compact_min) {
+    wal_replay_t rp;
+    wal_file_t *files = 0;
+    uint64_t snap = 0, last = 0, s;
+    int have_snap = 0, nf = 0, cf = 0, is_snap, i;
+    long n = -1;
+    DIR *d;
+    struct dirent *de;
+
+    pthread_mutex_lock(&wal_mutex);
+    if (wal_on || wal_compacting) {
+	pthread_mutex_unlock(&wal_mutex);
+	errno = EBUSY;
+	return -1;
+    }
+    free(wal_dir);
+    wal_dir = strdup(dir);
+    pthread_mutex_unlock(&wal_mutex);
+    if (!wal_dir || (mkdir(dir, 0777) && errno != EEXIST) || !(d = opendir(dir)))
+	return -1;
+    while ((de = readdir(d))) {
+	if (wal_name(de->d_name, &s, "snap") && (!have_snap || s > snap)) {
+	    snap = s;
+	    have_snap = 1;
+	}
+	if ((wal_name(de->d_name, &s, "snap") || wal_name(de->d_name, &s, "wal")) && s > last)
+	    last = s;
+    }
+    /* the newest snapshot and the segments since */
+    memset(&rp, 0, sizeof(rp));
+    rewinddir(d);
+    while ((de = readdir(d))) {
+	if (!((is_snap = wal_name(de->d_name, &s, "snap")) || wal_name(de->d_name, &s, "wal")) ||
+	    s < snap || (is_snap && s != snap))
+	    continue;
+	if (nf == cf) {
+	    wal_file_t *nfs = (wal_file_t*) realloc(files, (cf = cf ? cf * 2 : 16) * sizeof(wal_file_t));
+	    if (!nfs)
+		goto done;
+	    files = nfs;
+	}
+	/* unreadable files are skipped */
+	if (!wal_scan(&rp, s, is_snap ? "snap" : "wal", &files[nf]))
+	    nf++;
+    }
+    n = wal_apply(&rp, files, nf);
+
+ done:
+    closedir(d);
+    /* entries hold their own references */
+    for (i = 0; i < nf; i++)
+	obj_map_release(files[i].map);
+    free(files);
+    free(rp.tab);
+    free(rp.drops);
+    if (n < 0)
+	return -1;
+
+    pthread_mutex_lock(&wal_mutex);
+    /* positions are never reset, threads may still hold them */
+    wal_since = wal_snap_len = 0;
+    wal_base = rp.max_version;
+    wal_records = wal_syncs = wal_compactions = 0;
+    wal_replayed = n;
+    wal_compact_min = compact_min;
+    wal_err = 0;
+    if (wal_rotate(last + 1)) {
+	pthread_mutex_unlock(&wal_mutex);
+	return -1;
+    }
+    wal_compacting = 1;
+    __atomic_store_n(&wal_on, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&wal_mutex);
+    /* the replayed files are replaced by a snapshot right away */
+    if (wal_compact_()) {
+	wal_close();
+	return -1;
+    }
+    return n;
+}
+
+void wal_close() {
+    pthread_mutex_lock(&wal_mutex);
+    __atomic_store_n(&wal_on, 0, __ATOMIC_RELEASE);
+    while (wal_syncing || wal_compacting)
+	pthread_cond_wait(&wal_cond, &wal_mutex);
+    wal_drain();
+    if (wal_fd != -1) {
+	fdatasync(wal_fd);
+	close(wal_fd);
+	wal_fd = -1;
+	wal_synced = wal_written;
+    }
+    wal_rotating = 0;
+    pthread_cond_broadcast(&wal_cond);
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+void wal_stat(wal_stat_t *st) {
+    pthread_mutex_lock(&wal_mutex);
+    st->on = wal_on;
+    st->records = wal_records;
+    st->bytes = wal_since;
+    st->syncs = wal_syncs;
+    st->compactions = wal_compactions;
+    st->replayed = wal_replayed;
+    st->snap_len = wal_snap_len;
+    pthread_mutex_unlock(&wal_mutex);
+}
+
+SEXP C_wal(SEXP sStat, SEXP sDir, SEXP sMin, SEXP sCompact) {
+    wal_stat_t ws;
+    SEXP res, nam;
+    obj_init();
+    if (!asLogical(sStat)) {
+	if (sDir == R_NilValue)
+	    wal_close();
+	else {
+	    double min = asReal(sMin);
+	    if (TYPEOF(sDir) != STRSXP || LENGTH(sDir) != 1)
+		Rf_error("Invalid directory, must be a string or NULL");
+	    if (ISNAN(min) || min < 0)
+		Rf_error("Invalid minimal compaction size");
+	    obj_gc();
+	    if (wal_open(CHAR(STRING_ELT(sDir, 0)), (size_t) min) < 0)
+		Rf_error("Unable to open log in '%s': %s", CHAR(STRING_ELT(sDir, 0)),
+			 strerror(errno));
+	}
+    }
+    if (asLogical(sCompact) == 1 && wal_compact())
+	Rf_error("Compaction failed: %s", strerror(errno));
+    wal_stat(&ws);
+    {
+	const char *names[] = { "on", "records", "bytes", "syncs", "compactions",
+				"replayed", "snapshot" };
+	double val[] = { ws.on, ws.records, ws.bytes, ws.syncs, ws.compactions,
+			 ws.replayed, ws.snap_len };
+	int i, n = sizeof(names) / sizeof(names[0]);
+	res = PROTECT(allocVector(VECSXP, n));
+	nam = allocVector(STRSXP, n);
+	setAttrib(res, R_NamesSymbol, nam);
+	for (i = 0; i < n; i++) {
+	    SET_STRING_ELT(nam, i, mkChar(names[i]));
+	    SET_VECTOR_ELT(res, i, (i == 0) ? ScalarLogical(ws.on) : ScalarReal(val[i]));
+	}
+    }
+    UNPROTECT(1);
+    return res;
+}
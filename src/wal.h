@@ -0,0 +1,55 @@
+/* write-ahead log of the object store
+
+   Author and (c) Simon Urbanek <urbanek@R-project.org>
+   License: MIT
+
+   The store appends a record for each change (see obj.c), so the
+   functions below are no-ops unless the log has been opened.
+   Servers call wal_sync() before acknowledging a change.
+*/
+
+#ifndef OSRV_WAL_H_
+#define OSRV_WAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* replays the log in dir (created if needed) into the store and
+   starts logging. Compaction runs once the log has grown by at least
+   compact_min bytes and twice the size of the last snapshot.
+   Returns the number of replayed objects or -1 on error (errno). */
+long wal_open(const char *dir, size_t compact_min);
+/* syncs and stops logging */
+void wal_close();
+
+/* records, called by the store after the change without holding
+   any locks (the payload is written without wal_mutex).
+   key is the full key, ns is set if it is in a namespace, expires
+   is the wall time in ms (0 = never) */
+void wal_put(const char *key, int ns, const void *data, uint64_t len,
+	     uint64_t version, uint64_t expires);
+/* key was removed (or replaced by an object without payload)
+   at version */
+void wal_del(const char *key, int ns, uint64_t version);
+/* namespace was dropped, version is the last assigned version */
+void wal_drop(const char *name, uint64_t version);
+
+/* waits until all records appended by this thread are on disk
+   (syncs are shared by concurrent threads). Returns 0 on success,
+   -1 if the log cannot be written. */
+int wal_sync();
+
+/* writes a new snapshot and removes the records it covers,
+   returns 0 on success (or if already compacting) */
+int wal_compact();
+
+typedef struct wal_stat_s {
+    int on;
+    uint64_t records, bytes; /* appended (bytes since the last compaction) */
+    uint64_t syncs, compactions, replayed;
+    uint64_t snap_len;       /* size of the last snapshot */
+} wal_stat_t;
+
+void wal_stat(wal_stat_t *st);
+
+#endif